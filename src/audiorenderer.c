@@ -13,23 +13,31 @@ typedef struct _AudioRenderer {
 
 typedef void (*AudioRendererConsumer)(void *userData, Uint8 *stream, int len);
 
-AudioRenderer *audiorenderer_init(char *fileName) {
+/** Samples rendered per call to the synth, whole blocks so that the output matches playback */
+#define AUDIORENDERER_BUFFER_SAMPLES (16 * SYNTH_BLOCK_SIZE)
+
+AudioRenderer *audiorenderer_init(char *fileName, Uint8 channels, Uint32 sampleRate, bool floatOutput) {
     AudioRenderer *renderer = calloc(1, sizeof(AudioRenderer));
-    renderer->synth = synth_init(TRACKS_PER_PATTERN, false, NULL, NULL);
+    SynthSettings settings = {
+        .channels = channels,
+        .sampleRate = sampleRate,
+        .floatOutput = floatOutput
+    };
+    renderer->synth = synth_init(&settings);
     if (renderer->synth == NULL) {
         audiorenderer_close(renderer);
         fprintf(stderr, "Audiorenderer: Failed to initialize synth\n");
         return NULL;
     }
     printf("Audiorenderer: Synth initialized\n");
-    renderer->player = player_init(renderer->synth, TRACKS_PER_PATTERN);
+    renderer->player = player_init(renderer->synth, channels);
     if (renderer->player == NULL) {
         audiorenderer_close(renderer);
         fprintf(stderr, "Audiorenderer: Failed to initialize player\n");
         return NULL;
     }
     printf("Audiorenderer: Player initialized\n");
-    renderer->wavSaver = wavSaver_init(fileName, synth_getSampleRate(renderer->synth));
+    renderer->wavSaver = wavSaver_init(fileName, synth_getSampleRate(renderer->synth), floatOutput);
     if (renderer->wavSaver == NULL) {
         audiorenderer_close(renderer);
         fprintf(stderr, "Audiorenderer: Failed to initialize WAV saver\n");
@@ -39,33 +47,46 @@ AudioRenderer *audiorenderer_init(char *fileName) {
 }
 
 void audiorenderer_renderSong(AudioRenderer *renderer, Song *song, Uint32 timeLimitInMs) {
-    Uint32 ms = 0;
     Player *player = renderer->player;
     Synth *synth = renderer->synth;
     int samplerate = synth_getSampleRate(synth);
+    int sampleSize = synth_getSampleSize(synth);
+    Uint32 limit = (Uint64)samplerate * timeLimitInMs / 1000;
+    Uint32 rendered = 0;
+    Uint8 *stream = calloc(AUDIORENDERER_BUFFER_SAMPLES, sampleSize);
 
     for (int i = 0; i < MAX_INSTRUMENTS; i++) {
         synth_loadPatch(synth, i, &song->instruments[i]);
     }
 
+    synth_setNoiseSeed(synth, SYNTH_DEFAULT_NOISE_SEED);
     player_reset(player, song, 0);
     fprintf(stderr, "Audiorenderer: Beginrender song\n");
 
-    while (!player_isEndReached(player) && ms < timeLimitInMs) {
-        Uint32 interval = player_processSong(0, player);
-        Uint32 samples = samplerate * interval/1000;
-        printf("%02d:%02d: Render %d ms = %d samples\n", ms/60000, (ms/1000)%60, interval, samples);
-
-        Uint8 *stream = calloc(samples, sizeof(Uint16));
-        synth_processBuffer(synth, stream, samples*2);
-
-        Sint16 *buffer = (Sint16*)stream;
-        wavSaver_consume(renderer->wavSaver, buffer, samples);
-
-        free(stream);
+    // The player runs as the sequencer of the synth, exactly as during playback
+    player_play(player);
+    while (rendered < limit) {
+        Uint32 samples = limit - rendered < AUDIORENDERER_BUFFER_SAMPLES ? limit - rendered : AUDIORENDERER_BUFFER_SAMPLES;
+        synth_processBuffer(synth, stream, samples * sampleSize);
+        bool last = player_isEndReached(player) && rendered + samples >= player_getEndPosition(player);
+        if (last) {
+            // Stop where the row that reached the end of the song finishes
+            samples = player_getEndPosition(player) - rendered;
+        }
 
-        ms += interval;
+        if (sampleSize == sizeof(float)) {
+            wavSaver_consumeFloat(renderer->wavSaver, (float*)stream, samples);
+        } else {
+            wavSaver_consume(renderer->wavSaver, (Sint16*)stream, samples);
+        }
+        rendered += samples;
+        if (last) {
+            break;
+        }
     }
+    player_stop(player);
+    free(stream);
+    printf("%02d:%02d: Rendered %d samples\n", rendered / samplerate / 60, (rendered / samplerate) % 60, rendered);
 }
 
 void audiorenderer_close(AudioRenderer *renderer) {
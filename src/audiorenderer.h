@@ -1,14 +1,17 @@
 #ifndef AUDIORENDERER_H_
 #define AUDIORENDERER_H_
 
+#include <stdbool.h>
 #include "song.h"
 
 typedef struct _AudioRenderer AudioRenderer;
 
 /**
- * Initialize audio renderer
+ * Initialize audio renderer for songs with the given number of tracks at
+ * sampleRate Hz, 0 for the synth default. With floatOutput the song is
+ * mixed in floating point and saved as 32 bit float samples.
  */
-AudioRenderer *audiorenderer_init(char *fileName);
+AudioRenderer *audiorenderer_init(char *fileName, Uint8 channels, Uint32 sampleRate, bool floatOutput);
 
 /**
  * Render song to audio file
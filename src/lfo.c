@@ -0,0 +1,78 @@
+#include <math.h>
+#include <stdio.h>
+
+#include "lfo.h"
+#include "synth_tables.h"
+
+/**
+ * Shape value between -32767 and 32767 at a phase of 1/2^32 cycle. The sine
+ * is interpolated from the quarter sine table, which is plenty for an
+ * oscillator that is only sampled once per control period.
+ */
+Sint16 _lfo_getShape(LfoShape shape, Uint32 phase) {
+    switch (shape) {
+    case LFO_SINE:
+    default: {
+        const int shift = 30 - QUARTER_SINE_TABLE_BITS;
+        Uint32 quarterPos = phase & 0x3FFFFFFF;
+        if (phase & 0x40000000) {
+            quarterPos = 0x40000000 - quarterPos;
+        }
+        Uint32 index = quarterPos >> shift;
+        Sint32 weight = (quarterPos >> (shift - 8)) & 0xFF;
+        const Sint16 *table = synthTables_quarterSine;
+        Sint16 value = table[index] + (((table[index + 1] - table[index]) * weight) >> 8);
+        return (phase & 0x80000000) ? -value : value;
+    }
+    }
+}
+
+Uint32 lfo_getStep(Uint32 frequency, Uint32 sampleRate) {
+    return (((Uint64)frequency << 16) + sampleRate / 2) / sampleRate;
+}
+
+void lfo_reset(Lfo *lfo) {
+    lfo->phase = 0;
+    lfo->value = 0;
+    lfo->slope = 0;
+}
+
+void lfo_advance(Lfo *lfo, int length) {
+    Sint32 start = _lfo_getShape(lfo->shape, lfo->phase);
+    lfo->phase += lfo->step * length;
+    Sint32 end = _lfo_getShape(lfo->shape, lfo->phase);
+    lfo->value = start * 65536;
+    lfo->slope = (Sint64)(end - start) * 65536 / length;
+}
+
+Sint16 lfo_getValue(const Lfo *lfo, int offset) {
+    return (lfo->value + lfo->slope * offset) >> 16;
+}
+
+void lfo_test() {
+    Uint32 frequencies[] = {1 << 16, 4 << 16, 16 << 16, 255 << 16};
+    Uint32 sampleRate = 48000;
+    int period = 16;
+
+    printf("======================TEST OF LFO========================\n");
+    for (int f = 0; f < 4; f++) {
+        Lfo lfo = {.shape = LFO_SINE, .step = lfo_getStep(frequencies[f], sampleRate)};
+        double frequencyError = fabs((double)lfo.step * sampleRate / 4294967296.0 - frequencies[f] / 65536.0);
+        int maxError = 0;
+        lfo_reset(&lfo);
+        for (int pos = 0; pos < (int)sampleRate; pos += period) {
+            Uint32 phase = lfo.phase;
+            lfo_advance(&lfo, period);
+            for (int i = 0; i < period; i++) {
+                double exact = 32767 * sin(2 * M_PI * (Uint32)(phase + lfo.step * i) / 4294967296.0);
+                int error = abs(lfo_getValue(&lfo, i) - (int)lround(exact));
+                maxError = error > maxError ? error : maxError;
+            }
+        }
+        // Besides table rounding, linear interpolation misses the sine by its sagitta over one control period
+        int bound = 4 + (int)(32767 * (1 - cos(M_PI * frequencies[f] / 65536 * period / sampleRate)));
+        bool ok = frequencyError < 1e-3 && maxError <= bound;
+        printf("%3d Hz: frequency error %.6f Hz, max error %4d of %4d %s\n",
+                frequencies[f] >> 16, frequencyError, maxError, bound, ok ? "OK" : "FAIL");
+    }
+}
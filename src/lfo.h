@@ -0,0 +1,54 @@
+#ifndef LFO_H_
+#define LFO_H_
+
+#include <SDL2/SDL.h>
+
+/*
+ * Low frequency oscillators for vibrato and tremolo. The phase is a free
+ * running accumulator that is advanced once per control period, and the
+ * output is interpolated linearly over the samples of the period.
+ */
+
+typedef enum {
+    LFO_SINE
+} LfoShape;
+
+typedef struct {
+    LfoShape shape;
+    /** Phase in 1/2^32 cycle and its increment per sample */
+    Uint32 phase;
+    Uint32 step;
+    /** Output at the start of the control period and its change per sample, 16 fractional bits */
+    Sint32 value;
+    Sint32 slope;
+} Lfo;
+
+/**
+ * Return the phase increment per sample for a frequency in 1/65536 Hz
+ */
+Uint32 lfo_getStep(Uint32 frequency, Uint32 sampleRate);
+
+/**
+ * Restart the oscillator at phase 0
+ */
+void lfo_reset(Lfo *lfo);
+
+/**
+ * Start a control period of length samples: set up the interpolation from
+ * the current phase to the phase at its end and move the phase there
+ */
+void lfo_advance(Lfo *lfo, int length);
+
+/**
+ * Return the output, between -32767 and 32767, offset samples into the
+ * current control period
+ */
+Sint16 lfo_getValue(const Lfo *lfo, int offset);
+
+/**
+ * Compare the interpolated output with an exact sine over one second for a
+ * number of frequencies and print the largest errors
+ */
+void lfo_test();
+
+#endif /* LFO_H_ */
@@ -2,8 +2,8 @@
 #include "pattern.h"
 #include "track.h"
 
-void pattern_clear(Pattern *pattern) {
-    for (int track = 0; track < TRACKS_PER_PATTERN; track++) {
+void pattern_clear(Pattern *pattern, Uint8 tracks) {
+    for (int track = 0; track < tracks; track++) {
         track_clear(&pattern->tracks[track]);
     }
 }
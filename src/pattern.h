@@ -3,13 +3,19 @@
 
 #include "track.h"
 
-#define TRACKS_PER_PATTERN 4
+/** Range of the number of tracks a song can have */
+#define MIN_TRACKS_PER_PATTERN 4
+#define MAX_TRACKS_PER_PATTERN 64
+
+/** Number of tracks in a new song */
+#define DEFAULT_TRACKS_PER_PATTERN 4
 
 typedef struct {
-    Track tracks[TRACKS_PER_PATTERN];
+    /** One track for each channel of the song, owned by the song */
+    Track *tracks;
 } Pattern;
 
-void pattern_clear(Pattern *pattern);
+void pattern_clear(Pattern *pattern, Uint8 tracks);
 
 
 #endif /* PATTERN_H_ */
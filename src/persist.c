@@ -15,9 +15,15 @@ bool persist_loadSongWithName(Song *song, char *name) {
     int pattern = 0;
     while (!feof(f)) {
         if (3 == fscanf(f, "%s %04x %04x\n", parameter, &address, &value)) {
+            if (strcmp(parameter, "tracks") == 0) {
+                if (value > MAX_TRACKS_PER_PATTERN || !song_setTracks(song, value)) {
+                    fclose(f);
+                    return false;
+                }
+            }
             if (strcmp(parameter, "pattern") == 0) {
                 if (address >= MAX_PATTERNS) {
-                    address = MAX_PATTERNS;
+                    address = MAX_PATTERNS - 1;
                 }
                 pattern = address;
             }
@@ -36,7 +42,7 @@ bool persist_loadSongWithName(Song *song, char *name) {
             if (strcmp(parameter, "note") == 0) {
                 int track = address / 256;
                 int note = address & 255;
-                if (track < TRACKS_PER_PATTERN && note < TRACK_LENGTH) {
+                if (track < song->tracks && note < TRACK_LENGTH) {
                     Note *target = &song->patterns[pattern].tracks[track].notes[note];
                     target->note = value;
                     if (target->patch == 0) {
@@ -47,7 +53,7 @@ bool persist_loadSongWithName(Song *song, char *name) {
             if (strcmp(parameter, "patch") == 0) {
                 int track = address / 256;
                 int note = address & 255;
-                if (track < TRACKS_PER_PATTERN && note < TRACK_LENGTH) {
+                if (track < song->tracks && note < TRACK_LENGTH) {
                     Note *target = &song->patterns[pattern].tracks[track].notes[note];
                     target->patch = value;
                 }
@@ -55,7 +61,7 @@ bool persist_loadSongWithName(Song *song, char *name) {
             if (strcmp(parameter, "cmd") == 0) {
                 int track = address / 256;
                 int note = address & 255;
-                if (track < TRACKS_PER_PATTERN && note < TRACK_LENGTH) {
+                if (track < song->tracks && note < TRACK_LENGTH) {
                     Note *target = &song->patterns[pattern].tracks[track].notes[note];
                     target->command = value;
                 }
@@ -150,11 +156,12 @@ bool persist_saveSongWithName(Song *song, char* name) {
         return false;
     }
 
+    fprintf(f, "tracks %04x %04x\n", 0, song->tracks);
     fprintf(f, "songbpm %04x %04x\n", 0, song->bpm);
 
     for (int pattern = 0; pattern < MAX_PATTERNS; pattern++) {
         bool patternStored = false;
-        for (int track = 0; track < TRACKS_PER_PATTERN; track++) {
+        for (int track = 0; track < song->tracks; track++) {
             for (int row = 0; row < TRACK_LENGTH; row++) {
                 Note note = song->patterns[pattern].tracks[track].notes[row];
                 Uint16 encodedNote = (track << 8) + row;
@@ -10,6 +10,7 @@
 #include "song.h"
 #include "trackermode.h"
 #include "player.h"
+#include "scope.h"
 #include "note.h"
 #include "instrument.h"
 #include "defaultsettings.h"
@@ -33,8 +34,8 @@ http://coppershade.org/helpers/DOCS/protracker23.readme.txt
 
 */
 
-#define CHANNELS TRACKS_PER_PATTERN
 #define SUBCOLUMNS 4
+/* Mute the tracks shown in the pattern view, from left to right */
 #define MUTE_SC_1 SDL_SCANCODE_F5
 #define MUTE_SC_2 SDL_SCANCODE_F6
 #define MUTE_SC_3 SDL_SCANCODE_F7
@@ -45,6 +46,15 @@ http://coppershade.org/helpers/DOCS/protracker23.readme.txt
 
 #define PATTERN_UNDO_BUFFER_SIZE 100
 #define SPECTRUM_ANALYZER_SIZE 1536
+/* The analyzers show the minimum and maximum of every column of samples */
+#define SCOPE_SAMPLES_PER_COLUMN 8
+#define ANALYZER_COLUMNS (SPECTRUM_ANALYZER_SIZE / SCOPE_SAMPLES_PER_COLUMN)
+/* Blocks rendered ahead of the audio callback, about 23 ms at 44.1 kHz */
+#define RENDER_AHEAD_BLOCKS 4
+
+/* Sample rates to render WAV output at, the synth default, a master and a draft rate */
+static const Uint32 renderSampleRates[] = {SYNTH_DEFAULT_SAMPLE_RATE, 96000, 22050};
+#define RENDER_SAMPLE_RATES (sizeof(renderSampleRates) / sizeof(renderSampleRates[0]))
 
 typedef struct _Tracker Tracker;
 
@@ -70,17 +80,21 @@ typedef struct  {
 
 typedef struct {
     TrackNavigation trackNavi;
-    Pattern pattern;
+    Track tracks[MAX_TRACKS_PER_PATTERN];
 } UndoItem;
 
 
 typedef struct {
     Uint16 pos;
-    Sint16 values[SPECTRUM_ANALYZER_SIZE];
+    ScopeColumn values[ANALYZER_COLUMNS];
 } SpectrumAnalyzer;
 
 typedef struct _Tracker {
-    SpectrumAnalyzer analyzer[TRACKS_PER_PATTERN];
+    /** One analyzer per channel, filled from the scope on the UI thread */
+    SpectrumAnalyzer *analyzer;
+    Scope *scope;
+    /** Number of channels the synth and player were created for */
+    Uint8 channels;
     Synth *synth;
     Player *player;
     Keyhandler *keyhandler;
@@ -94,7 +108,10 @@ typedef struct _Tracker {
     Uint8 octave;
     Uint8 patch;
     Track trackClipboard;
-    Pattern patternClipboard;
+    Track patternClipboard[MAX_TRACKS_PER_PATTERN];
+    Uint8 patternClipboardTracks;
+    /** Index in renderSampleRates of the rate WAV output is rendered at */
+    Uint8 renderSampleRate;
     TrackNavigation trackNavi;
     Uint16 currentPos;
     Uint16 currentPattern;
@@ -215,11 +232,124 @@ void gotoSongPos(Tracker *tracker, Uint16 pos) {
 
     tracker->currentPattern = tracker->song.arrangement[pos].pattern;
     screen_setSongPos(pos);
-    for (int i = 0; i < TRACKS_PER_PATTERN; i++) {
+    for (int i = 0; i < tracker->song.tracks; i++) {
         screen_setTrackData(i, &getCurrentPattern(tracker)->tracks[i]);
     }
 }
 
+/*
+ * Channel tap of the synth, runs on the audio thread and only hands the
+ * output over to the scope
+ */
+void channelTap(void *userData, const Sint16 *const *channels, int length) {
+    Tracker *tracker = (Tracker*)userData;
+    scope_write(tracker->scope, channels, length);
+}
+
+/*
+ * Move the scope columns written since the last frame into the analyzers,
+ * and draw the analyzers that are full
+ */
+void updateAnalyzers(Tracker *tracker) {
+    ScopeColumn columns[MAX_TRACKS_PER_PATTERN];
+    if (tracker->scope == NULL) {
+        return;
+    }
+    while (scope_read(tracker->scope, columns)) {
+        for (int channel = 0; channel < tracker->channels; channel++) {
+            SpectrumAnalyzer *analyzer = &tracker->analyzer[channel];
+            analyzer->values[analyzer->pos] = columns[channel];
+            analyzer->pos++;
+            if (analyzer->pos >= ANALYZER_COLUMNS) {
+                screen_drawAnalyzer(channel, analyzer->values, ANALYZER_COLUMNS);
+                analyzer->pos = 0;
+            }
+        }
+    }
+}
+
+void clearPatternUndo(Tracker *tracker) {
+    tracker->patternUndoSize = 0;
+    tracker->patternUndoPos = 0;
+    tracker->patternRedoSize = 0;
+}
+
+/*
+ * Close the synth, player, scope and analyzers of the channels
+ */
+void closeChannels(Tracker *tracker) {
+    if (tracker->player != NULL) {
+        player_close(tracker->player);
+        tracker->player = NULL;
+    }
+    if (tracker->synth != NULL) {
+        synth_close(tracker->synth);
+        tracker->synth = NULL;
+    }
+    free(tracker->analyzer);
+    tracker->analyzer = NULL;
+    scope_close(tracker->scope);
+    tracker->scope = NULL;
+    tracker->channels = 0;
+}
+
+/*
+ * Create the synth, player, scope and analyzers for a number of channels,
+ * leaving none of them behind if that fails
+ */
+bool createChannels(Tracker *tracker, Uint8 channels) {
+    SynthSettings synthSettings = {
+        .channels = channels,
+        .enablePlayback = true,
+        .renderAhead = RENDER_AHEAD_BLOCKS,
+        .channelTap = channelTap,
+        .userData = tracker
+    };
+
+    if (
+            NULL == (tracker->analyzer = calloc(channels, sizeof(SpectrumAnalyzer))) ||
+            NULL == (tracker->scope = scope_init(channels, SCOPE_SAMPLES_PER_COLUMN)) ||
+            NULL == (tracker->synth = synth_init(&synthSettings)) ||
+            NULL == (tracker->player = player_init(tracker->synth, channels))
+    ) {
+        fprintf(stderr, "Failed to set up %d channels\n", channels);
+        closeChannels(tracker);
+        return false;
+    }
+    for (int i = 1; i < MAX_INSTRUMENTS; i++) {
+        synth_loadPatch(tracker->synth, i, &tracker->song.instruments[i]);
+    }
+    tracker->channels = channels;
+    if (tracker->trackNavi.currentTrack >= channels) {
+        tracker->trackNavi.currentTrack = channels - 1;
+        tracker->trackNavi.currentColumn = 0;
+    }
+    clearPatternUndo(tracker);
+    screen_setNumberOfTracks(channels);
+    return true;
+}
+
+/*
+ * Set up the synth, player and analyzers for a number of channels. Nothing
+ * is done if the number is unchanged, otherwise playback is stopped and the
+ * audio device is reopened. If that fails the previous number of channels
+ * is set up again, so that the tracker keeps a working synth.
+ */
+bool setupChannels(Tracker *tracker, Uint8 channels) {
+    Uint8 previousChannels = tracker->channels;
+    if (tracker->synth != NULL && previousChannels == channels) {
+        return true;
+    }
+    closeChannels(tracker);
+    if (createChannels(tracker, channels)) {
+        return true;
+    }
+    if (previousChannels > 0 && !createChannels(tracker, previousChannels)) {
+        fprintf(stderr, "Failed to restore %d channels\n", previousChannels);
+    }
+    return false;
+}
+
 void moveToFirstRow(Tracker *tracker) {
     tracker->trackNavi.rowOffset = 0;
 }
@@ -292,7 +422,7 @@ void increaseStepping(void *userData, SDL_Scancode scancode,SDL_Keymod keymod) {
 
 void saveCurrentPattern(Tracker *tracker) {
     if (tracker->patternUndoPos < PATTERN_UNDO_BUFFER_SIZE) {
-        memcpy(&tracker->patternUndo[tracker->patternUndoPos].pattern, getCurrentPattern(tracker), sizeof(Pattern));
+        memcpy(tracker->patternUndo[tracker->patternUndoPos].tracks, getCurrentPattern(tracker)->tracks, tracker->song.tracks * sizeof(Track));
         memcpy(&tracker->patternUndo[tracker->patternUndoPos].trackNavi, &tracker->trackNavi, sizeof(TrackNavigation));
     } else {
         fprintf(stderr, "saveCurrentPattern: Patternundopos %d exceeds undo buffer size %d\n", tracker->patternUndoPos,  PATTERN_UNDO_BUFFER_SIZE);
@@ -326,7 +456,7 @@ void registerPatternState(Tracker *tracker) {
 void recoverCurrentPattern(Tracker *tracker) {
     if (tracker->patternUndoPos < PATTERN_UNDO_BUFFER_SIZE) {
         UndoItem *recovery = &tracker->patternUndo[tracker->patternUndoPos];
-        memcpy(&tracker->song.patterns[tracker->currentPattern], &recovery->pattern, sizeof(Pattern));
+        memcpy(tracker->song.patterns[tracker->currentPattern].tracks, recovery->tracks, tracker->song.tracks * sizeof(Track));
         memcpy(&tracker->trackNavi, &recovery->trackNavi, sizeof(TrackNavigation));
     } else {
         fprintf(stderr, "recoverCurrentPattern: Patternundopos %d exceeds undo buffer size %d\n", tracker->patternUndoPos,  PATTERN_UNDO_BUFFER_SIZE);
@@ -379,23 +509,12 @@ void editCommand(void *userData, SDL_Scancode scancode,SDL_Keymod keymod) {
 
 void muteTrack(void *userData, SDL_Scancode scancode,SDL_Keymod keymod) {
     Tracker *tracker = (Tracker*)userData;
+    int channel = screen_getFirstVisibleTrack() + scancode - MUTE_SC_1;
 
-    if (scancode == MUTE_SC_1) {
-        bool mute = !synth_isChannelMuted(tracker->synth, 0);
-        synth_muteChannel(tracker->synth, 0, mute);
-        screen_setChannelMute(0, mute);
-    } else if (scancode == MUTE_SC_2) {
-        bool mute = !synth_isChannelMuted(tracker->synth, 1);
-        synth_muteChannel(tracker->synth, 1, mute);
-        screen_setChannelMute(1, mute);
-    } else if (scancode == MUTE_SC_3) {
-        bool mute = !synth_isChannelMuted(tracker->synth, 2);
-        synth_muteChannel(tracker->synth, 2, mute);
-        screen_setChannelMute(2, mute);
-    } else if (scancode == MUTE_SC_4) {
-        bool mute = !synth_isChannelMuted(tracker->synth, 3);
-        synth_muteChannel(tracker->synth, 3, mute);
-        screen_setChannelMute(3, mute);
+    if (channel < tracker->channels) {
+        bool mute = !synth_isChannelMuted(tracker->synth, channel);
+        synth_muteChannel(tracker->synth, channel, mute);
+        screen_setChannelMute(channel, mute);
     }
 }
 
@@ -677,7 +796,7 @@ void transposePatternDown(void *userData, SDL_Scancode scancode, SDL_Keymod keym
     Tracker *tracker = (Tracker*)userData;
     registerPatternState(tracker);
 
-    for (int i = 0; i < CHANNELS; i++) {
+    for (int i = 0; i < tracker->song.tracks; i++) {
         _transposeTrackDown(&getCurrentPattern(tracker)->tracks[i]);
     }
 }
@@ -686,7 +805,7 @@ void transposePatternUp(void *userData, SDL_Scancode scancode, SDL_Keymod keymod
     Tracker *tracker = (Tracker*)userData;
     registerPatternState(tracker);
 
-    for (int i = 0; i < CHANNELS; i++) {
+    for (int i = 0; i < tracker->song.tracks; i++) {
         _transposeTrackUp(&getCurrentPattern(tracker)->tracks[i]);
     }
 }
@@ -726,7 +845,8 @@ void pasteTrack(void *userData, SDL_Scancode scancode, SDL_Keymod keymod) {
  */
 void copyPattern(void *userData, SDL_Scancode scancode, SDL_Keymod keymod) {
     Tracker *tracker = (Tracker*)userData;
-    memcpy(&tracker->patternClipboard, getCurrentPattern(tracker), sizeof(Pattern));
+    tracker->patternClipboardTracks = tracker->song.tracks;
+    memcpy(tracker->patternClipboard, getCurrentPattern(tracker)->tracks, tracker->song.tracks * sizeof(Track));
 }
 
 void cutPattern(void *userData, SDL_Scancode scancode, SDL_Keymod keymod) {
@@ -734,20 +854,22 @@ void cutPattern(void *userData, SDL_Scancode scancode, SDL_Keymod keymod) {
     registerPatternState(tracker);
 
     copyPattern(tracker, scancode, keymod);
-    pattern_clear(getCurrentPattern(tracker));
+    pattern_clear(getCurrentPattern(tracker), tracker->song.tracks);
 }
 
 void pastePattern(void *userData, SDL_Scancode scancode, SDL_Keymod keymod) {
     Tracker *tracker = (Tracker*)userData;
     registerPatternState(tracker);
 
-    memcpy(getCurrentPattern(tracker), &tracker->patternClipboard, sizeof(Pattern));
+    int tracksToPaste = tracker->patternClipboardTracks < tracker->song.tracks
+            ? tracker->patternClipboardTracks : tracker->song.tracks;
+    memcpy(getCurrentPattern(tracker)->tracks, tracker->patternClipboard, tracksToPaste * sizeof(Track));
 }
 
 
 
 void gotoNextTrack(Tracker *tracker) {
-    if (tracker->trackNavi.currentTrack < CHANNELS-1) {
+    if (tracker->trackNavi.currentTrack < tracker->song.tracks-1) {
         tracker->trackNavi.currentTrack++;
         tracker->trackNavi.currentColumn = 0;
     }
@@ -854,7 +976,7 @@ void resetChannelParams(Synth *synth, Uint8 channel) {
 void startEditing(void *userData, SDL_Scancode scancode, SDL_Keymod keymod) {
     Tracker *tracker = (Tracker*)userData;
 
-    for (int i = 0; i < CHANNELS; i++) {
+    for (int i = 0; i < tracker->channels; i++) {
         synth_noteOff(tracker->synth, i);
         resetChannelParams(tracker->synth, i);
     }
@@ -863,7 +985,7 @@ void startEditing(void *userData, SDL_Scancode scancode, SDL_Keymod keymod) {
 
 void stopEditing(void *userData, SDL_Scancode scancode, SDL_Keymod keymod) {
     Tracker *tracker = (Tracker*)userData;
-    for (int i = 0; i < CHANNELS; i++) {
+    for (int i = 0; i < tracker->channels; i++) {
         synth_noteRelease(tracker->synth, i);
         resetChannelParams(tracker->synth, i);
     }
@@ -873,7 +995,7 @@ void stopEditing(void *userData, SDL_Scancode scancode, SDL_Keymod keymod) {
 void stopOrCutPlayback(Tracker *tracker, void noteOffFunc(Synth*, Uint8) ) {
     player_stop(tracker->player);
     synth_setGlobalVolume(tracker->synth, 255);
-    for (int i = 0; i < CHANNELS; i++) {
+    for (int i = 0; i < tracker->channels; i++) {
         synth_pitchGlideReset(tracker->synth, i);
         synth_frequencyModulation(tracker->synth, i, 0, 0);
         synth_amplitudeModulation(tracker->synth, i, 0, 0);
@@ -922,13 +1044,47 @@ void increaseSongBpm(void *userData, SDL_Scancode scancode, SDL_Keymod keymod) {
     }
 }
 
+void setNumberOfTracks(Tracker *tracker, Uint8 tracks) {
+    char buf[30];
+    Uint8 previousTracks = tracker->song.tracks;
+    cutPlayback(tracker);
+    /* The song keeps its tracks until the channels for the new number are set up */
+    if (!setupChannels(tracker, tracks)) {
+        screen_setStatusMessage("Failed to change tracks!");
+        return;
+    }
+    if (!song_setTracks(&tracker->song, tracks)) {
+        setupChannels(tracker, previousTracks);
+        screen_setStatusMessage("Failed to change tracks!");
+        return;
+    }
+    gotoSongPos(tracker, tracker->currentPos);
+    sprintf(buf, "%d tracks", tracks);
+    screen_setStatusMessage(buf);
+}
+
+void removeTrack(void *userData, SDL_Scancode scancode, SDL_Keymod keymod) {
+    Tracker *tracker = (Tracker*)userData;
+    if (tracker->song.tracks > MIN_TRACKS_PER_PATTERN) {
+        setNumberOfTracks(tracker, tracker->song.tracks - 1);
+    }
+}
+
+void addTrack(void *userData, SDL_Scancode scancode, SDL_Keymod keymod) {
+    Tracker *tracker = (Tracker*)userData;
+    if (tracker->song.tracks < MAX_TRACKS_PER_PATTERN) {
+        setNumberOfTracks(tracker, tracker->song.tracks + 1);
+    }
+}
+
 
 void renderSong(void *userData, SDL_Scancode scancode, SDL_Keymod keymod) {
     Tracker *tracker = (Tracker*)userData;
     char filename[MAX_SONG_NAME + 10];
     strcpy(filename, tracker->song.name);
     strcat(filename, ".wav");
-    AudioRenderer *renderer = audiorenderer_init(filename);
+    AudioRenderer *renderer = audiorenderer_init(filename, tracker->song.tracks,
+            renderSampleRates[tracker->renderSampleRate], keymod & KMOD_SHIFT);
     if (renderer == NULL) {
         screen_setStatusMessage("Failed to render song!");
         fprintf(stderr, "Audio renderer failed to initialize\n");
@@ -939,6 +1095,14 @@ void renderSong(void *userData, SDL_Scancode scancode, SDL_Keymod keymod) {
     screen_setStatusMessage("Rendered successfully!");
 }
 
+void selectRenderSampleRate(void *userData, SDL_Scancode scancode, SDL_Keymod keymod) {
+    Tracker *tracker = (Tracker*)userData;
+    char buf[40];
+    tracker->renderSampleRate = (tracker->renderSampleRate + 1) % RENDER_SAMPLE_RATES;
+    sprintf(buf, "Render WAV at %u Hz", (unsigned)renderSampleRates[tracker->renderSampleRate]);
+    screen_setStatusMessage(buf);
+}
+
 void loadSongDialog(void *userData, SDL_Scancode scancode, SDL_Keymod keymod) {
     Tracker *tracker = (Tracker*)userData;
     cutPlayback(tracker);
@@ -976,10 +1140,19 @@ void loadSong(Tracker *tracker, char *name) {
         sprintf(buf, "%s loaded!", name);
         screen_setStatusMessage(buf);
     }
+    if (!setupChannels(tracker, tracker->song.tracks)) {
+        screen_setStatusMessage("Failed to set up audio!");
+        /* Fall back to an empty song with the tracks of the channels still set up */
+        song_clear(&tracker->song);
+        defaultsettings_createInstruments(tracker->song.instruments);
+        song_setTracks(&tracker->song, tracker->channels);
+        tracker->song.name[0] = '\0';
+    } else {
+        strnosuffix(tracker->song.name, name, SONG_SUFFIX, MAX_SONG_NAME-1);
+    }
     for (int i = 1; i < MAX_INSTRUMENTS; i++) {
         synth_loadPatch(tracker->synth, i, &tracker->song.instruments[i]);
     }
-    strnosuffix(tracker->song.name, name, SONG_SUFFIX, MAX_SONG_NAME-1);
 
     screen_setSongName(tracker->song.name);
     gotoSongPos(tracker, 0);
@@ -1479,8 +1652,12 @@ void initKeyMappings(Tracker *tracker) {
 
     keyhandler_register(kh, SDL_SCANCODE_F9, KM_SONG, predicate_isEditOrStopped, decreaseSongBpm, tracker);
     keyhandler_register(kh, SDL_SCANCODE_F10, KM_SONG, predicate_isEditOrStopped, increaseSongBpm, tracker);
+    keyhandler_register(kh, SDL_SCANCODE_F11, KM_SONG, predicate_isEditOrStopped, removeTrack, tracker);
+    keyhandler_register(kh, SDL_SCANCODE_F12, KM_SONG, predicate_isEditOrStopped, addTrack, tracker);
 
     keyhandler_register(kh, SDL_SCANCODE_B, KM_CTRL, NULL, renderSong, tracker);
+    keyhandler_register(kh, SDL_SCANCODE_B, KM_SHIFT_CTRL, NULL, renderSong, tracker);
+    keyhandler_register(kh, SDL_SCANCODE_R, KM_CTRL, NULL, selectRenderSampleRate, tracker);
     keyhandler_register(kh, SDL_SCANCODE_O, KM_CTRL, NULL, loadSongDialog, tracker);
     keyhandler_register(kh, SDL_SCANCODE_S, KM_CTRL, NULL, saveSongDialog, tracker);
 
@@ -1617,6 +1794,9 @@ void tracker_close(Tracker *tracker) {
             inputfield_close(tracker->songNameField);
             tracker->songNameField = NULL;
         }
+        free(tracker->analyzer);
+        scope_close(tracker->scope);
+        song_close(&tracker->song);
         free(tracker);
         tracker = NULL;
     }
@@ -1645,31 +1825,20 @@ void createInstrumentSettings(Tracker *tracker) {
     }
 }
 
-void soundOutputHook(void *userData, int channel, Sint16 sample) {
-    Tracker *tracker = (Tracker*)userData;
-    SpectrumAnalyzer *analyzer = &tracker->analyzer[channel];
-    analyzer->values[analyzer->pos] = sample;
-    analyzer->pos++;
-    if (analyzer->pos >= SPECTRUM_ANALYZER_SIZE) {
-        screen_drawAnalyzer(channel, analyzer->values, SPECTRUM_ANALYZER_SIZE);
-        analyzer->pos = 0;
-    }
-}
-
 Tracker *tracker_init() {
     Tracker *tracker = calloc(1, sizeof(Tracker));
-    tracker->song.bpm = 59;
     tracker->stepping = 1;
     tracker->patch = 1;
 
     if (
-            NULL == (tracker->synth = synth_init(CHANNELS, true, soundOutputHook, tracker)) ||
-            NULL == (tracker->player = player_init(tracker->synth, CHANNELS)) ||
+            !song_clear(&tracker->song) ||
+            !setupChannels(tracker, tracker->song.tracks) ||
             NULL == (tracker->keyhandler = keyhandler_init())
     ) {
         tracker_close(tracker);
         return NULL;
     }
+    tracker->song.bpm = 59;
     tracker->fileSelector = fileSelector_init();
     tracker->songNameField = inputfield_init();
     createInstrumentSettings(tracker);
@@ -1686,7 +1855,7 @@ int main(int argc, char* args[]) {
 
     Tracker *tracker = tracker_init();
 
-    if (!screen_init(CHANNELS)) {
+    if (!screen_init(tracker->channels)) {
         screen_close();
         tracker_close(tracker);
         return 1;
@@ -1754,7 +1923,9 @@ int main(int argc, char* args[]) {
 
         }
         screen_setStepping(tracker->stepping);
+        updateAnalyzers(tracker);
         if (player_isPlaying(tracker->player)) {
+            player_updateSong(tracker->player, tracker->currentPattern);
             screen_setRowOffset(player_getCurrentRow(tracker->player));
             Uint16 playPos = player_getSongPos(tracker->player);
             if (playPos != tracker->currentPos) {
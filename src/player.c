@@ -1,8 +1,11 @@
 #include <SDL2/SDL.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "player.h"
 #include "song.h"
 #include "note.h"
+#include "rcu.h"
 #include "synth.h"
 
 #define PLAYER_AMP_MODULATION_AMP_SCALING 16
@@ -26,11 +29,32 @@ typedef struct {
     Sint8 arpeggio[4];
 } PlayerChannel;
 
+/**
+ * The parts of a song the player reads, published for the sequencer and
+ * never changed afterwards. A new version shares the tracks of the patterns
+ * that were not edited with the one it replaces.
+ */
+typedef struct {
+    PatternPtr arrangement[MAX_PATTERNS];
+    /** Tracks of every pattern in the arrangement, NULL for the others */
+    Track *patterns[MAX_PATTERNS];
+    Uint8 tracks;
+} SongVersion;
+
 typedef struct _Player {
     PlayerChannel *channelData;
     Synth *synth;
+    /** Song being edited, copied into versions by player_reset() and player_updateSong() */
     Song *song;
-    SDL_TimerID timerId;
+    /** Version read by the sequencer, and the Rcu that reclaims the ones it replaced */
+    SongVersion *version;
+    Rcu rcu;
+    bool isPlaying;
+    /** Fraction of a sample carried over from the row lengths so far, in 1/(2 * bpm) samples */
+    Uint32 rowRemainder;
+    /** Samples from the start of playback to the end of the row processed last */
+    Uint32 position;
+    Uint32 endPosition;
     Uint16 songPos;
     Uint8 rowOffset;
     Uint8 playbackTick;
@@ -46,37 +70,56 @@ void _player_parameterToNibbles(Uint8 parameter, Uint8 *left, Uint8 *right) {
     *right = parameter & 0xF;
 }
 
-Uint32 _player_getDelayFromBpm(int bpm) {
-    return 30000/bpm;
+/**
+ * Length of the next row in samples. A row lasts 7.5 / bpm seconds, the
+ * fraction of a sample left over is carried to the next row so that rows
+ * never drift from the tempo.
+ */
+Uint32 _player_getRowLength(Player *player) {
+    Uint32 denominator = 2 * player->bpm;
+    Uint32 numerator = synth_getSampleRate(player->synth) * 15 + player->rowRemainder;
+    player->rowRemainder = numerator % denominator;
+    return numerator / denominator;
 }
 
-void _player_setSongPos(Player *player, Uint16 songPos) {
-    if (songPos >= MAX_PATTERNS || player->song->arrangement[songPos].pattern < 0) {
+void _player_setSongPos(Player *player, SongVersion *song, Uint16 songPos) {
+    if (songPos >= MAX_PATTERNS || song->arrangement[songPos].pattern < 0) {
         player->songPos = 0;
         player->isEndReached = true;
     } else {
         player->songPos = songPos;
     }
 }
-void _player_increaseSongPos(Player *player) {
-    _player_setSongPos(player, player->songPos+1);
+void _player_increaseSongPos(Player *player, SongVersion *song) {
+    _player_setSongPos(player, song, player->songPos+1);
 }
 
-Uint32 player_processSong(Uint32 interval, void *param) {
+Uint32 player_processSong(void *param) {
     Player *player = (Player*)param;
+    bool wasEndReached = player->isEndReached;
     Synth *synth = player->synth;
 
-    Uint16 patternToPlay = player->song->arrangement[player->songPos].pattern;
+    rcu_readBegin(&player->rcu);
+    SongVersion *song = (SongVersion*)SDL_AtomicGetPtr((void**)&player->version);
+    if (song == NULL) {
+        rcu_readEnd(&player->rcu);
+        return 0;
+    }
+    Uint16 patternToPlay = song->arrangement[player->songPos].pattern;
     if (patternToPlay < 0 || patternToPlay >= MAX_PATTERNS) {
         patternToPlay = 0;
     }
 
-    Pattern *pattern = &player->song->patterns[patternToPlay];
+    Track *tracks = song->patterns[patternToPlay];
+    Uint8 channels = song->tracks < player->channels ? song->tracks : player->channels;
+    if (tracks == NULL) {
+        channels = 0;
+    }
 
-    for (int channel = 0; channel < player->channels; channel++) {
-        Sint8 note = pattern->tracks[channel].notes[player->rowOffset].note;
-        Uint8 patch = pattern->tracks[channel].notes[player->rowOffset].patch;
-        Uint16 command = pattern->tracks[channel].notes[player->rowOffset].command;
+    for (int channel = 0; channel < channels; channel++) {
+        Sint8 note = tracks[channel].notes[player->rowOffset].note;
+        Uint8 patch = tracks[channel].notes[player->rowOffset].patch;
+        Uint16 command = tracks[channel].notes[player->rowOffset].command;
         Uint8 effect = command >> 8;
         Uint8 parameter = command & 0xFF;
 
@@ -86,12 +129,13 @@ Uint32 player_processSong(Uint32 interval, void *param) {
             if (effect == EFFECT_TONE_PORTAMENTO) {
                 synth_notePitch(synth, channel, patch, note);
             } else {
+                // Trigger first so that the volume does not change the release of the previous note
+                synth_noteTrigger(synth, channel, patch, note);
                 if (effect != EFFECT_VOLUME) {
                     synth_setChannelVolume(synth, channel, 255);
                 } else {
                     synth_setChannelVolume(synth, channel, parameter);
                 }
-                synth_noteTrigger(synth, channel, patch, note);
             }
         }
         if (effect == EFFECT_VIBRATO) {
@@ -168,22 +212,87 @@ Uint32 player_processSong(Uint32 interval, void *param) {
     }
     if (player->patternBreak > -1) {
         player->rowOffset = player->patternBreak % TRACK_LENGTH;
-        _player_increaseSongPos(player);
+        _player_increaseSongPos(player, song);
     } else if (player->jumpSongPos > -1) {
         player->rowOffset = 0;
-        _player_setSongPos(player, player->jumpSongPos);
+        _player_setSongPos(player, song, player->jumpSongPos);
     } else {
         player->rowOffset = player->rowOffset + 1;
         if (player->rowOffset >= TRACK_LENGTH) {
             player->rowOffset = 0;
-            _player_increaseSongPos(player);
+            _player_increaseSongPos(player, song);
         }
     }
+    rcu_readEnd(&player->rcu);
     player->patternBreak = -1;
     player->jumpSongPos = - 1;
-    return _player_getDelayFromBpm(player->bpm)/4;
+    Uint32 rowLength = _player_getRowLength(player);
+    player->position += rowLength;
+    if (player->isEndReached && !wasEndReached) {
+        player->endPosition = player->position;
+    }
+    return rowLength;
+}
+
+/**
+ * Retire a version together with its patterns that the version replacing
+ * it does not share, NULL retires all of them
+ */
+void _player_retireVersion(Player *player, SongVersion *version, SongVersion *replacement) {
+    if (version == NULL) {
+        return;
+    }
+    for (int i = 0; i < MAX_PATTERNS; i++) {
+        if (version->patterns[i] != NULL && (replacement == NULL || replacement->patterns[i] != version->patterns[i])) {
+            rcu_retire(&player->rcu, version->patterns[i], free);
+        }
+    }
+    rcu_retire(&player->rcu, version, free);
+}
+
+/**
+ * Copy the tracks of a pattern of the song, NULL if allocation fails
+ */
+Track *_player_copyPattern(Song *song, Uint16 pattern) {
+    Track *tracks = malloc(song->tracks * sizeof(Track));
+    if (tracks != NULL) {
+        memcpy(tracks, song->patterns[pattern].tracks, song->tracks * sizeof(Track));
+    }
+    return tracks;
 }
 
+/**
+ * Publish a version with the arrangement of the song. Patterns that are
+ * still in the arrangement are shared with the current version, except
+ * editedPattern which is copied again if it has changed. Pass -1 to copy
+ * every pattern.
+ */
+void _player_publishVersion(Player *player, Sint16 editedPattern) {
+    Song *song = player->song;
+    SongVersion *current = player->version;
+    SongVersion *version = malloc(sizeof(SongVersion));
+    if (version == NULL) {
+        fprintf(stderr, "Failed to publish the song to the player\n");
+        return;
+    }
+    memcpy(version->arrangement, song->arrangement, sizeof(version->arrangement));
+    memset(version->patterns, 0, sizeof(version->patterns));
+    version->tracks = song->tracks;
+    for (int i = 0; i < MAX_PATTERNS; i++) {
+        Sint16 pattern = version->arrangement[i].pattern;
+        if (pattern < 0 || pattern >= MAX_PATTERNS || version->patterns[pattern] != NULL) {
+            continue;
+        }
+        Track *shared = current == NULL || editedPattern < 0 ? NULL : current->patterns[pattern];
+        if (shared != NULL && pattern == editedPattern
+                && memcmp(shared, song->patterns[pattern].tracks, song->tracks * sizeof(Track)) != 0) {
+            shared = NULL;
+        }
+        version->patterns[pattern] = shared != NULL ? shared : _player_copyPattern(song, pattern);
+    }
+    SDL_AtomicSetPtr((void**)&player->version, version);
+    _player_retireVersion(player, current, version);
+}
 
 Player *player_init(Synth *synth, Uint8 channels) {
     Player *player = calloc(1, sizeof(Player));
@@ -196,6 +305,8 @@ Player *player_init(Synth *synth, Uint8 channels) {
 void player_close(Player *player) {
     player_stop(player);
     if (player != NULL) {
+        _player_retireVersion(player, player->version, NULL);
+        rcu_close(&player->rcu);
         free(player->channelData);
         free(player);
         player = NULL;
@@ -209,14 +320,38 @@ void player_reset(Player *player, Song *song, Uint16 songPos) {
     player->rowOffset = 0;
     player->playbackTick = 0;
     player->bpm = song->bpm;
+    player->rowRemainder = 0;
+    player->position = 0;
+    player->endPosition = 0;
     player->patternBreak = -1;
     player->jumpSongPos = -1;
     player->isEndReached = false;
+    _player_publishVersion(player, -1);
     synth_setGlobalVolume(player->synth, 255);
 }
 
+void player_updateSong(Player *player, Uint16 pattern) {
+    SongVersion *version = player->version;
+    if (version == NULL || player->song == NULL) {
+        return;
+    }
+    if (version->tracks != player->song->tracks) {
+        _player_publishVersion(player, -1);
+        return;
+    }
+    bool arrangementChanged = memcmp(version->arrangement, player->song->arrangement, sizeof(version->arrangement)) != 0;
+    bool patternChanged = pattern < MAX_PATTERNS && version->patterns[pattern] != NULL
+            && memcmp(version->patterns[pattern], player->song->patterns[pattern].tracks, version->tracks * sizeof(Track)) != 0;
+    if (arrangementChanged || patternChanged) {
+        _player_publishVersion(player, pattern);
+    } else {
+        rcu_reclaim(&player->rcu);
+    }
+}
+
 void player_play(Player *player) {
-    player->timerId = SDL_AddTimer(0, player_processSong, player);
+    player->isPlaying = true;
+    synth_setSequencer(player->synth, player_processSong, player);
 }
 
 Uint8 player_getCurrentRow(Player *player) {
@@ -233,16 +368,20 @@ Uint16 player_getSongPos(Player *player) {
 
 
 void player_stop(Player *player) {
-    if (player->timerId != 0) {
-        SDL_RemoveTimer(player->timerId);
-        player->timerId = 0;
+    if (player->isPlaying) {
+        synth_setSequencer(player->synth, NULL, NULL);
+        player->isPlaying = false;
     }
 }
 
 bool player_isPlaying(Player *player) {
-    return player->timerId != 0;
+    return player->isPlaying;
 }
 
 bool player_isEndReached(Player *player) {
     return player->isEndReached;
 }
+
+Uint32 player_getEndPosition(Player *player) {
+    return player->endPosition;
+}
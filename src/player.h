@@ -9,18 +9,32 @@
 
 typedef struct _Player Player;
 
+/**
+ * Initialize a player driving the given number of synth channels. Tracks of
+ * the song beyond that number are not played.
+ */
 Player *player_init(Synth *synth, Uint8 channels);
 
 void player_close(Player *player);
 
 /**
  *
- * Reset the player, preparing for playback. Will not start the song.
+ * Reset the player, preparing for playback. Will not start the song. The
+ * player plays a copy of the song, edits reach it through player_updateSong().
  */
 void player_reset(Player *player, Song *song, Uint16 songPos);
 
 /**
- * Start playing song using timer
+ * Make edits of the arrangement and of the given pattern audible. The
+ * player switches to a new copy of the song at its next row, old copies
+ * are freed here once the sequencer has moved past them. Call it from the
+ * thread editing the song, which only edits one pattern at a time.
+ */
+void player_updateSong(Player *player, Uint16 pattern);
+
+/**
+ * Start playing the song. Rows are processed by the synth while it renders,
+ * each at the exact sample it starts on.
  */
 void player_play(Player *player);
 
@@ -35,14 +49,22 @@ Uint16 player_getSongPos(Player *player);
 void player_stop(Player *player);
 
 /**
- * Process song data. Don't call manually if player_play() has been called
+ * Process one row of song data and return the number of samples until the
+ * next row. Run by the synth as its sequencer after player_play(), don't
+ * call manually.
  */
-Uint32 player_processSong(Uint32 interval, void *param);
+Uint32 player_processSong(void *param);
 
 /**
  * Returns true if an "end" marker has been reached, used for file rendering
  */
-bool player_isEndReached();
+bool player_isEndReached(Player *player);
+
+/**
+ * Samples from player_play() to the end of the row that reached the end of
+ * the song, valid once player_isEndReached() returns true
+ */
+Uint32 player_getEndPosition(Player *player);
 
 
 #endif /* PLAYER_H_ */
@@ -0,0 +1,114 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rcu.h"
+
+typedef struct _RetiredVersion {
+    void *version;
+    void (*destructor)(void*);
+    /** Reader epoch when the version was retired */
+    Uint32 epoch;
+    RetiredVersion *next;
+} RetiredVersion;
+
+void rcu_readBegin(Rcu *rcu) {
+    SDL_AtomicAdd(&rcu->epoch, 1);
+}
+
+void rcu_readEnd(Rcu *rcu) {
+    SDL_AtomicAdd(&rcu->epoch, 1);
+}
+
+/**
+ * A version retired at an even epoch was replaced while the reader was
+ * outside its read sections, later sections load the new one. A version
+ * retired at an odd epoch is in use until that read section ends.
+ */
+bool _rcu_isUnused(Uint32 retiredEpoch, Uint32 epoch) {
+    return (retiredEpoch & 1) == 0 || epoch != retiredEpoch;
+}
+
+void rcu_retire(Rcu *rcu, void *version, void (*destructor)(void*)) {
+    if (version == NULL) {
+        return;
+    }
+    RetiredVersion *retired = malloc(sizeof(RetiredVersion));
+    if (retired == NULL) {
+        // Leaking is the only safe option without knowing if the reader is done
+        fprintf(stderr, "Failed to retire a version\n");
+        return;
+    }
+    retired->version = version;
+    retired->destructor = destructor;
+    // The new version has been published, read the epoch after it
+    retired->epoch = SDL_AtomicGet(&rcu->epoch);
+    retired->next = rcu->retired;
+    rcu->retired = retired;
+    rcu_reclaim(rcu);
+}
+
+void rcu_reclaim(Rcu *rcu) {
+    Uint32 epoch = SDL_AtomicGet(&rcu->epoch);
+    RetiredVersion **link = &rcu->retired;
+    while (*link != NULL) {
+        RetiredVersion *retired = *link;
+        if (_rcu_isUnused(retired->epoch, epoch)) {
+            *link = retired->next;
+            retired->destructor(retired->version);
+            free(retired);
+        } else {
+            link = &retired->next;
+        }
+    }
+}
+
+void rcu_close(Rcu *rcu) {
+    while (rcu->retired != NULL) {
+        RetiredVersion *retired = rcu->retired;
+        rcu->retired = retired->next;
+        retired->destructor(retired->version);
+        free(retired);
+    }
+}
+
+int rcuTestFreed;
+
+void _rcu_testDestructor(void *version) {
+    rcuTestFreed += *(int*)version;
+    free(version);
+}
+
+int *_rcu_testVersion(int value) {
+    int *version = malloc(sizeof(int));
+    *version = value;
+    return version;
+}
+
+void rcu_test() {
+    Rcu rcu = {0};
+    bool ok = true;
+
+    printf("======================TEST OF RCU========================\n");
+    rcuTestFreed = 0;
+    rcu_retire(&rcu, _rcu_testVersion(1), _rcu_testDestructor);
+    ok = ok && rcuTestFreed == 1;
+    printf("Retired outside a read section: freed %d %s\n", rcuTestFreed, ok ? "OK" : "FAIL");
+
+    rcu_readBegin(&rcu);
+    rcu_retire(&rcu, _rcu_testVersion(2), _rcu_testDestructor);
+    rcu_retire(&rcu, _rcu_testVersion(4), _rcu_testDestructor);
+    rcu_reclaim(&rcu);
+    ok = ok && rcuTestFreed == 1;
+    printf("Retired inside a read section: freed %d %s\n", rcuTestFreed, ok ? "OK" : "FAIL");
+    rcu_readEnd(&rcu);
+    rcu_readBegin(&rcu);
+    rcu_retire(&rcu, _rcu_testVersion(8), _rcu_testDestructor);
+    ok = ok && rcuTestFreed == 7;
+    printf("Next read section: freed %d %s\n", rcuTestFreed, ok ? "OK" : "FAIL");
+    rcu_readEnd(&rcu);
+    rcu_reclaim(&rcu);
+    ok = ok && rcuTestFreed == 15 && rcu.retired == NULL;
+    printf("After the read section: freed %d %s\n", rcuTestFreed, ok ? "OK" : "FAIL");
+    rcu_close(&rcu);
+}
@@ -0,0 +1,53 @@
+#ifndef RCU_H_
+#define RCU_H_
+
+#include <SDL2/SDL.h>
+
+/*
+ * Read-copy-update for data the audio callback reads while the UI thread
+ * replaces it. The writer never changes a published version: it publishes a
+ * new one with SDL_AtomicSetPtr() and retires the old one, which is freed
+ * once the reader has left every read section that may still be using it.
+ * The reader only counts its read sections and never waits.
+ */
+
+typedef struct _RetiredVersion RetiredVersion;
+
+typedef struct {
+    /** Read sections entered plus read sections left, odd while the reader is in one */
+    SDL_atomic_t epoch;
+    /** Versions waiting for the reader to move past them, only touched by the writer */
+    RetiredVersion *retired;
+} Rcu;
+
+/**
+ * Enter a read section on the reader thread. Versions loaded from their
+ * published pointers stay valid until rcu_readEnd().
+ */
+void rcu_readBegin(Rcu *rcu);
+
+void rcu_readEnd(Rcu *rcu);
+
+/**
+ * Hand over a version the writer has replaced. destructor is called with it
+ * once no read section can still be using it, which is at once if the reader
+ * is outside one. Frees earlier versions that have become unused as well.
+ */
+void rcu_retire(Rcu *rcu, void *version, void (*destructor)(void*));
+
+/**
+ * Free the retired versions no read section can still be using
+ */
+void rcu_reclaim(Rcu *rcu);
+
+/**
+ * Free all retired versions. The reader must have stopped.
+ */
+void rcu_close(Rcu *rcu);
+
+/**
+ * Retire versions inside and outside read sections and check when they are freed
+ */
+void rcu_test();
+
+#endif /* RCU_H_ */
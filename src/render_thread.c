@@ -0,0 +1,255 @@
+/* Needed for pthread_setaffinity_np() */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "render_thread.h"
+
+/** SCHED_FIFO priority of a real-time render thread, in the range audio servers use */
+#define RENDER_THREAD_FIFO_PRIORITY 70
+/** Longest wait for a free block, the thread checks if it has been stopped in between */
+#define RENDER_THREAD_WAIT_MS 10
+
+typedef struct _RenderThread {
+    RenderThreadFunc render;
+    void *userData;
+    int blockBytes;
+    int blocks;
+    Uint8 *ring;
+    /**
+     * Positions of the next block to read and to render. They run over
+     * twice the number of blocks to tell a full ring from an empty one,
+     * only the audio callback moves read and only the thread moves write.
+     */
+    SDL_atomic_t read;
+    SDL_atomic_t write;
+    /** Bytes of the block at read that have been copied out already */
+    int readOffset;
+    SDL_atomic_t underruns;
+    SDL_atomic_t running;
+    /** Posted whenever a block has been read */
+    SDL_sem *space;
+    /** Held while a block is rendered */
+    SDL_mutex *lock;
+    SDL_Thread *thread;
+    bool realtime;
+    Uint32 cpus;
+} RenderThread;
+
+int _renderThread_getFill(RenderThread *thread, int read, int write) {
+    return (write - read + 2 * thread->blocks) % (2 * thread->blocks);
+}
+
+void _renderThread_renderBlock(RenderThread *thread, int write) {
+    SDL_LockMutex(thread->lock);
+    thread->render(thread->userData, &thread->ring[(write % thread->blocks) * thread->blockBytes], thread->blockBytes);
+    SDL_UnlockMutex(thread->lock);
+    SDL_AtomicSet(&thread->write, (write + 1) % (2 * thread->blocks));
+}
+
+void _renderThread_setScheduling(RenderThread *thread) {
+#ifdef __linux__
+    if (thread->cpus != 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu = 0; cpu < 32; cpu++) {
+            if (thread->cpus & (1u << cpu)) {
+                CPU_SET(cpu, &set);
+            }
+        }
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            fprintf(stderr, "Failed to pin the render thread to CPUs %x\n", thread->cpus);
+        }
+    }
+    if (thread->realtime) {
+        struct sched_param param = {.sched_priority = RENDER_THREAD_FIFO_PRIORITY};
+        if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+            fprintf(stderr, "No real-time scheduling for the render thread, using high priority\n");
+            SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+        }
+    }
+#else
+    if (thread->cpus != 0) {
+        fprintf(stderr, "Pinning the render thread to CPUs is not supported on this platform\n");
+    }
+    if (thread->realtime) {
+        SDL_SetThreadPriority(SDL_THREAD_PRIORITY_TIME_CRITICAL);
+    }
+#endif
+}
+
+int _renderThread_run(void *data) {
+    RenderThread *thread = (RenderThread*)data;
+    _renderThread_setScheduling(thread);
+    while (SDL_AtomicGet(&thread->running)) {
+        int write = SDL_AtomicGet(&thread->write);
+        if (_renderThread_getFill(thread, SDL_AtomicGet(&thread->read), write) == thread->blocks) {
+            SDL_SemWaitTimeout(thread->space, RENDER_THREAD_WAIT_MS);
+        } else {
+            _renderThread_renderBlock(thread, write);
+        }
+    }
+    return 0;
+}
+
+RenderThread *renderThread_init(RenderThreadFunc render, void *userData, int blockBytes, int blocks, bool realtime, Uint32 cpus) {
+    if (blockBytes <= 0 || blocks <= 0) {
+        fprintf(stderr, "Cannot render ahead %d blocks of %d bytes\n", blocks, blockBytes);
+        return NULL;
+    }
+    RenderThread *thread = calloc(1, sizeof(RenderThread));
+    if (thread == NULL) {
+        return NULL;
+    }
+    thread->render = render;
+    thread->userData = userData;
+    thread->blockBytes = blockBytes;
+    thread->blocks = blocks;
+    thread->realtime = realtime;
+    thread->cpus = cpus;
+    thread->ring = calloc(blocks, blockBytes);
+    thread->space = SDL_CreateSemaphore(0);
+    thread->lock = SDL_CreateMutex();
+    if (thread->ring == NULL || thread->space == NULL || thread->lock == NULL) {
+        fprintf(stderr, "Failed to set up the render thread\n");
+        renderThread_close(thread);
+        return NULL;
+    }
+    // Start with the ring full, the audio callback may read from it at once
+    for (int i = 0; i < blocks; i++) {
+        _renderThread_renderBlock(thread, i);
+    }
+    SDL_AtomicSet(&thread->running, 1);
+    thread->thread = SDL_CreateThread(_renderThread_run, "render", thread);
+    if (thread->thread == NULL) {
+        fprintf(stderr, "Failed to start the render thread due to %s\n", SDL_GetError());
+        renderThread_close(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+void renderThread_close(RenderThread *thread) {
+    if (thread != NULL) {
+        if (thread->thread != NULL) {
+            SDL_AtomicSet(&thread->running, 0);
+            SDL_SemPost(thread->space);
+            SDL_WaitThread(thread->thread, NULL);
+        }
+        if (thread->space != NULL) {
+            SDL_DestroySemaphore(thread->space);
+        }
+        if (thread->lock != NULL) {
+            SDL_DestroyMutex(thread->lock);
+        }
+        free(thread->ring);
+        free(thread);
+    }
+}
+
+void renderThread_read(RenderThread *thread, Uint8 *stream, int len) {
+    int read = SDL_AtomicGet(&thread->read);
+    for (int pos = 0; pos < len;) {
+        if (read == SDL_AtomicGet(&thread->write)) {
+            memset(&stream[pos], 0, len - pos);
+            SDL_AtomicAdd(&thread->underruns, 1);
+            return;
+        }
+        Uint8 *block = &thread->ring[(read % thread->blocks) * thread->blockBytes];
+        int count = thread->blockBytes - thread->readOffset;
+        count = count < len - pos ? count : len - pos;
+        memcpy(&stream[pos], &block[thread->readOffset], count);
+        pos += count;
+        thread->readOffset += count;
+        if (thread->readOffset == thread->blockBytes) {
+            thread->readOffset = 0;
+            read = (read + 1) % (2 * thread->blocks);
+            SDL_AtomicSet(&thread->read, read);
+            SDL_SemPost(thread->space);
+        }
+    }
+}
+
+void renderThread_lock(RenderThread *thread) {
+    SDL_LockMutex(thread->lock);
+}
+
+void renderThread_unlock(RenderThread *thread) {
+    SDL_UnlockMutex(thread->lock);
+}
+
+int renderThread_getUnderruns(RenderThread *thread) {
+    return SDL_AtomicGet(&thread->underruns);
+}
+
+/** Block period the test reads at, and how often and for how many periods rendering stalls */
+#define RENDER_THREAD_TEST_PERIOD_MS 1
+#define RENDER_THREAD_TEST_STALL_INTERVAL 16
+#define RENDER_THREAD_TEST_STALL_PERIODS 3
+#define RENDER_THREAD_TEST_BLOCKS 8
+
+typedef struct {
+    Sint16 counter;
+    int blocks;
+    int stalls;
+} RenderThreadTest;
+
+/**
+ * Counting signal, now and then taking several block periods for a block
+ * but never as many as are rendered ahead
+ */
+void _renderThread_testRender(void *userData, Uint8 *stream, int len) {
+    RenderThreadTest *test = (RenderThreadTest*)userData;
+    Sint16 *samples = (Sint16*)stream;
+    for (int i = 0; i < len / (int)sizeof(Sint16); i++) {
+        // Skips 0, which is the silence of an underrun
+        test->counter = test->counter == 32767 ? 1 : test->counter + 1;
+        samples[i] = test->counter;
+    }
+    test->blocks++;
+    if (test->blocks % RENDER_THREAD_TEST_STALL_INTERVAL == 0) {
+        SDL_Delay(RENDER_THREAD_TEST_STALL_PERIODS * RENDER_THREAD_TEST_PERIOD_MS);
+        test->stalls++;
+    }
+}
+
+void renderThread_test() {
+    RenderThreadTest test = {0};
+    Sint16 buffer[100];
+    int blockSamples = 64;
+    RenderThread *thread = renderThread_init(_renderThread_testRender, &test, blockSamples * sizeof(Sint16),
+            RENDER_THREAD_TEST_BLOCKS, false, 0);
+    Sint16 expected = 1;
+    int played = 0;
+    int owed = 0;
+    bool ok = true;
+
+    printf("======================TEST OF RENDER THREAD========================\n");
+    if (thread == NULL) {
+        fprintf(stderr, "Render thread test failed to start\n");
+        return;
+    }
+    // Read like an audio callback, one block per period in chunks that do not match the blocks
+    for (int chunk = 0; played < 300 * blockSamples; chunk++) {
+        int samples = 37 + chunk % 64;
+        renderThread_read(thread, (Uint8*)buffer, samples * sizeof(Sint16));
+        for (int i = 0; i < samples; i++) {
+            ok = ok && buffer[i] == expected;
+            expected = expected == 32767 ? 1 : expected + 1;
+        }
+        played += samples;
+        for (owed += samples; owed >= blockSamples; owed -= blockSamples) {
+            SDL_Delay(RENDER_THREAD_TEST_PERIOD_MS);
+        }
+    }
+    int underruns = renderThread_getUnderruns(thread);
+    renderThread_close(thread);
+    ok = ok && underruns == 0 && test.stalls > 0;
+    printf("%d samples in order through %d stalls of %d block periods, %d underruns %s\n",
+            played, test.stalls, RENDER_THREAD_TEST_STALL_PERIODS, underruns, ok ? "OK" : "FAIL");
+}
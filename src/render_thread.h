@@ -0,0 +1,58 @@
+#ifndef RENDER_THREAD_H_
+#define RENDER_THREAD_H_
+
+#include <stdbool.h>
+#include <SDL2/SDL.h>
+
+/*
+ * Thread rendering audio ahead of playback. Blocks of a fixed size are
+ * rendered into a single producer single consumer ring that the audio
+ * callback only copies from, so a block that takes long to render is
+ * absorbed by the blocks rendered ahead instead of causing a dropout.
+ */
+
+typedef struct _RenderThread RenderThread;
+
+/** Renders len bytes into stream, called with the render lock held */
+typedef void (*RenderThreadFunc)(void *userData, Uint8 *stream, int len);
+
+/**
+ * Fill a ring of blocks blocks of blockBytes bytes each with render and
+ * start a thread that renders a new block whenever one has been read.
+ * realtime asks for SCHED_FIFO scheduling, cpus is a mask of the CPUs the
+ * thread may run on, 0 for any. The thread is still started when the
+ * scheduling cannot be changed.
+ */
+RenderThread *renderThread_init(RenderThreadFunc render, void *userData, int blockBytes, int blocks, bool realtime, Uint32 cpus);
+
+/**
+ * Stop the thread. Nothing may call renderThread_read() any more.
+ */
+void renderThread_close(RenderThread *thread);
+
+/**
+ * Copy len bytes of rendered audio into stream, from the audio callback.
+ * Never waits, a ring that runs empty is played as silence.
+ */
+void renderThread_read(RenderThread *thread, Uint8 *stream, int len);
+
+/**
+ * Wait for the block being rendered and keep the thread from rendering
+ * another one until renderThread_unlock()
+ */
+void renderThread_lock(RenderThread *thread);
+
+void renderThread_unlock(RenderThread *thread);
+
+/** Number of times the ring has run empty */
+int renderThread_getUnderruns(RenderThread *thread);
+
+/**
+ * Read a counting signal through the ring at the block rate in chunks that
+ * do not match the blocks, while rendering now and then stalls for a few
+ * blocks. Check that the look-ahead absorbs the stalls and that no sample
+ * is lost or repeated.
+ */
+void renderThread_test();
+
+#endif /* RENDER_THREAD_H_ */
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "scope.h"
+
+/** Columns the ring holds for every channel, a power of two */
+#define SCOPE_RING_SIZE 1024
+/** Ring positions run over twice the size to tell a full ring from an empty one */
+#define SCOPE_POSITION_MASK (2 * SCOPE_RING_SIZE - 1)
+
+typedef struct _Scope {
+    Uint8 channels;
+    Uint16 samplesPerColumn;
+    /** Column being collected by the audio thread and the samples it has so far */
+    ScopeColumn *current;
+    Uint16 samples;
+    /** SCOPE_RING_SIZE rows of one column per channel */
+    ScopeColumn *ring;
+    /** Only the UI thread moves read and only the audio thread moves write */
+    SDL_atomic_t read;
+    SDL_atomic_t write;
+} Scope;
+
+Scope *scope_init(Uint8 channels, Uint16 samplesPerColumn) {
+    if (channels == 0 || samplesPerColumn == 0) {
+        fprintf(stderr, "Cannot create a scope of %d channels and %d samples per column\n", channels, samplesPerColumn);
+        return NULL;
+    }
+    Scope *scope = calloc(1, sizeof(Scope));
+    if (scope == NULL) {
+        return NULL;
+    }
+    scope->channels = channels;
+    scope->samplesPerColumn = samplesPerColumn;
+    scope->current = calloc(channels, sizeof(ScopeColumn));
+    scope->ring = calloc(SCOPE_RING_SIZE * channels, sizeof(ScopeColumn));
+    if (scope->current == NULL || scope->ring == NULL) {
+        scope_close(scope);
+        return NULL;
+    }
+    return scope;
+}
+
+void scope_close(Scope *scope) {
+    if (scope != NULL) {
+        free(scope->current);
+        free(scope->ring);
+        free(scope);
+    }
+}
+
+/**
+ * Put the collected columns in the ring, or drop them if it is full
+ */
+void _scope_publish(Scope *scope) {
+    int write = SDL_AtomicGet(&scope->write);
+    if (((write - SDL_AtomicGet(&scope->read)) & SCOPE_POSITION_MASK) < SCOPE_RING_SIZE) {
+        ScopeColumn *row = &scope->ring[(write & (SCOPE_RING_SIZE - 1)) * scope->channels];
+        for (int channel = 0; channel < scope->channels; channel++) {
+            row[channel] = scope->current[channel];
+        }
+        SDL_AtomicSet(&scope->write, (write + 1) & SCOPE_POSITION_MASK);
+    }
+    scope->samples = 0;
+}
+
+void scope_write(Scope *scope, const Sint16 *const *channels, int length) {
+    for (int pos = 0; pos < length;) {
+        int count = scope->samplesPerColumn - scope->samples;
+        count = count < length - pos ? count : length - pos;
+        for (int channel = 0; channel < scope->channels; channel++) {
+            ScopeColumn *column = &scope->current[channel];
+            const Sint16 *samples = channels[channel];
+            if (scope->samples == 0) {
+                column->min = samples == NULL ? 0 : samples[pos];
+                column->max = column->min;
+            }
+            if (samples == NULL) {
+                // Silence, the column ends up including 0
+                column->min = column->min > 0 ? 0 : column->min;
+                column->max = column->max < 0 ? 0 : column->max;
+                continue;
+            }
+            for (int i = pos; i < pos + count; i++) {
+                column->min = samples[i] < column->min ? samples[i] : column->min;
+                column->max = samples[i] > column->max ? samples[i] : column->max;
+            }
+        }
+        scope->samples += count;
+        pos += count;
+        if (scope->samples == scope->samplesPerColumn) {
+            _scope_publish(scope);
+        }
+    }
+}
+
+bool scope_read(Scope *scope, ScopeColumn *columns) {
+    int read = SDL_AtomicGet(&scope->read);
+    if (read == SDL_AtomicGet(&scope->write)) {
+        return false;
+    }
+    ScopeColumn *row = &scope->ring[(read & (SCOPE_RING_SIZE - 1)) * scope->channels];
+    for (int channel = 0; channel < scope->channels; channel++) {
+        columns[channel] = row[channel];
+    }
+    SDL_AtomicSet(&scope->read, (read + 1) & SCOPE_POSITION_MASK);
+    return true;
+}
+
+void scope_test() {
+    Uint16 samplesPerColumn = 8;
+    Scope *scope = scope_init(2, samplesPerColumn);
+    Sint16 ramp[100];
+    ScopeColumn columns[2];
+    bool ok = true;
+    int read = 0;
+
+    printf("======================TEST OF SCOPE========================\n");
+    if (scope == NULL) {
+        fprintf(stderr, "Scope test failed to start\n");
+        return;
+    }
+    for (int i = 0; i < 100; i++) {
+        ramp[i] = i % 2 == 0 ? i : -i;
+    }
+    // Blocks that do not line up with the columns, channel 1 silent
+    const Sint16 *channels[] = {ramp, NULL};
+    scope_write(scope, channels, 5);
+    channels[0] = &ramp[5];
+    scope_write(scope, channels, 95);
+    for (; scope_read(scope, columns); read++) {
+        int first = read * samplesPerColumn;
+        int last = first + samplesPerColumn - 1;
+        int min = -(last % 2 == 1 ? last : last - 1);
+        int max = last % 2 == 0 ? last : last - 1;
+        ok = ok && columns[0].min == min && columns[0].max == max && columns[1].min == 0 && columns[1].max == 0;
+    }
+    ok = ok && read == 100 / samplesPerColumn;
+    printf("%d columns of partial blocks %s\n", read, ok ? "OK" : "FAIL");
+
+    // Columns beyond the ring size are dropped until the reader catches up
+    Sint16 silence[256] = {0};
+    channels[0] = silence;
+    for (int i = 0; i < 2 * SCOPE_RING_SIZE * samplesPerColumn / 256; i++) {
+        scope_write(scope, channels, 256);
+    }
+    for (read = 0; scope_read(scope, columns); read++);
+    scope_write(scope, channels, samplesPerColumn);
+    ok = ok && read == SCOPE_RING_SIZE && scope_read(scope, columns) && !scope_read(scope, columns);
+    printf("%d columns after overflow %s\n", read, ok ? "OK" : "FAIL");
+    scope_close(scope);
+}
@@ -0,0 +1,48 @@
+#ifndef SCOPE_H_
+#define SCOPE_H_
+
+#include <stdbool.h>
+#include <SDL2/SDL.h>
+
+/*
+ * Oscilloscope data carried from the audio thread to the UI thread. The
+ * audio thread writes blocks of channel output, which are reduced to the
+ * minimum and maximum of every column of samples and put in a single
+ * producer single consumer ring. Neither side ever waits for the other,
+ * columns that do not fit in the ring are dropped.
+ */
+
+typedef struct {
+    Sint16 min;
+    Sint16 max;
+} ScopeColumn;
+
+typedef struct _Scope Scope;
+
+/**
+ * Create a scope for a number of channels, columns are samplesPerColumn
+ * samples wide
+ */
+Scope *scope_init(Uint8 channels, Uint16 samplesPerColumn);
+
+void scope_close(Scope *scope);
+
+/**
+ * Add length samples of output of every channel, on the audio thread. NULL
+ * buffers are silent channels.
+ */
+void scope_write(Scope *scope, const Sint16 *const *channels, int length);
+
+/**
+ * Take the next column of every channel, on the UI thread. columns must
+ * hold one column per channel. Returns false if there are no new columns.
+ */
+bool scope_read(Scope *scope, ScopeColumn *columns);
+
+/**
+ * Write known waveforms and check the columns read back, also when the
+ * ring overflows
+ */
+void scope_test();
+
+#endif /* SCOPE_H_ */
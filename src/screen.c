@@ -42,6 +42,7 @@
 #define ANALYZER_Y_SPACING 28
 #define ANALYZER_Y_OFFSET 13
 #define ANALYZER_AUDIO_SCALER (65000/ANALYZER_Y_SPACING)
+#define VISIBLE_TRACKS 4
 
 typedef struct {
     Uint8 x;
@@ -57,7 +58,7 @@ typedef struct {
     SDL_Texture *noteBeatTexture[128];
     SDL_Texture *asciiTexture[256];
     ColumnHighlightPos columnHighlight[4];
-    bool mute[16];
+    bool *mute;
     int noteWidth[128];
     int noteHeight[128];
     TTF_Font *font;
@@ -76,6 +77,8 @@ typedef struct {
     Uint8 selectedTrack;
     Uint8 selectedColumn;
     Uint8 numberOfTracks;
+    /** Tracks scroll horizontally so that the selected track is visible */
+    Uint8 firstVisibleTrack;
     Uint8 stepping;
     Uint8 selectedPatch;
     Uint8 octave;
@@ -85,8 +88,7 @@ typedef struct {
     Uint32 ticks;
     Uint32 statusTimer;
     Uint32 statusOffset;
-    Sint16 analyzer[TRACKS_PER_PATTERN][ANALYZER_WIDTH];
-    Sint16 analyzerLastV[TRACKS_PER_PATTERN];
+    ScopeColumn (*analyzer)[ANALYZER_WIDTH];
 } Screen;
 
 SDL_Color statusColor = {255,255,255};
@@ -225,9 +227,9 @@ bool screen_init(Uint8 numberOfTracks) {
         free(screen);
     }
     screen = calloc(1, sizeof(Screen));
-    screen->numberOfTracks = numberOfTracks;
-    screen->tracks = calloc(numberOfTracks, sizeof(Track*));
-
+    if (!screen_setNumberOfTracks(numberOfTracks)) {
+        return false;
+    }
 
     screen->window = SDL_CreateWindow(
             "Pixla",
@@ -253,6 +255,39 @@ bool screen_init(Uint8 numberOfTracks) {
 
 }
 
+void _screen_freeTrackArrays() {
+    free(screen->tracks);
+    free(screen->mute);
+    free(screen->analyzer);
+    screen->tracks = NULL;
+    screen->mute = NULL;
+    screen->analyzer = NULL;
+    screen->numberOfTracks = 0;
+}
+
+bool screen_setNumberOfTracks(Uint8 numberOfTracks) {
+    if (screen == NULL) {
+        return false;
+    }
+    _screen_freeTrackArrays();
+    screen->tracks = calloc(numberOfTracks, sizeof(Track*));
+    screen->mute = calloc(numberOfTracks, sizeof(bool));
+    screen->analyzer = calloc(numberOfTracks, sizeof(*screen->analyzer));
+    if (screen->tracks == NULL || screen->mute == NULL || screen->analyzer == NULL) {
+        fprintf(stderr, "Failed to allocate screen data for %d tracks\n", numberOfTracks);
+        _screen_freeTrackArrays();
+        return false;
+    }
+    screen->numberOfTracks = numberOfTracks;
+    screen->selectedTrack = 0;
+    screen->firstVisibleTrack = 0;
+    return true;
+}
+
+Uint8 screen_getFirstVisibleTrack() {
+    return screen->firstVisibleTrack;
+}
+
 void screen_close() {
     if (NULL != screen) {
         for (int i = 0; i < 128; i++) {
@@ -283,6 +318,7 @@ void screen_close() {
         }
         TTF_Quit();
         SDL_Quit();
+        _screen_freeTrackArrays();
         free(screen);
         screen = NULL;
     }
@@ -375,6 +411,11 @@ void screen_setSelectedTrack(Uint8 track) {
     }
     screen->selectedColumn = 0;
     screen->selectedTrack = track;
+    if (track < screen->firstVisibleTrack) {
+        screen->firstVisibleTrack = track;
+    } else if (track >= screen->firstVisibleTrack + VISIBLE_TRACKS) {
+        screen->firstVisibleTrack = track - VISIBLE_TRACKS + 1;
+    }
 }
 
 void screen_setRowOffset(Sint8 rowOffset) {
@@ -395,6 +436,11 @@ int getColumnOffset(int column) {
     return 36+column*92;
 }
 
+int _screen_getVisibleTracks() {
+    int tracks = screen->numberOfTracks - screen->firstVisibleTrack;
+    return tracks < VISIBLE_TRACKS ? tracks : VISIBLE_TRACKS;
+}
+
 
 void screen_selectPatch(Uint8 patch, Instrument *instrument) {
    screen->selectedPatch = patch;
@@ -426,6 +472,9 @@ void screen_setTrackermode(Trackermode trackermode) {
 }
 
 void screen_setChannelMute(Uint8 track, bool mute) {
+    if (track >= screen->numberOfTracks) {
+        return;
+    }
     screen->mute[track] = mute;
 }
 
@@ -462,19 +511,18 @@ void _screen_setWaveBaseColor() {
     SDL_SetRenderDrawColor(screen->renderer, 35,5,35,100);
 }
 
-void screen_drawAnalyzer(Uint8 track, Sint16 *samples, Uint16 length) {
-    if (screen == NULL || length == 0) {
+void screen_drawAnalyzer(Uint8 track, const ScopeColumn *columns, Uint16 length) {
+    if (screen == NULL || length < ANALYZER_WIDTH || track >= screen->numberOfTracks) {
         return;
     }
     int step = length / ANALYZER_WIDTH;
-    for (int i = 0; i < length; i+=step) {
-/*        Sint32 average = 0;
-        for (int j = 0; j < step; j++) {
-            average += samples[i+j];
-        }*/
-        screen->analyzer[track][i/step] = samples[i];
-
-        //screen->analyzer[track][i/step] = (Sint32)average/(Sint32)step;
+    for (int x = 0; x < ANALYZER_WIDTH; x++) {
+        ScopeColumn column = columns[x * step];
+        for (int i = x * step + 1; i < (x + 1) * step; i++) {
+            column.min = columns[i].min < column.min ? columns[i].min : column.min;
+            column.max = columns[i].max > column.max ? columns[i].max : column.max;
+        }
+        screen->analyzer[track][x] = column;
     }
 }
 void _screen_renderSong() {
@@ -526,8 +574,8 @@ void _screen_renderColumns() {
             SDL_Color *textColor = isBeat ? &noteBeatColor : &noteColor;
             screen_print(8, screenY, screen->rowNumbers[offset], textColor);
 
-            for (int x = 0; x < screen->numberOfTracks; x++) {
-                Track *track = screen->tracks[x];
+            for (int x = 0; x < _screen_getVisibleTracks(); x++) {
+                Track *track = screen->tracks[screen->firstVisibleTrack + x];
                 if (NULL == track || offset >= TRACK_LENGTH) {
                     continue;
                 }
@@ -566,8 +614,8 @@ void _screen_renderColumns() {
 
     SDL_SetRenderDrawBlendMode(screen->renderer, SDL_BLENDMODE_BLEND);
     SDL_SetRenderDrawColor(screen->renderer, 0,0,0,200);
-    for (int i = 0; i < screen->numberOfTracks; i++) {
-        if (screen->mute[i]) {
+    for (int i = 0; i < _screen_getVisibleTracks(); i++) {
+        if (screen->mute[screen->firstVisibleTrack + i]) {
             SDL_Rect pos2 = {
                     .x=getColumnOffset(i),
                     .y=getTrackRowY(0)-1,
@@ -590,7 +638,7 @@ void _screen_renderColumns() {
             _screen_setDisabledCursorColor();
         }
         SDL_Rect pos2 = {
-                .x=getColumnOffset(screen->selectedTrack)+screen->columnHighlight[screen->selectedColumn].x-2,
+                .x=getColumnOffset(screen->selectedTrack - screen->firstVisibleTrack)+screen->columnHighlight[screen->selectedColumn].x-2,
                 .y=getTrackRowY(editOffset)-2,
                 .w=screen->columnHighlight[screen->selectedColumn].w+3,
                 .h=12
@@ -729,20 +777,26 @@ void _screen_renderSongPanel() {
     SDL_SetRenderDrawBlendMode(screen->renderer, SDL_BLENDMODE_NONE);
     if (strlen(screen->statusMsg) == 0) {
         screen_print(PANEL_X_OFFSET, STATUS_MSG_ROW, screen->songName, &statusColor);
-        for (int i = 0; i < TRACKS_PER_PATTERN; i++) {
+        for (int y = 0; y < _screen_getVisibleTracks(); y++) {
+            int i = screen->firstVisibleTrack + y;
             int xOfs = PANEL_X_OFFSET + 3; //+(i%2)*ANALYZER_X_SPACING;
-            int yOfs = PANEL_Y_OFFSET + ANALYZER_Y_OFFSET + ANALYZER_Y_SPACING * i;
+            int yOfs = PANEL_Y_OFFSET + ANALYZER_Y_OFFSET + ANALYZER_Y_SPACING * y;
             _screen_setWaveBaseColor();
             SDL_RenderDrawLine(screen->renderer, xOfs, yOfs,xOfs + ANALYZER_WIDTH, yOfs);
             _screen_setWaveColor();
             for (int s = 0; s < ANALYZER_WIDTH; s++) {
-                int v = screen->analyzer[i][s]/ANALYZER_AUDIO_SCALER;
+                ScopeColumn *column = &screen->analyzer[i][s];
+                // Reach the previous column so that steep edges stay connected
+                Sint16 min = column->min;
+                Sint16 max = column->max;
+                if (s > 0) {
+                    min = screen->analyzer[i][s-1].max < min ? screen->analyzer[i][s-1].max : min;
+                    max = screen->analyzer[i][s-1].min > max ? screen->analyzer[i][s-1].min : max;
+                }
                 SDL_RenderDrawLine(screen->renderer,
-                        xOfs+s, yOfs + screen->analyzerLastV[i],
-                        xOfs+s+1, yOfs+ v
+                        xOfs+s, yOfs + min/ANALYZER_AUDIO_SCALER,
+                        xOfs+s, yOfs + max/ANALYZER_AUDIO_SCALER
                         );
-
-                screen->analyzerLastV[i] = v;
             }
         }
 
@@ -11,6 +11,7 @@
 #include "settings_component.h"
 #include "file_selector.h"
 #include "inputfield.h"
+#include "scope.h"
 
 /*
  * Initialize screen
@@ -22,6 +23,12 @@
  */
 bool screen_init(Uint8 numberOfTracks);
 
+/*
+ * Change the number of tracks to display. Track data, mutes and analyzer
+ * values are reset.
+ */
+bool screen_setNumberOfTracks(Uint8 numberOfTracks);
+
 /*
  * Close screen
  *
@@ -52,8 +59,16 @@ void screen_setFileSelector(FileSelector *fileSelector);
 
 void screen_songNameField(Inputfield *inputfield);
 
+/*
+ * Select a track, scrolling the pattern view horizontally to show it
+ */
 void screen_setSelectedTrack(Uint8 track);
 
+/*
+ * Return the leftmost track shown in the pattern view
+ */
+Uint8 screen_getFirstVisibleTrack();
+
 void screen_setSelectedColumn(Uint8 column);
 
 void screen_setStepping(Uint8 stepping);
@@ -74,7 +89,11 @@ void screen_setChannelMute(Uint8 track, bool mute);
 
 void screen_setTableToShow(Sint8 *table, Uint8 elements);
 
-void screen_drawAnalyzer(Uint8 track, Sint16 *samples, Uint16 length);
+/*
+ * Show length scope columns of a track in its analyzer, merged into the
+ * columns the analyzer is wide
+ */
+void screen_drawAnalyzer(Uint8 track, const ScopeColumn *columns, Uint16 length);
 
 SDL_Color *screen_getDefaultColor();
 
@@ -1,13 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "song.h"
 #include "pattern.h"
 
-void song_clear(Song *song) {
+bool song_clear(Song *song) {
+    if (!song_setTracks(song, DEFAULT_TRACKS_PER_PATTERN)) {
+        return false;
+    }
     for (int pattern = 0; pattern < MAX_PATTERNS; pattern++) {
-        pattern_clear(&song->patterns[pattern]);
-        for (int i = 0; i < MAX_PATTERNS; i++) {
-            song->arrangement[i].pattern = -1;
-        }
+        pattern_clear(&song->patterns[pattern], song->tracks);
+    }
+    for (int i = 0; i < MAX_PATTERNS; i++) {
+        song->arrangement[i].pattern = -1;
     }
     song->arrangement[0].pattern = 0;
     song->bpm = 58;
+    return true;
+}
+
+bool song_setTracks(Song *song, Uint8 tracks) {
+    if (tracks < MIN_TRACKS_PER_PATTERN || tracks > MAX_TRACKS_PER_PATTERN) {
+        fprintf(stderr, "Number of tracks %d outside supported range %d-%d\n",
+                tracks, MIN_TRACKS_PER_PATTERN, MAX_TRACKS_PER_PATTERN);
+        return false;
+    }
+    if (song->trackData != NULL && song->tracks == tracks) {
+        return true;
+    }
+    Track *trackData = malloc(MAX_PATTERNS * tracks * sizeof(Track));
+    if (trackData == NULL) {
+        fprintf(stderr, "Failed to allocate %d tracks\n", tracks);
+        return false;
+    }
+    int tracksToKeep = song->trackData == NULL ? 0 : (song->tracks < tracks ? song->tracks : tracks);
+    for (int pattern = 0; pattern < MAX_PATTERNS; pattern++) {
+        Track *patternTracks = &trackData[pattern * tracks];
+        if (tracksToKeep > 0) {
+            memcpy(patternTracks, song->patterns[pattern].tracks, tracksToKeep * sizeof(Track));
+        }
+        for (int track = tracksToKeep; track < tracks; track++) {
+            track_clear(&patternTracks[track]);
+        }
+        song->patterns[pattern].tracks = patternTracks;
+    }
+    free(song->trackData);
+    song->trackData = trackData;
+    song->tracks = tracks;
+    return true;
+}
+
+void song_close(Song *song) {
+    if (song != NULL) {
+        free(song->trackData);
+        song->trackData = NULL;
+        for (int pattern = 0; pattern < MAX_PATTERNS; pattern++) {
+            song->patterns[pattern].tracks = NULL;
+        }
+        song->tracks = 0;
+    }
 }
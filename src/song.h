@@ -1,6 +1,8 @@
 #ifndef SONG_H_
 #define SONG_H_
 
+#include <stdbool.h>
+
 #include "pattern.h"
 #include "instrument.h"
 
@@ -18,8 +20,29 @@ typedef struct {
     Instrument instruments[MAX_INSTRUMENTS];
     PatternPtr arrangement[MAX_PATTERNS];
     int bpm;
+    /** Number of tracks in each pattern and channels used to play the song */
+    Uint8 tracks;
+    /** Storage of the pattern tracks, MAX_PATTERNS * tracks */
+    Track *trackData;
 } Song;
 
-void song_clear(Song *song);
+/**
+ * Clear the song and set the number of tracks to DEFAULT_TRACKS_PER_PATTERN.
+ * A zero initialized song must be cleared before use. Returns false if the
+ * patterns could not be allocated.
+ */
+bool song_clear(Song *song);
+
+/**
+ * Change the number of tracks in all patterns. The notes of the tracks that
+ * remain are kept and added tracks are empty. Returns false and keeps the
+ * song unchanged if the number is out of range or allocation fails.
+ */
+bool song_setTracks(Song *song, Uint8 tracks);
+
+/**
+ * Free the pattern storage of the song
+ */
+void song_close(Song *song);
 
 #endif /* SONG_H_ */
@@ -1,10 +1,18 @@
 
 #include <SDL2/SDL.h>
+#include <math.h>
 #include <stdio.h>
-#include <time.h>
 
 #include "synth.h"
 #include "frequency_table.h"
+#include "lfo.h"
+#include "pattern.h"
+#include "rcu.h"
+#include "render_thread.h"
+#include "scope.h"
+#include "voicebank.h"
+#include "synth_tables.h"
+#include "wavetable.h"
 
 typedef enum {
     ATTACK,
@@ -17,13 +25,29 @@ typedef enum {
 
 typedef struct _Channel Channel;
 
+/** SYNTH_BLOCK_SIZE must be a multiple of ADSR_PWM_PRESCALER */
+#define ADSR_PWM_PRESCALER 16
+#define SYNTH_SUB_BLOCKS (SYNTH_BLOCK_SIZE / ADSR_PWM_PRESCALER)
+
 typedef struct _Synth Synth;
 
-/*
- * Function to create a byte in the waveform
+typedef struct _SubBlock SubBlock;
+
+/**
+ * Oscillator loop for one waveform, writes length samples of a voice from
+ * its phases. phase and wave point at the voice's lane, rows stride apart.
  */
-typedef Sint8 (*GenerateWaveformFunc)(Uint8 offset);
+typedef void (*SynthKernel)(Synth *synth, Channel *ch, SubBlock *osc, const Uint16 *phase, Sint16 *wave, int stride, int length);
 
+/**
+ * Reciprocal of a divisor which only changes at control rate, so that a
+ * per sample division becomes a multiplication, a shift and a correction
+ */
+typedef struct {
+    Uint32 divisor;
+    Uint32 multiplier;
+    Uint8 shift;
+} Reciprocal;
 
 #define SWIPE_OFFSET_SCALE 480000
 #define SWIPE_LIMIT 4
@@ -37,22 +61,79 @@ typedef struct {
 typedef struct {
     Uint8 frequency;
     Uint8 amplitude;
+    Lfo lfo;
 } Modulation;
 
 typedef struct {
     Uint8 speed;
-    Sint8 notes[256];
+    Sint8 notes[SYNTH_MAX_ARPEGGIO_NOTES];
     Uint8 notesLength;
 } PitchModulation;
 
 #define FREQ_SWIPE_NOTE_SCALER 32
 
+#define NO_LANE 0xFF
+#define NO_VOICE 0xFF
+
+/** Odd harmonics of a triangle fall by 1/k^2, the 17th is the last within 50 dB of the fundamental */
+#define TRIANGLE_HARMONICS 17
+
+/** The noise generator is clocked 2^(16-NOISE_CLOCK_SHIFT) times per oscillator cycle */
+#define NOISE_CLOCK_SHIFT 11
+
+/**
+ * Wave segment of a compiled patch, holding what a voice takes over when
+ * the segment starts
+ */
 typedef struct {
-    Uint16 wavePos;
+    /** Playtime in samples at which the segment ends, 0xFFFFFFFF for the last segment */
+    Uint32 end;
+    Waveform waveform;
+    /** Oscillator loop of the waveform */
+    SynthKernel kernel;
+    /** Band limited tables of the waveform, NULL for waveforms computed per sample */
+    const Wavetable *wavetable;
+    /** Start duty cycle in 1/65536, 0 keeps the duty cycle of the previous segment */
     Uint16 dutyCycle;
     Uint16 carrierFrequency;
+    /** Ring modulation carrier phase increment for carrierFrequency, 1/2^32 cycle per sample */
+    Uint32 carrierStep;
+    Sint8 pwm;
+    Sint8 note;
+    Sint8 filter;
+    /** Relative volume 1-127, the default for 0 already applied */
+    Sint8 volume;
+} PatchSegment;
+
+/**
+ * Instrument compiled by synth_loadPatch() for the current sample rate, so
+ * that the voices only compare their playtime with the next segment end.
+ * Never changed once published, loading the patch again publishes a new one.
+ */
+typedef struct {
+    PatchSegment segments[MAX_WAVESEGMENTS];
+    /** Envelope coefficients, 0 for stages of zero length */
+    Uint32 attackCoefficient;
+    Uint32 decayCoefficient;
+    Uint32 releaseCoefficient;
+    /** Sustain level in envelope level units */
+    Sint32 sustainLevel;
+    /** Changes on every load, makes playing voices look up their segment again */
+    Uint32 revision;
+} Patch;
+
+typedef struct {
+    Uint16 dutyCycle;
+    Uint16 carrierFrequency;
+    /** Ring modulation carrier phase increment for carrierFrequency, 1/2^32 cycle per sample */
+    Uint32 carrierStep;
+    SynthKernel kernel;
+    const Wavetable *wavetable;
     Sint8 pwm;
     Uint8 currentSegment;
+    /** Playtime at which the current segment ends and patch revision it was looked up in */
+    Uint32 segmentEnd;
+    Uint32 patchRevision;
     Sint8 filter;
     Sint8 volume;
     Swipe swipe;
@@ -64,13 +145,39 @@ typedef struct {
 
 typedef struct {
     Modulation amplitudeModulation;
+    /** Envelope level with tremolo applied, 0-32767 */
     Sint16 amplitude;
-    Uint16 adsrTimer;
+    /** Requested envelope stage, set by note trigger, release and off */
     Adsr adsr;
+    /** Stage the envelope generator has been set up for, differs from adsr when a new stage is requested */
+    Adsr stage;
+    /** Envelope level, amplitude with ENVELOPE_FRACTION_BITS fractional bits */
+    Sint32 level;
+    /** Level the current stage approaches, beyond the level where it ends */
+    Sint32 target;
+    Sint32 stageEnd;
+    /** Part of the distance to target covered each sub-block, 24 fractional bits */
+    Uint32 coefficient;
     Uint8 volume;
 } AmpData;
 /*
- * Definition of an oscillator channel
+ * Oscillator settings captured by the control pass for one sub-block
+ */
+typedef struct _SubBlock {
+    /** Oscillator loop of the segment waveform, or the silent one */
+    SynthKernel kernel;
+    /** Band limited table for the pitch of the sub-block, NULL for computed waveforms */
+    const Sint8 *wavetable;
+    Uint16 dutyCycle;
+    /** Ring modulation carrier phase increment, 1/2^32 cycle per sample */
+    Uint32 carrierStep;
+    bool audible;
+} SubBlock;
+
+/*
+ * Definition of an oscillator channel, a voice of the synth's voice pool
+ * which plays the notes of one tracker channel at a time. Only control rate
+ * state lives here, the per sample state is kept in the synth's VoiceBank.
  */
 typedef struct _Channel {
     Uint32 playtime;
@@ -78,148 +185,374 @@ typedef struct _Channel {
     Sint8 note;
     WaveData waveData;
     AmpData ampData;
-    bool mute;
-    Sint8 mean;
+    /** Tracker channel the voice plays, or last played, a note of */
+    Uint8 owner;
+    /** Synth clock when the note was released, orders voices for stealing */
+    Uint32 releaseTime;
+    /** Frequency and phase increment cached from the last pitch calculation */
+    Uint32 scaledFrequency;
+    Uint16 phaseStep;
+    /** Set when an input to the pitch calculation has changed */
+    bool pitchDirty;
+    /** Playtime of the next arpeggio step, when the pitch must be recalculated */
+    Uint32 nextPitchChange;
+    /** Arpeggio note length in samples and index of the current note */
+    Uint32 arpeggioStep;
+    Uint8 arpeggioPos;
+    /** Ring modulation carrier phase accumulator, 1/2^32 cycle */
+    Uint32 carrierPos;
+    /** Xorshift noise generator state, never 0 */
+    Uint32 noiseState;
+    /** Phase accumulator and lowpass filter state, loaded into the voice bank while the channel is active */
+    Uint16 wavePos;
+    Sint16 mean;
+    float floatMean;
+    /** Voice gain at the end of the previous sub-block, the start of the next gain ramp */
+    Sint16 gain;
+    /**
+     * Samples until the next envelope and PWM tick. Ticks fall due every
+     * ADSR_PWM_PRESCALER samples and run at the start of the sub-block
+     * they fall in, so short sub-blocks at sequencer events do not speed
+     * up the envelope.
+     */
+    Sint8 controlCountdown;
+    /** Voice bank rate shift of the last block, vibrato and glides are sampled at the same rate */
+    Uint8 rateShift;
+    /** Last outputs of the voice, read by the upsampler when it runs at a reduced rate */
+    Sint16 outputHistory[VOICEBANK_HISTORY];
+    /** Voice bank lane of the channel in the current block, NO_LANE while idle */
+    Uint8 lane;
+    /** Phase at which the noise generator was last sampled */
+    Uint16 noisePos;
+    Sint8 noiseValue;
+    SubBlock subBlocks[SYNTH_SUB_BLOCKS];
     PitchModulation pitchModulation;
 } Channel;
 
+/** Channel and synth settings a queued command changes */
+typedef enum {
+    COMMAND_NOTE_TRIGGER,
+    COMMAND_NOTE_PITCH,
+    COMMAND_NOTE_RELEASE,
+    COMMAND_NOTE_OFF,
+    COMMAND_PITCH_MODULATION,
+    COMMAND_FREQUENCY_MODULATION,
+    COMMAND_AMPLITUDE_MODULATION,
+    COMMAND_GLIDE,
+    COMMAND_GLIDE_RESET,
+    COMMAND_CHANNEL_VOLUME,
+    COMMAND_GLOBAL_VOLUME,
+    COMMAND_MUTE
+} CommandType;
+
+/**
+ * Arguments of a synth_* call queued for the audio callback, only the
+ * fields of its type are set
+ */
+typedef struct {
+    CommandType type;
+    Uint8 channel;
+    Uint8 patch;
+    Sint8 note;
+    /** Volume, modulation frequency or glide speed */
+    Uint8 value;
+    /** Modulation amplitude */
+    Uint8 amplitude;
+    /** Glide direction, -1, 0 or 1 */
+    Sint8 direction;
+    bool mute;
+    PitchModulation pitchModulation;
+} Command;
+
+/** Commands the queue holds, a power of two */
+#define COMMAND_QUEUE_SIZE 1024
+/** Queue positions run over twice the size to tell a full queue from an empty one */
+#define COMMAND_POSITION_MASK (2 * COMMAND_QUEUE_SIZE - 1)
+
 /*
  * Definition of the synth
  */
 typedef struct _Synth {
-    SoundOutputHook soundOutputHook;
+    SynthChannelTap channelTap;
     void *userData;
     FrequencyTable *frequencyTable;
-    Uint16 sampleFreq;
-    Sint8 lowpassSaw[256];
-    Sint8 lowpassPulse[256];
-    Uint8 attackTable[512];
-    Uint8 decayReleaseTable[512];
+    Uint32 sampleFreq;
+    Reciprocal sampleFreqReciprocal;
+    /** Envelope table steps per envelope tick, 8 fractional bits */
+    Uint32 adsrTimescaler;
+    /** Glide offset of one octave, glide speed is given in offset units per sample */
+    Sint32 swipeOffsetScale;
+    Reciprocal swipeOffsetReciprocal;
+    /** 2^(EXP2_TABLE_BITS + 48) / swipeOffsetScale, maps a fraction of an octave to the exp2 table */
+    Uint64 swipeFractionScaler;
     SDL_AudioDeviceID audio;
+    /** Renders ahead of the audio callback when renderAhead is set, NULL otherwise */
+    RenderThread *renderThread;
+    /** Voice pool, voices entries */
     Channel *channelData;
+    Uint8 voices;
+    VoiceStealing voiceStealing;
+    /** Voice playing the latest note of each tracker channel, always set */
+    Uint8 *channelVoices;
+    /** Mute state applied by the audio callback */
+    bool *mutedChannels;
+    /** Mute state as requested with synth_muteChannel(), ahead of mutedChannels until the command is applied */
+    bool *requestedMutes;
+    /** Per channel sums of the voice outputs of a block and their clipped values, for the channel tap */
+    Sint32 *channelSums;
+    Sint16 *channelBuffers;
+    /** Buffer of each channel handed to the channel tap, NULL for silent channels */
+    const Sint16 **tapBuffers;
+    VoiceBank *voiceBank;
+    /** Channel of each voice bank lane, audible channels first, then muted ones */
+    Uint8 *lanes;
+    /** Lanes holding channels with a running envelope */
+    int activeLanes;
+    /** Lanes holding channels which are also not muted */
+    int audibleLanes;
+    Sint32 mixBuffer[SYNTH_BLOCK_SIZE];
+    float floatMixBuffer[SYNTH_BLOCK_SIZE];
+    /** Channel 0 phase increment for each sub-block of the current block, used as ring modulation carrier */
+    Uint32 carrierSteps[SYNTH_SUB_BLOCKS];
+    /** Instruments as loaded, kept to compile them again when the sample rate changes */
     Instrument *instruments;
+    /** Published patch of each instrument, read with _synth_getPatch() */
+    Patch **patches;
+    /** Reclaims the patches replaced by synth_loadPatch(), the audio callback is the reader */
+    Rcu patchRcu;
     Uint8 channels;
-    /** Store sine values between -32768 and 32767 */
-    Sint16 sineTable[65536];
-    /** 8192 represents 1/2 and 32768 represents 2. Mid index 32768 means 16384 aka 1 */
-    Uint16 halfToDoubleModulationTable[65536];
+    /** Gain applied to the sum of all voices, 32768 = 1 */
+    Sint32 mixScaler;
+    /** mixScaler for the float mix, which is scaled to -1..1 */
+    float floatMixScaler;
+    /** Samples rendered since init */
     Uint32 clock;
+    /** Called at exact sample positions, sequencerCountdown samples from now */
+    SynthSequencer sequencer;
+    void *sequencerData;
+    Uint32 sequencerCountdown;
+    /**
+     * Single producer single consumer ring of commands for the audio
+     * callback. Only the producer moves commandWrite and only the callback
+     * moves commandRead, neither ever waits for a lock.
+     */
+    Command *commands;
+    SDL_atomic_t commandRead;
+    SDL_atomic_t commandWrite;
+    /** Queue commands instead of applying them, set when the synth plays to an audio device */
+    bool queueCommands;
     Uint8 volume;
+    bool compactTables;
+    bool floatOutput;
+    /** Highest harmonic of a reduced rate voice in percent of the reduced Nyquist frequency, 0 = off */
+    Uint8 multiRateThreshold;
 } Synth;
 
-#define SAMPLE_RATE 48000
-#define SAMPLE_RATE_MS 48
+/**
+ * Sample rate the envelope, glide and vibrato speeds are defined at, they are
+ * scaled so that other sample rates sound the same
+ */
+#define REFERENCE_SAMPLE_RATE 48000
+#define MIN_SAMPLE_RATE 8000
+#define MAX_SAMPLE_RATE 192000
 #define MODULATION_SCALER 12
-#define ADSR_PWM_PRESCALER 16
+
+/** Low frequency oscillator frequency in 1/65536 Hz per unit of modulation frequency, vibrato runs MODULATION_SCALER times slower */
+#define VIBRATO_RATE (REFERENCE_SAMPLE_RATE / MODULATION_SCALER)
+#define TREMOLO_RATE 65536
+
+/*
+ * Up to MIX_HEADROOM_CHANNELS voices the mix is scaled so that it can never
+ * clip. Beyond that the gain falls with the square root of the number of
+ * voices, which keeps the loudness of uncorrelated voices about the same,
+ * and the rare peaks above full scale are clipped.
+ */
+#define MIX_HEADROOM_CHANNELS 4
+#define MIX_FULL_SCALE 30000
 #define ADSR_MAX_TIME_IN_SECS 5
 
 //Uint16 adsrTimescaler = (255 * 127 * ADSR_PWM_PRESCALER)/(ADSR_MAX_TIME_IN_SECS * SAMPLE_RATE) = 2.67
-/** Scaled up two times */
-#define ADSR_TIMESCALER_2 (511 * 127 * ADSR_PWM_PRESCALER)/(ADSR_MAX_TIME_IN_SECS * SAMPLE_RATE)
+/** Scaled up two times, at the reference sample rate */
+#define ADSR_TIMESCALER_2 (511 * 127 * ADSR_PWM_PRESCALER)/(ADSR_MAX_TIME_IN_SECS * REFERENCE_SAMPLE_RATE)
 
+/*
+ * Envelope stages are exponential approaches to a target beyond the level
+ * where the stage ends, which bounds their length. The attack aims this many
+ * 1/256 above full scale, giving a curve close to a square root, and decay
+ * and release this many 1/256 of their distance below their end.
+ */
+#define ENVELOPE_FRACTION_BITS 8
+#define ENVELOPE_PEAK (32767 << ENVELOPE_FRACTION_BITS)
+#define ENVELOPE_ATTACK_OVERSHOOT 51
+#define ENVELOPE_DECAY_UNDERSHOOT 3
+#define ENVELOPE_COEFFICIENT_BITS 24
 
-void _synth_updateAdsr(Synth *synth, Channel *ch) {
-    Instrument *instr = &synth->instruments[ch->patch];
-    AmpData *amp = &ch->ampData;
-    // Snapshot current instrument settings to avoid concurrent modification
-    Sint8 attack = instr->attack;
-    Sint8 decay = instr->decay;
-    Sint8 sustain = instr->sustain;
-    Sint8 release = instr->release;
 
-    switch(amp->adsr) {
+Reciprocal _synth_getReciprocal(Uint32 divisor) {
+    Reciprocal reciprocal = {.divisor = divisor, .shift = 31};
+    while ((1u << (reciprocal.shift - 31)) < divisor) {
+        reciprocal.shift++;
+    }
+    reciprocal.multiplier = (1ull << reciprocal.shift) / divisor;
+    return reciprocal;
+}
+
+/**
+ * Exact x / divisor. The multiplier is rounded down so the estimate is at
+ * most one too small, which the remainder reveals.
+ */
+Uint32 _synth_divide(Uint32 x, Reciprocal *reciprocal) {
+    Uint32 quotient = ((Uint64)x * reciprocal->multiplier) >> reciprocal->shift;
+    if (x - quotient * reciprocal->divisor >= reciprocal->divisor) {
+        quotient++;
+    }
+    return quotient;
+}
+
+/**
+ * Sine value between -32767 and 32767 for a phase of 1/65536 cycle
+ */
+Sint16 _synth_getSine(Synth *synth, Uint16 pos) {
+    if (!synth->compactTables) {
+        return synthTables_sine[pos];
+    }
+    const int shift = 14 - QUARTER_SINE_TABLE_BITS;
+    const Sint16 *table = synthTables_quarterSine;
+    Uint16 quarterPos = pos & 0x3FFF;
+    if (pos & 0x4000) {
+        quarterPos = 0x4000 - quarterPos;
+    }
+    Uint16 index = quarterPos >> shift;
+    Sint32 weight = quarterPos & ((1 << shift) - 1);
+    Sint16 value = table[index] + (((table[index + 1] - table[index]) * weight) >> shift);
+    return (pos & 0x8000) ? -value : value;
+}
+
+/**
+ * Modulation factor 2^((index-32768)/32768), 16384 represents 1
+ */
+Uint16 _synth_getHalfToDouble(Synth *synth, Uint16 index) {
+    if (!synth->compactTables) {
+        return synthTables_halfToDoubleModulation[index];
+    }
+    const int shift = 15 - COMPACT_EXP2_TABLE_BITS;
+    const Uint32 *table = synthTables_compactExp2;
+    Uint16 fraction = index & 0x7FFF;
+    Uint16 tableIndex = fraction >> shift;
+    Uint32 weight = fraction & ((1 << shift) - 1);
+    Uint32 factor = table[tableIndex] + (((table[tableIndex + 1] - table[tableIndex]) * weight) >> shift);
+    // factor is 2^(fraction/32768) with 65536 as 1, the top bit of index selects the octave
+    return factor >> ((index & 0x8000) ? 2 : 3);
+}
+
+/**
+ * Ring modulation carrier value for a phase of 1/65536 cycle
+ */
+Sint16 _synth_getCarrier(Synth *synth, Uint16 pos) {
+    if (!synth->compactTables) {
+        return synthTables_carrier[pos];
+    }
+    const int shift = 16 - COMPACT_CARRIER_TABLE_BITS;
+    const Sint16 *table = synthTables_compactCarrier;
+    Uint16 index = pos >> shift;
+    Sint32 weight = pos & ((1 << shift) - 1);
+    return table[index] + (((table[index + 1] - table[index]) * weight) >> shift);
+}
+
+/**
+ * Patch of an instrument as currently published. It stays valid until the
+ * end of synth_processBuffer() even if the instrument is loaded again.
+ */
+Patch *_synth_getPatch(Synth *synth, Uint8 index) {
+    return (Patch*)SDL_AtomicGetPtr((void**)&synth->patches[index]);
+}
+
+/**
+ * Set up the envelope generator for a new stage starting at the current
+ * level. Stages of zero length are passed through at once.
+ */
+void _synth_startEnvelopeStage(Synth *synth, Channel *ch, Adsr stage) {
+    Patch *patch = _synth_getPatch(synth, ch->patch);
+    AmpData *amp = &ch->ampData;
+    Uint32 attackCoefficient = patch->attackCoefficient;
+    Uint32 decayCoefficient = patch->decayCoefficient;
+    Sint32 sustainLevel = patch->sustainLevel;
+    Uint32 releaseCoefficient = patch->releaseCoefficient;
+
+    if (stage == ATTACK && attackCoefficient == 0) {
+        amp->level = ENVELOPE_PEAK;
+        stage = DECAY;
+    }
+    if (stage == DECAY && decayCoefficient == 0) {
+        amp->level = sustainLevel;
+        stage = SUSTAIN;
+    }
+    if (stage == RELEASE && releaseCoefficient == 0) {
+        stage = OFF;
+    }
+    switch (stage) {
     case ATTACK:
-        if (attack <= 0) {
-            amp->amplitude = 32767;
-            amp->adsr = DECAY;
-        } else {
-            Uint16 tableIndex = ADSR_TIMESCALER_2 * amp->adsrTimer / attack;
-            if (tableIndex < 511) { // 511 = scaled up twice
-                amp->amplitude = synth->attackTable[tableIndex] << 7;
-                amp->adsrTimer++;
-            } else {
-                amp->amplitude = 32767;
-                amp->adsr = DECAY;
-                amp->adsrTimer = 0;
-            }
-        }
+        amp->stageEnd = ENVELOPE_PEAK;
+        amp->target = ENVELOPE_PEAK + (ENVELOPE_PEAK >> 8) * ENVELOPE_ATTACK_OVERSHOOT;
+        amp->coefficient = attackCoefficient;
         break;
     case DECAY:
-        if (decay <= 0) {
-            amp->amplitude = sustain << 8;
-            amp->adsr = SUSTAIN;
-        } else {
-            Uint16 tableIndex = ADSR_TIMESCALER_2 * amp->adsrTimer / decay;
-            if (tableIndex < 511) { // 511 = scaled up twice
-                amp->amplitude = (sustain << 8) + ((127-sustain) * synth->decayReleaseTable[tableIndex]);
-                amp->adsrTimer++;
-            } else {
-                amp->amplitude = sustain << 8;
-                amp->adsr = SUSTAIN;
-            }
-        }
+        amp->stageEnd = sustainLevel;
+        amp->target = sustainLevel - ((amp->level - sustainLevel) >> 8) * ENVELOPE_DECAY_UNDERSHOOT;
+        amp->coefficient = decayCoefficient;
         break;
     case RELEASE:
-        if (release == 0) {
-            amp->amplitude = 0;
-            amp->adsr = OFF;
-        } else if (amp->adsrTimer < 0xffff) {
-            // Normalized time in seconds:
-            // t in s = adsrPos * ADSR_PWM_PRESCALER / SAMPLE_RATE, 16/48000 ger t = 3000  = 1 s
-            // t in micros = 16000/48 = 300
-
-            // max_length_in_s =
-            // index: i = f(t)/release
-            // index: 255 = f(4)/127
-            // 255 = C * 4 / 127
-            // C = 255*127/4
-            // C= 8096,   f(t) = 8096 * t
-
-            // release = 127, t = 0:  8096 * 0 / 127 = 0
-            // release = 127, t = 2:  8096 * 2 / 127 = 127
-            // release = 63, t = 2: 8096 * 2 / 63 = 257
-            // release = 1, t = 2: 8096 * 2 / 1 = 16384
-
-            // 255= C * t / r =>  t = 255 * r / 8096
-            //
-            // r = 127 => t = 255 * 127 / 8096 = 4 s
-            // r = 63 => t = 255 * 63 / 8096 = 1.98s
-            // r = 1 => t = 255 / 8096 =
-
-            // i = 8096 * t_s / 127
-            // i = (8096 * t_micros / 127) / 1000000
-            // i = 80
-
-            // i = 8096 * (pos * prescaler / samplerate) * (1/r)
-            //
-            //  i
-
-            Uint16 tableIndex = ADSR_TIMESCALER_2 * amp->adsrTimer / release;
-            if (tableIndex < 511) { // 511 = scaled up twice
-                amp->amplitude = sustain * synth->decayReleaseTable[tableIndex];
-                amp->adsrTimer++;
-            } else {
-                amp->amplitude = 0;
-                amp->adsr = OFF;
-            }
-        } else {
-            amp->amplitude = 0;
-            amp->adsr = OFF;
-        }
+        amp->stageEnd = 0;
+        amp->target = -(amp->level >> 8) * ENVELOPE_DECAY_UNDERSHOOT;
+        amp->coefficient = releaseCoefficient;
+        break;
+    case SUSTAIN:
+        amp->level = sustainLevel;
         break;
     case OFF:
+        amp->level = 0;
         break;
+    }
+    amp->adsr = stage;
+    amp->stage = stage;
+}
+
+/**
+ * Envelope tick, once every ADSR_PWM_PRESCALER samples. The level moves a
+ * fixed part of its distance to the stage target, the voice bank
+ * interpolates the resulting gain over the samples of the sub-block.
+ */
+void _synth_updateAdsr(Synth *synth, Channel *ch) {
+    AmpData *amp = &ch->ampData;
+
+    if (amp->adsr != amp->stage) {
+        _synth_startEnvelopeStage(synth, ch, amp->adsr);
+    }
+    switch (amp->stage) {
+    case ATTACK:
+    case DECAY:
+    case RELEASE: {
+        amp->level += ((Sint64)(amp->target - amp->level) * amp->coefficient) >> ENVELOPE_COEFFICIENT_BITS;
+        bool rising = amp->target > amp->stageEnd;
+        if (rising ? amp->level >= amp->stageEnd : amp->level <= amp->stageEnd) {
+            amp->level = amp->stageEnd;
+            _synth_startEnvelopeStage(synth, ch, amp->stage == ATTACK ? DECAY : (amp->stage == DECAY ? SUSTAIN : OFF));
+        }
+        break;
+    }
     case SUSTAIN:
-        amp->amplitude = sustain << 8;
+        // Follow changes to the patch while it is playing
+        amp->level = _synth_getPatch(synth, ch->patch)->sustainLevel;
+        break;
+    case OFF:
         break;
     }
+    amp->amplitude = amp->level >> ENVELOPE_FRACTION_BITS;
     if (amp->adsr != OFF && amp->amplitudeModulation.amplitude > 0) {
-        Uint16 sinePos = amp->amplitudeModulation.frequency * 65536 * ch->playtime / SAMPLE_RATE;
-
-
-        Uint16 scalePos = 32768 + amp->amplitudeModulation.amplitude * synth->sineTable[sinePos] / 256;
-        Sint32 ampmod = amp->amplitude  * synth->halfToDoubleModulationTable[scalePos] / 16384;
-        //Sint32 ampmod =  amp->amplitude + amp->amplitudeModulation.amplitude * amp->amplitude * synth->sineTable[pos] / 400000;
+        Sint16 modulationIndex = lfo_getValue(&amp->amplitudeModulation.lfo, 0);
+        Uint16 scalePos = 32768 + amp->amplitudeModulation.amplitude * modulationIndex / 256;
+        Sint32 ampmod = (amp->amplitude * _synth_getHalfToDouble(synth, scalePos)) >> 14;
+        //Sint32 ampmod =  amp->amplitude + amp->amplitudeModulation.amplitude * amp->amplitude * synthTables_sine[pos] / 400000;
         if (ampmod < 0) {
             amp->amplitude = 0;
         } else if (ampmod > 32767) {
@@ -235,29 +568,55 @@ Uint32 _synth_getWaveFactor(FrequencyTable *ft) {
     return  65536 / frequencyTable_getScaleFactor(ft);
 }
 
+/**
+ * Scale frequency by 2^(offset/swipeOffsetScale) using the exp2 table, the
+ * integer part of the exponent is applied as a shift
+ */
+Uint32 _synth_getExp2ScaledFrequency(Synth *synth, Uint32 scaledFrequency, Sint32 offset) {
+    Uint32 scale = synth->swipeOffsetScale;
+    // Glides never pass SWIPE_LIMIT octaves, biasing by that gives floor division
+    Uint32 biasedOffset = offset + scale * SWIPE_LIMIT;
+    Uint32 octaves = _synth_divide(biasedOffset, &synth->swipeOffsetReciprocal);
+    Sint32 octave = octaves - SWIPE_LIMIT;
+    Uint32 fraction = biasedOffset - octaves * scale;
+    Uint32 tablePos = ((Uint64)fraction * synth->swipeFractionScaler) >> 32;
+    if (((Uint64)fraction << (EXP2_TABLE_BITS + 16)) - (Uint64)tablePos * scale >= scale) {
+        tablePos++;
+    }
+    Uint32 index = tablePos >> 16;
+    Uint32 weight = tablePos & 0xFFFF;
+    const Uint32 *table = synthTables_exp2;
+    Uint32 factor = table[index] + (((table[index + 1] - table[index]) * weight) >> 16);
+
+    return ((Uint64)scaledFrequency * factor) >> (EXP2_TABLE_SHIFT - octave);
+}
+
 Uint32 _synth_getSwipedFrequency(
-        FrequencyTable *frequencyTable,
+        Synth *synth,
         Uint32 scaledFrequency,
-        Uint32 millis,
-        Swipe *swipe
+        Swipe *swipe,
+        int steps
 ) {
+    FrequencyTable *frequencyTable = synth->frequencyTable;
+    Sint32 limit = synth->swipeOffsetScale * SWIPE_LIMIT;
+
     if (swipe->direction > 0) {
-        swipe->offset+=swipe->speed;
-        if (swipe->offset > SWIPE_OFFSET_SCALE * SWIPE_LIMIT) {
-            swipe->offset = SWIPE_OFFSET_SCALE * SWIPE_LIMIT;
+        swipe->offset+=swipe->speed * steps;
+        if (swipe->offset > limit) {
+            swipe->offset = limit;
         }
     }
     if (swipe->direction < 0) {
-        swipe->offset-=swipe->speed;
-        if (swipe->offset < -SWIPE_OFFSET_SCALE * SWIPE_LIMIT) {
-            swipe->offset = -SWIPE_OFFSET_SCALE * SWIPE_LIMIT;
+        swipe->offset-=swipe->speed * steps;
+        if (swipe->offset < -limit) {
+            swipe->offset = -limit;
         }
     }
     if (swipe->offset == 0) {
         return scaledFrequency;
     }
 
-    Uint32 resultFreq = scaledFrequency * pow(2, (double)swipe->offset/(double)SWIPE_OFFSET_SCALE);
+    Uint32 resultFreq = _synth_getExp2ScaledFrequency(synth, scaledFrequency, swipe->offset);
     if (resultFreq > frequencyTable_getHighestScaledFrequency(frequencyTable)) {
         resultFreq = frequencyTable_getHighestScaledFrequency(frequencyTable);
     } else if (resultFreq < frequencyTable_getLowestScaledFrequency(frequencyTable)) {
@@ -267,10 +626,14 @@ Uint32 _synth_getSwipedFrequency(
 
 }
 
+/**
+ * Apply vibrato to a frequency, offset samples into the control period of
+ * the vibrato oscillator
+ */
 Uint32 _synth_getModulatedFrequency(
         Synth *synth,
         Uint32 scaledFrequency,
-        Uint32 playtime,
+        int offset,
         Modulation *frequencyModulation
 ) {
 
@@ -278,13 +641,24 @@ Uint32 _synth_getModulatedFrequency(
         return scaledFrequency;
 
     }
-    Sint16 modulationIndex =  synth->sineTable[(playtime * frequencyModulation->frequency / MODULATION_SCALER) & 0xFFFF];
+    Sint16 modulationIndex = lfo_getValue(&frequencyModulation->lfo, offset);
     Sint16 scaledModulationIndex = frequencyModulation->amplitude * modulationIndex / 255;
 
-    return scaledFrequency * synth->halfToDoubleModulationTable[scaledModulationIndex+32768] / 16384;
+    return (scaledFrequency * _synth_getHalfToDouble(synth, scaledModulationIndex+32768)) >> 14;
+}
+
+/**
+ * Length of one arpeggio note in samples, speed is given in milliseconds
+ */
+Uint32 _synth_getArpeggioStep(Synth *synth, Channel *ch) {
+    return synth->sampleFreq * ch->pitchModulation.speed / 1000;
 }
 
-Uint32 _synth_getChannelFrequency(Synth *synth, Channel *ch) {
+/**
+ * Frequency of the channel offset samples into the sub-block, moving a glide
+ * on by steps samples
+ */
+Uint32 _synth_getChannelFrequency(Synth *synth, Channel *ch, int steps, int offset) {
     FrequencyTable *ft = synth->frequencyTable;
     WaveData *wav = &ch->waveData;
     Sint8 note = ch->note;
@@ -295,33 +669,30 @@ Uint32 _synth_getChannelFrequency(Synth *synth, Channel *ch) {
         note = wav->noteModulation;
     }
 
-    Uint8 notesLength = ch->pitchModulation.notesLength;
-    Uint8 modSpeed = ch->pitchModulation.speed;
-
-    if (notesLength > 0 && modSpeed > 0) {
-        note += ch->pitchModulation.notes[(ch->playtime/(SAMPLE_RATE_MS * modSpeed) ) % notesLength];
+    if (ch->pitchModulation.notesLength > 0 && ch->arpeggioStep > 0) {
+        note += ch->pitchModulation.notes[ch->arpeggioPos];
     }
 
     Uint32 scaledFrequency = frequencyTable_getScaledValue(ft, note);
 
     scaledFrequency = _synth_getSwipedFrequency(
-            ft,
+            synth,
             scaledFrequency,
-            ch->playtime / SAMPLE_RATE_MS,
-            &wav->swipe);
+            &wav->swipe,
+            steps);
 
     scaledFrequency = _synth_getModulatedFrequency(
             synth,
             scaledFrequency,
-            ch->playtime,
+            offset,
             &wav->frequencyModulation
             );
     return scaledFrequency;
 }
 
 
-Sint8 _synth_getSampleFromArray(Synth *synth, Channel *ch, Sint8* wavetable) {
-    Sint8 sample = wavetable[ch->waveData.wavePos >> 8];
+Sint8 _synth_getSampleFromArray(const Sint8* wavetable, Uint16 wavePos) {
+    Sint8 sample = wavetable[wavePos >> 8];
     return sample;
 }
 
@@ -329,21 +700,25 @@ Sint8 _synth_getPulseAtPos(Uint16 dutyCycle, Uint16 wavePos) {
     return wavePos > dutyCycle ? 127 : -128;
 }
 
-Sint8 _synth_getMean(Channel *ch, Sint8 real) {
-    return (127-ch->waveData.filter) * real / 127 + ch->waveData.filter * ch->mean / 127;
-}
-
-Sint8 _synth_getPulse(Synth *synth, Channel *ch) {
-    Uint16 dutyCycle = ch->waveData.dutyCycle;
-    return  _synth_getPulseAtPos(dutyCycle, ch->waveData.wavePos);
-}
-
-Sint8 _synth_getNoise(Synth *synth, Channel *ch) {
-    return (rand() >> 23)-128;
+/**
+ * Xorshift noise, stepped each time the oscillator phase crosses a noise
+ * clock boundary so that the noise color follows the note pitch
+ */
+Sint8 _synth_getNoise(Channel *ch, Uint16 wavePos) {
+    if ((wavePos ^ ch->noisePos) >> NOISE_CLOCK_SHIFT) {
+        Uint32 x = ch->noiseState;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        ch->noiseState = x;
+        ch->noiseValue = x >> 24;
+    }
+    ch->noisePos = wavePos;
+    return ch->noiseValue;
 }
 
-Sint8 _synth_getTriangle(Synth *synth, Channel *ch) {
-    Uint16 offset = ch->waveData.wavePos - 16384;
+Sint8 _synth_getTriangle(Uint16 wavePos) {
+    Uint16 offset = wavePos - 16384;
     if (offset < 32768) {
         return (offset-16384)/128;
     } else {
@@ -351,229 +726,708 @@ Sint8 _synth_getTriangle(Synth *synth, Channel *ch) {
     }
 }
 
-Sint8 _synth_getRingModulation(Synth *synth, Channel *ch) {
-    Uint32 carrierOffset = 0;
-
-    if (ch->waveData.carrierFrequency == 0) {
-        carrierOffset = _synth_getWaveFactor(synth->frequencyTable) * ch->playtime * _synth_getChannelFrequency(synth, &synth->channelData[0]);
-    } else {
-        carrierOffset = 65536 * ch->playtime * ch->waveData.carrierFrequency;
-    }
-    carrierOffset = (carrierOffset/SAMPLE_RATE) % 65536;
-
-    Sint16 carrierValue = synth->sineTable[ch->waveData.wavePos];
-
-    Sint32 modulation = 0;
-    for (int i = 1; i < 12; i+=2) {
-        modulation += synth->sineTable[(i * carrierOffset) % 65536] / i;
-    }
-
-
-    return  modulation * carrierValue / 10000000;
+Sint8 _synth_getRingModulation(Synth *synth, Uint16 carrierPos, Uint16 wavePos) {
+    return _synth_getCarrier(synth, carrierPos) * _synth_getSine(synth, wavePos) / 10000000;
 }
 
+/**
+ * Switch to the wave segment of the current playtime. The segment is only
+ * looked up when the current one ends or the patch has been loaded again.
+ */
 void _synth_updateWaveform(Synth *synth, Uint8 channel) {
     Channel *ch =  &synth->channelData[channel];
-    Instrument *instr = &synth->instruments[ch->patch];
+    Patch *patch = _synth_getPatch(synth, ch->patch);
     WaveData *wav = &ch->waveData;
 
-    Uint32 length = 0;
-    Sint8 segment = 0;
-
-    int ms = ch->playtime/SAMPLE_RATE_MS;
-    for (int i = 0; i < MAX_WAVESEGMENTS; i++) {
-        if (instr->waves[i].length == 0 || (ms < length + instr->waves[i].length)) {
-            segment = i;
-            break;
-        }
-        length += instr->waves[i].length;
+    if (ch->playtime < wav->segmentEnd && wav->patchRevision == patch->revision) {
+        return;
+    }
+    Uint8 segment = 0;
+    while (segment < MAX_WAVESEGMENTS - 1 && ch->playtime >= patch->segments[segment].end) {
+        segment++;
     }
+    wav->segmentEnd = patch->segments[segment].end;
+    wav->patchRevision = patch->revision;
     if (segment == wav->currentSegment) {
         return;
     }
     wav->currentSegment = segment;
-    Wavesegment *waveData = &instr->waves[segment];
-    ch->waveData.waveform = waveData->waveform;
-    ch->waveData.pwm = waveData->pwm;
+    PatchSegment *waveData = &patch->segments[segment];
+    wav->waveform = waveData->waveform;
+    wav->kernel = waveData->kernel;
+    wav->wavetable = waveData->wavetable;
+    wav->pwm = waveData->pwm;
     if (waveData->dutyCycle > 0) {
-        ch->waveData.dutyCycle = waveData->dutyCycle << 8;
+        wav->dutyCycle = waveData->dutyCycle;
     }
-    ch->waveData.noteModulation = waveData->note;
-    ch->waveData.filter = waveData->filter;
-    ch->waveData.volume = waveData->volume == 0 ? 127 : waveData->volume;
-    ch->waveData.carrierFrequency = waveData->carrierFrequency;
+    wav->noteModulation = waveData->note;
+    ch->pitchDirty = true;
+    wav->filter = waveData->filter;
+    wav->volume = waveData->volume;
+    wav->carrierFrequency = waveData->carrierFrequency;
+    wav->carrierStep = waveData->carrierStep;
 }
 
 
-Sint8 _synth_getSample(Synth *synth, Channel *channel, Waveform waveform) {
+/*
+ * Oscillator kernels, one loop per waveform and table variant so that the
+ * waveform is dispatched once per sub-block rather than for every sample.
+ * SAMPLE is evaluated with wavePos holding the phase of the sample and
+ * carrierPos the ring modulation carrier phase, which only advances in
+ * kernels with CARRIER set.
+ */
+#define SYNTH_KERNEL(name, CARRIER, SAMPLE) \
+void name(Synth *synth, Channel *ch, SubBlock *osc, const Uint16 *phase, Sint16 *wave, int stride, int length) { \
+    Uint32 carrierPos = ch->carrierPos; \
+    for (int i = 0; i < length; i++) { \
+        Uint16 wavePos = phase[i * stride]; \
+        (void)wavePos; \
+        wave[i * stride] = (SAMPLE); \
+        if (CARRIER) { \
+            carrierPos += osc->carrierStep; \
+        } \
+    } \
+    ch->carrierPos = carrierPos; \
+}
+
+SYNTH_KERNEL(_synth_renderSilence, false, 0)
+SYNTH_KERNEL(_synth_renderWavetable, false, _synth_getSampleFromArray(osc->wavetable, wavePos))
+SYNTH_KERNEL(_synth_renderPulse, false, _synth_getPulseAtPos(osc->dutyCycle, wavePos))
+SYNTH_KERNEL(_synth_renderNoise, false, _synth_getNoise(ch, wavePos))
+SYNTH_KERNEL(_synth_renderTriangle, false, _synth_getTriangle(wavePos))
+SYNTH_KERNEL(_synth_renderRingModulation, true,
+        synthTables_carrier[carrierPos >> 16] * synthTables_sine[wavePos] / 10000000)
+SYNTH_KERNEL(_synth_renderCompactRingModulation, true,
+        _synth_getRingModulation(synth, carrierPos >> 16, wavePos))
+
+/**
+ * Oscillator kernel of a waveform for the table variant the synth uses
+ */
+SynthKernel _synth_getKernel(Synth *synth, Waveform waveform) {
     switch (waveform) {
     case LOWPASS_SAW:
-        return _synth_getSampleFromArray(synth, channel, synth->lowpassSaw);
     case LOWPASS_PULSE:
-        return _synth_getSampleFromArray(synth, channel, synth->lowpassPulse);
+        return _synth_renderWavetable;
     case PWM:
-        return _synth_getPulse(synth, channel);
+        return _synth_renderPulse;
     case NOISE:
-        return _synth_getNoise(synth, channel);
+        return _synth_renderNoise;
     case TRIANGLE:
-        return _synth_getTriangle(synth, channel);
+        return _synth_renderTriangle;
     case RING_MOD:
-        return _synth_getRingModulation(synth, channel);
+        return synth->compactTables ? _synth_renderCompactRingModulation : _synth_renderRingModulation;
     default:
-        return 0;
+        return _synth_renderSilence;
     }
 }
 
-void synth_processBuffer(void* userdata, Uint8* stream, int len) {
-    Synth *synth = (Synth*)userdata;
-    Sint16 *buffer = (Sint16*)stream;
-    FrequencyTable *ft = synth->frequencyTable;
-
-    Sint16 scaler = 30000/synth->channels;
+/**
+ * Voice gain in VoiceBank units, folding waveform volume (0-127), envelope
+ * (0-32767), channel and global volume (0-255 each) into one factor
+ */
+Sint16 _synth_getGain(Synth *synth, Channel *ch) {
+    Sint64 scaledVolume = ch->ampData.volume * synth->volume;
+    // 1065369600 = 255*255*16384
+    return (Sint64)ch->waveData.volume * ch->ampData.amplitude * scaledVolume * VOICEBANK_UNITY_GAIN / 1065369600;
+}
 
-    Uint32 waveFactor = 65536 / frequencyTable_getScaleFactor(ft);
+/**
+ * True when the pitch changes from sample to sample, i.e. during vibrato or
+ * while a glide has not yet reached its limit
+ */
+bool _synth_isPitchModulated(Synth *synth, Channel *ch) {
+    Swipe *swipe = &ch->waveData.swipe;
+    Sint32 limit = synth->swipeOffsetScale * SWIPE_LIMIT;
+    if (ch->waveData.frequencyModulation.amplitude > 0) {
+        return true;
+    }
+    if (swipe->speed == 0) {
+        return false;
+    }
+    return (swipe->direction > 0 && swipe->offset < limit)
+            || (swipe->direction < 0 && swipe->offset > -limit);
+}
 
-    for (int i = 0; i < len/2; i++) {
-        Sint32 output = 0;
+/**
+ * Move the arpeggio to the note of the current playtime and recalculate the
+ * channel frequency and phase increment offset samples into the sub-block,
+ * moving a glide on by steps samples. The arpeggio position is only
+ * computed by division when its settings have changed, otherwise it steps
+ * one note at each nextPitchChange.
+ */
+void _synth_updatePitch(Synth *synth, Channel *ch, Uint32 waveFactor, int steps, int offset) {
+    PitchModulation *arpeggio = &ch->pitchModulation;
+    if (ch->pitchDirty) {
+        ch->arpeggioStep = _synth_getArpeggioStep(synth, ch);
+        if (arpeggio->notesLength > 0 && ch->arpeggioStep > 0) {
+            Uint32 arpeggioSteps = ch->playtime / ch->arpeggioStep;
+            ch->arpeggioPos = arpeggioSteps % arpeggio->notesLength;
+            ch->nextPitchChange = (arpeggioSteps + 1) * ch->arpeggioStep;
+        } else {
+            ch->arpeggioPos = 0;
+            ch->nextPitchChange = 0xFFFFFFFF;
+        }
+    } else if (ch->playtime >= ch->nextPitchChange) {
+        ch->arpeggioPos = ch->arpeggioPos + 1 < arpeggio->notesLength ? ch->arpeggioPos + 1 : 0;
+        ch->nextPitchChange += ch->arpeggioStep;
+    }
+    ch->scaledFrequency = _synth_getChannelFrequency(synth, ch, steps, offset);
+    ch->phaseStep = _synth_divide(waveFactor * ch->scaledFrequency, &synth->sampleFreqReciprocal);
+    ch->pitchDirty = false;
+}
 
-        for (int j = 0; j < synth->channels; j++) {
-            Channel *ch = &synth->channelData[j];
-            WaveData *wav = &ch->waveData;
-            AmpData *amp = &ch->ampData;
+/**
+ * Wavetable level band limited for the phase increment, picked once per
+ * sub-block so the oscillator pass stays a plain table lookup
+ */
+const Sint8 *_synth_getWavetable(const Wavetable *wavetable, Uint16 phaseStep) {
+    if (wavetable == NULL) {
+        return NULL;
+    }
+    return wavetable->levels[wavetable_getLevel(phaseStep)];
+}
 
-            Uint32 scaledFrequency = _synth_getChannelFrequency(synth, ch);
+/**
+ * Largest rate shift at which the highest harmonic of the voice stays below
+ * multiRateThreshold percent of the reduced Nyquist frequency
+ */
+Uint8 _synth_getRateShift(Synth *synth, Channel *ch, Uint16 maxPhaseStep) {
+    Uint32 harmonics;
+    switch (ch->waveData.waveform) {
+    case LOWPASS_SAW:
+    case LOWPASS_PULSE:
+        harmonics = ch->waveData.wavetable->harmonics[wavetable_getLevel(ch->phaseStep)];
+        break;
+    case TRIANGLE:
+        harmonics = TRIANGLE_HARMONICS;
+        break;
+    default:
+        // The pulse is not band limited, noise and ring modulation keep per sample state
+        return 0;
+    }
+    // A phase step of 32768 is the Nyquist frequency
+    Uint8 shift = VOICEBANK_MAX_RATE_SHIFT;
+    while (shift > 0 && (Uint64)harmonics * maxPhaseStep * 100 > (Uint64)synth->multiRateThreshold * (32768 >> shift)) {
+        shift--;
+    }
+    return shift;
+}
 
+/**
+ * Control pass: update the waveform segment once per sub-block, envelope
+ * and PWM at their ticks, and compute the phase increment for every sample
+ * of the block. A voice qualifies for a reduced rate when all its sub-blocks
+ * do, its vibrato and glides are sampled at the rate of its previous block.
+ */
+void _synth_prepareVoice(Synth *synth, Uint8 channel, int length) {
+    Channel *ch = &synth->channelData[channel];
+    WaveData *wav = &ch->waveData;
+    AmpData *amp = &ch->ampData;
+    VoiceBank *bank = synth->voiceBank;
+    int lane = ch->lane;
+    Uint32 waveFactor = _synth_getWaveFactor(synth->frequencyTable);
+    int pitchStep = 1 << ch->rateShift;
+    Uint8 rateShift = synth->multiRateThreshold > 0 && lane < synth->audibleLanes ? VOICEBANK_MAX_RATE_SHIFT : 0;
+
+    for (int pos = 0; pos < length; pos += ADSR_PWM_PRESCALER) {
+        int subBlockLength = length - pos < ADSR_PWM_PRESCALER ? length - pos : ADSR_PWM_PRESCALER;
+        int subBlock = pos / ADSR_PWM_PRESCALER;
+        SubBlock *osc = &ch->subBlocks[subBlock];
+
+        _synth_updateWaveform(synth, channel);
+        lfo_advance(&wav->frequencyModulation.lfo, subBlockLength);
+        lfo_advance(&amp->amplitudeModulation.lfo, subBlockLength);
+        if (ch->controlCountdown <= 0) {
+            _synth_updateAdsr(synth, ch);
+            if (wav->pwm > 0) {
+                wav->dutyCycle += wav->pwm;
+            }
+            ch->controlCountdown += ADSR_PWM_PRESCALER;
+        }
+        ch->controlCountdown -= subBlockLength;
+
+        osc->dutyCycle = wav->dutyCycle;
+        osc->audible = lane < synth->audibleLanes && amp->adsr != OFF;
+        osc->kernel = osc->audible ? wav->kernel : _synth_renderSilence;
+
+        /* A filter value of 127 holds the filter state while the voice is silent */
+        bank->filter[subBlock * bank->stride + lane] = osc->audible ? wav->filter : 127;
+        /* Ramp from the previous gain over the sub-block, which may be short at a block end, so that envelope steps do not zipper */
+        Sint16 gain = osc->audible ? _synth_getGain(synth, ch) : 0;
+        bank->gain[subBlock * bank->stride + lane] = ch->gain;
+        bank->gainStep[subBlock * bank->stride + lane] = (gain - ch->gain) / subBlockLength;
+        ch->gain = gain;
+
+        bool pitchModulated = _synth_isPitchModulated(synth, ch);
+        Uint16 maxPhaseStep = ch->phaseStep;
+        for (int i = 0; i < subBlockLength; i++) {
+            bool modulationDue = pitchModulated && ((bank->clock + pos + i) & (pitchStep - 1)) == 0;
+            if (modulationDue || ch->pitchDirty || ch->playtime >= ch->nextPitchChange) {
+                _synth_updatePitch(synth, ch, waveFactor, modulationDue ? pitchStep : 0, i);
+                maxPhaseStep = ch->phaseStep > maxPhaseStep ? ch->phaseStep : maxPhaseStep;
+            }
+            bank->phaseStep[(pos + i) * bank->stride + lane] = ch->phaseStep;
+            ch->playtime++;
+        }
+        osc->wavetable = _synth_getWavetable(wav->wavetable, ch->phaseStep);
+        if (rateShift > 0) {
+            Uint8 subBlockShift = osc->audible ? _synth_getRateShift(synth, ch, maxPhaseStep) : 0;
+            rateShift = subBlockShift < rateShift ? subBlockShift : rateShift;
+        }
+        if (channel == synth->channelVoices[0]) {
+            synth->carrierSteps[subBlock] = (Uint32)ch->phaseStep << 16;
+        }
+        if (wav->carrierFrequency == 0) {
+            osc->carrierStep = synth->carrierSteps[subBlock];
+        } else {
+            osc->carrierStep = wav->carrierStep;
+        }
+    }
+    ch->rateShift = rateShift;
+    if (rateShift > 0) {
+        voicebank_setRateShift(bank, lane, rateShift);
+    }
+}
 
-            if (0 == i % ADSR_PWM_PRESCALER) {
-                _synth_updateWaveform(synth, j);
-                _synth_updateAdsr(synth, ch);
+/**
+ * Oscillator pass: generate the unfiltered waveform from the phases produced
+ * by voicebank_advancePhase(). Reduced rate voices are only rendered on the
+ * rows the voice bank reads, the last sub-block also renders their
+ * look-ahead rows.
+ */
+void _synth_renderVoice(Synth *synth, int lane, int length) {
+    Channel *ch = &synth->channelData[synth->lanes[lane]];
+    VoiceBank *bank = synth->voiceBank;
+    int stride = bank->stride;
+    int shift = ch->rateShift;
+    int step = 1 << shift;
+    int row = (step - bank->clock % step) % step;
+
+    for (int pos = 0; pos < length; pos += ADSR_PWM_PRESCALER) {
+        int subBlockLength = length - pos < ADSR_PWM_PRESCALER ? length - pos : ADSR_PWM_PRESCALER;
+        SubBlock *osc = &ch->subBlocks[pos / ADSR_PWM_PRESCALER];
+        int end = pos + subBlockLength == length && shift > 0 ? length + VOICEBANK_LOOKAHEAD : pos + subBlockLength;
+        int rows = row < end ? (end - row + step - 1) >> shift : 0;
+
+        osc->kernel(synth, ch, osc, &bank->phase[row * stride + lane], &bank->wave[row * stride + lane], stride << shift, rows);
+        row += rows << shift;
+    }
+}
 
-                if (ch->waveData.pwm > 0) {
-                    ch->waveData.dutyCycle+=ch->waveData.pwm;
-                }
+/**
+ * Sum the voice outputs of the block by channel and hand them to the
+ * channel tap. Channels with no audible voice are passed as NULL.
+ */
+void _synth_tapChannels(Synth *synth, int length) {
+    VoiceBank *bank = synth->voiceBank;
+    int stride = bank->stride;
+    for (int channel = 0; channel < synth->channels; channel++) {
+        synth->tapBuffers[channel] = NULL;
+    }
+    for (int lane = 0; lane < synth->audibleLanes; lane++) {
+        Uint8 channel = synth->channelData[synth->lanes[lane]].owner;
+        Sint32 *sum = &synth->channelSums[channel * SYNTH_BLOCK_SIZE];
+        bool first = synth->tapBuffers[channel] == NULL;
+        synth->tapBuffers[channel] = &synth->channelBuffers[channel * SYNTH_BLOCK_SIZE];
+        for (int i = 0; i < length; i++) {
+            Sint32 value = synth->floatOutput ? (Sint32)bank->floatOutput[i * stride + lane] : bank->output[i * stride + lane];
+            sum[i] = first ? value : sum[i] + value;
+        }
+    }
+    for (int channel = 0; channel < synth->channels; channel++) {
+        if (synth->tapBuffers[channel] != NULL) {
+            Sint32 *sum = &synth->channelSums[channel * SYNTH_BLOCK_SIZE];
+            Sint16 *buffer = &synth->channelBuffers[channel * SYNTH_BLOCK_SIZE];
+            for (int i = 0; i < length; i++) {
+                buffer[i] = sum[i] > 32767 ? 32767 : (sum[i] < -32768 ? -32768 : sum[i]);
             }
+        }
+    }
+    synth->channelTap(synth->userData, synth->tapBuffers, length);
+}
 
-            if (!ch->mute && amp->adsr != OFF) {
-                /** Sample func 0-127 */
-                /** Amplitude 0-32767 */
-                Sint8 real = _synth_getSample(synth, ch, wav->waveform);
-                ch->mean = _synth_getMean(ch, real);
-                Sint64 scaledVolume = amp->volume * synth->volume;
-                // 1065369600 = 255*255*16384
-                Sint64 sample = ch->mean * wav->volume * amp->amplitude * scaledVolume / 1065369600;
-                if (synth->soundOutputHook != NULL) {
-                    synth->soundOutputHook(synth->userData, j, sample);
-                }
-                output += sample;
-            } else {
-                if (synth->soundOutputHook != NULL) {
-                    synth->soundOutputHook(synth->userData, j, 0);
-                }
-            }
+void _synth_mixBlock(Synth *synth, Sint16 *buffer, int length) {
+    VoiceBank *bank = synth->voiceBank;
 
-            wav->wavePos += waveFactor * scaledFrequency / synth->sampleFreq;
-            ch->playtime++;
+    voicebank_mix(bank, synth->mixBuffer, length);
+    for (int i = 0; i < length; i++) {
+        // Rounds towards minus infinity, one LSB below a division for negative values
+        Sint32 value = ((Sint64)synth->mixBuffer[i] * synth->mixScaler) >> 15;
+        buffer[i] = value > 32767 ? 32767 : (value < -32768 ? -32768 : value);
+        synth->clock++;
+    }
+}
 
+void _synth_mixBlockFloat(Synth *synth, float *buffer, int length) {
+    VoiceBank *bank = synth->voiceBank;
+
+    voicebank_mixFloat(bank, synth->floatMixBuffer, length);
+    for (int i = 0; i < length; i++) {
+        buffer[i] = synth->floatMixBuffer[i] * synth->floatMixScaler;
+    }
+    synth->clock += length;
+}
+
+/**
+ * Give every channel with a running envelope a voice bank lane for the next
+ * block, audible channels first so that muted ones are not mixed. Channels
+ * are active from their trigger until the envelope has been released or cut
+ * off, all others cost nothing.
+ */
+void _synth_assignLanes(Synth *synth) {
+    VoiceBank *bank = synth->voiceBank;
+    int lane = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int j = 0; j < synth->voices; j++) {
+            Channel *ch = &synth->channelData[j];
+            if (pass == 0) {
+                if (ch->lane == NO_LANE && synth->multiRateThreshold > 0) {
+                    // The voice was silent, so is the history of the upsampler
+                    memset(ch->outputHistory, 0, sizeof(ch->outputHistory));
+                }
+                ch->lane = NO_LANE;
+            }
+            if (ch->ampData.adsr != OFF && synth->mutedChannels[ch->owner] == (pass == 1)) {
+                ch->lane = lane;
+                synth->lanes[lane++] = j;
+            }
+        }
+        if (pass == 0) {
+            synth->audibleLanes = lane;
+        }
+    }
+    synth->activeLanes = lane;
+    voicebank_setActiveVoices(bank, synth->activeLanes, synth->audibleLanes);
+    for (lane = 0; lane < synth->activeLanes; lane++) {
+        Channel *ch = &synth->channelData[synth->lanes[lane]];
+        bank->wavePos[lane] = ch->wavePos;
+        bank->mean[lane] = ch->mean;
+        bank->floatMean[lane] = ch->floatMean;
+        for (int i = 0; synth->multiRateThreshold > 0 && i < VOICEBANK_HISTORY; i++) {
+            bank->output[(i - VOICEBANK_HISTORY) * bank->stride + lane] = ch->outputHistory[i];
         }
-        buffer[i] = output * scaler / 32768;
-        synth->clock++;
     }
 }
 
-Sint8 getSquareAmplitude(Uint8 offset) {
-    return (offset > 128) ? 127 : -128;
+void _synth_storeLanes(Synth *synth) {
+    VoiceBank *bank = synth->voiceBank;
+    for (int lane = 0; lane < synth->activeLanes; lane++) {
+        Channel *ch = &synth->channelData[synth->lanes[lane]];
+        ch->wavePos = bank->wavePos[lane];
+        ch->mean = bank->mean[lane];
+        ch->floatMean = bank->floatMean[lane];
+        for (int i = 0; synth->multiRateThreshold > 0 && i < VOICEBANK_HISTORY; i++) {
+            // Muted voices are not mixed and silent
+            ch->outputHistory[i] = lane < synth->audibleLanes ? bank->output[(i - VOICEBANK_HISTORY) * bank->stride + lane] : 0;
+        }
+    }
 }
 
-Sint8 getSawAmplitude(Uint8 offset) {
-    return 127-offset;
+/**
+ * Call the sequencer if it is due and return the length of the next block.
+ * Blocks end at multiples of SYNTH_BLOCK_SIZE on the clock, where the
+ * sequencer is due again and at the end of the stream, so that streams of
+ * whole blocks are split the same way whatever their length.
+ */
+int _synth_getBlockLength(Synth *synth, int samples) {
+    if (synth->sequencer != NULL && synth->sequencerCountdown == 0) {
+        synth->sequencerCountdown = synth->sequencer(synth->sequencerData);
+        if (synth->sequencerCountdown == 0) {
+            synth->sequencer = NULL;
+        }
+    }
+    Uint32 length = SYNTH_BLOCK_SIZE - synth->clock % SYNTH_BLOCK_SIZE;
+    if (synth->sequencer != NULL && synth->sequencerCountdown < length) {
+        length = synth->sequencerCountdown;
+    }
+    return length < (Uint32)samples ? length : samples;
 }
 
-void createFilteredBuffer(GenerateWaveformFunc sampleFunc, Sint8* output, int filter) {
-    for (int i = 0; i < 256; i++) {
-        Sint16 value = 0;
-        if (filter == 0) {
-            value = sampleFunc(i);
-        } else {
-            for (int j = 0; j < filter; j++) {
-                value += sampleFunc((i+j)%256);
-            }
-            value /= filter;
+/**
+ * Render one block of at most SYNTH_BLOCK_SIZE samples into stream
+ */
+void _synth_renderBlock(Synth *synth, Uint8 *stream, int blockLength) {
+    _synth_assignLanes(synth);
+    // Prepare the voice of channel 0 first, ring modulators read its carrier
+    Uint8 carrierVoice = synth->channelVoices[0];
+    if (synth->channelData[carrierVoice].lane == NO_LANE) {
+        // Ring modulators keep using the last pitch of a silent channel 0 as carrier
+        for (int i = 0; i < SYNTH_SUB_BLOCKS; i++) {
+            synth->carrierSteps[i] = (Uint32)synth->channelData[carrierVoice].phaseStep << 16;
         }
-        output[i] = value;
+    } else {
+        _synth_prepareVoice(synth, carrierVoice, blockLength);
+    }
+    for (int j = 0; j < synth->voices; j++) {
+        if (j != carrierVoice && synth->channelData[j].lane != NO_LANE) {
+            _synth_prepareVoice(synth, j, blockLength);
+        }
+    }
+    voicebank_advancePhase(synth->voiceBank, blockLength);
+    for (int lane = 0; lane < synth->audibleLanes; lane++) {
+        _synth_renderVoice(synth, lane, blockLength);
+    }
+    if (synth->floatOutput) {
+        _synth_mixBlockFloat(synth, (float*)stream, blockLength);
+    } else {
+        _synth_mixBlock(synth, (Sint16*)stream, blockLength);
+    }
+    if (synth->channelTap != NULL) {
+        _synth_tapChannels(synth, blockLength);
+    }
+    _synth_storeLanes(synth);
+    if (synth->sequencer != NULL) {
+        synth->sequencerCountdown -= blockLength;
     }
 }
 
-void _synth_initAudioTables(Synth *synth) {
-    createFilteredBuffer(getSquareAmplitude, synth->lowpassPulse, 8);
-    createFilteredBuffer(getSawAmplitude, synth->lowpassSaw, 4);
+/** Synth rendering on this thread, whose sequencer applies its commands directly */
+static _Thread_local Synth *renderingSynth = NULL;
 
+/** Apply the queued commands, defined with the functions that queue them */
+void _synth_applyCommands(Synth *synth);
 
-    for (int i = 0; i < 512; i++) {
-        synth->attackTable[i] = 11.2*sqrt(i);
+void synth_processBuffer(void* userdata, Uint8* stream, int len) {
+    Synth *synth = (Synth*)userdata;
+    int sampleSize = synth_getSampleSize(synth);
+    int samples = len / sampleSize;
+
+    renderingSynth = synth;
+    rcu_readBegin(&synth->patchRcu);
+    for (int offset = 0; offset < samples;) {
+        _synth_applyCommands(synth);
+        int blockLength = _synth_getBlockLength(synth, samples - offset);
+        _synth_renderBlock(synth, &stream[offset * sampleSize], blockLength);
+        offset += blockLength;
+    }
+    rcu_readEnd(&synth->patchRcu);
+    renderingSynth = NULL;
+}
+
+/**
+ * Audio callback when rendering ahead, only copies what the render thread
+ * has rendered
+ */
+void _synth_playRendered(void* userdata, Uint8* stream, int len) {
+    Synth *synth = (Synth*)userdata;
+    renderThread_read(synth->renderThread, stream, len);
+}
+
+void synth_setSequencer(Synth *synth, SynthSequencer sequencer, void *userData) {
+    if (synth == NULL) {
+        return;
+    }
+    if (synth->renderThread != NULL) {
+        renderThread_lock(synth->renderThread);
+    } else if (synth->audio != 0) {
+        SDL_LockAudioDevice(synth->audio);
     }
-    for (int i = 0; i < 512; i++) {
-        synth->decayReleaseTable[i] = 13950/(i+50)-24;
+    synth->sequencer = sequencer;
+    synth->sequencerData = userData;
+    synth->sequencerCountdown = 0;
+    if (synth->renderThread != NULL) {
+        renderThread_unlock(synth->renderThread);
+    } else if (synth->audio != 0) {
+        SDL_UnlockAudioDevice(synth->audio);
     }
+}
 
-    for (int i = 0; i < 65536; i++) {
-        synth->sineTable[i] = 32767 * sin((double)i/10430.3);
+/**
+ * Envelope coefficient for a stage of the given time setting, which lasts
+ * as many ticks as the stage took with the former envelope tables. remainder
+ * is the part of the distance to the target left when the stage ends.
+ */
+Uint32 _synth_getEnvelopeCoefficient(Synth *synth, Sint8 time, double remainder) {
+    if (time <= 0) {
+        return 0;
     }
-    for (int i = 0; i < 65536; i++) {
-        synth->halfToDoubleModulationTable[i] = (double)16384 * pow(2, (double)(i-32768)/(double)32768);
+    double ticks = 511.0 * 256 * time / synth->adsrTimescaler;
+    return (1 - pow(remainder, 1 / ticks)) * (1 << ENVELOPE_COEFFICIENT_BITS);
+}
+
+/**
+ * Compile the loaded instrument of a patch for the current sample rate into
+ * a new patch and publish it. The patch it replaces is freed once the audio
+ * callback cannot be using it any more.
+ */
+void _synth_compilePatch(Synth *synth, Uint8 index) {
+    Instrument *instrument = &synth->instruments[index];
+    Patch *patch = synth->patches[index];
+    Patch *published = malloc(sizeof(Patch));
+    if (published == NULL) {
+        fprintf(stderr, "Failed to compile patch %d\n", index);
+        return;
+    }
+    Patch compiled = {.revision = patch == NULL ? 1 : patch->revision + 1};
+    double attackRemainder = ENVELOPE_ATTACK_OVERSHOOT / (256.0 + ENVELOPE_ATTACK_OVERSHOOT);
+    double decayRemainder = ENVELOPE_DECAY_UNDERSHOOT / (256.0 + ENVELOPE_DECAY_UNDERSHOOT);
+    Uint32 length = 0;
+
+    for (int i = 0; i < MAX_WAVESEGMENTS; i++) {
+        Wavesegment *wave = &instrument->waves[i];
+        PatchSegment *segment = &compiled.segments[i];
+        length += wave->length;
+        if (wave->length == 0 || i == MAX_WAVESEGMENTS - 1) {
+            segment->end = 0xFFFFFFFF;
+        } else {
+            // Lengths are in ms, the segment lasts while playtime * 1000 < length * sampleFreq
+            segment->end = ((Uint64)length * synth->sampleFreq + 999) / 1000;
+        }
+        segment->waveform = wave->waveform;
+        segment->kernel = _synth_getKernel(synth, wave->waveform);
+        switch (wave->waveform) {
+        case LOWPASS_SAW:
+            segment->wavetable = &synthTables_lowpassSaw;
+            break;
+        case LOWPASS_PULSE:
+            segment->wavetable = &synthTables_lowpassPulse;
+            break;
+        default:
+            segment->wavetable = NULL;
+            break;
+        }
+        segment->dutyCycle = wave->dutyCycle << 8;
+        segment->carrierFrequency = wave->carrierFrequency;
+        segment->carrierStep = ((Uint64)wave->carrierFrequency << 32) / synth->sampleFreq;
+        segment->pwm = wave->pwm;
+        segment->note = wave->note;
+        segment->filter = wave->filter;
+        segment->volume = wave->volume == 0 ? 127 : wave->volume;
     }
+    compiled.attackCoefficient = _synth_getEnvelopeCoefficient(synth, instrument->attack, attackRemainder);
+    compiled.decayCoefficient = _synth_getEnvelopeCoefficient(synth, instrument->decay, decayRemainder);
+    compiled.releaseCoefficient = _synth_getEnvelopeCoefficient(synth, instrument->release, decayRemainder);
+    compiled.sustainLevel = instrument->sustain << (8 + ENVELOPE_FRACTION_BITS);
+    memcpy(published, &compiled, sizeof(Patch));
+    SDL_AtomicSetPtr((void**)&synth->patches[index], published);
+    rcu_retire(&synth->patchRcu, patch, free);
 }
 
 void _synth_initChannels(Synth *synth) {
-    for (int i = 0; i < synth->channels; i++) {
+    for (int i = 0; i < synth->voices; i++) {
+        // Channel i starts out on voice i, the remaining voices are free
+        synth->channelData[i].owner = i < synth->channels ? i : 0;
         synth->channelData[i].ampData.amplitude = 0;
         synth->channelData[i].ampData.adsr = OFF;
         synth->channelData[i].waveData.waveform = LOWPASS_SAW;
+        synth->channelData[i].waveData.kernel = _synth_renderSilence;
         synth->channelData[i].patch  = 0;
         synth->channelData[i].ampData.volume = 255;
     }
+    for (int i = 0; i < synth->channels; i++) {
+        synth->channelVoices[i] = i;
+    }
+}
+
+/**
+ * Set the sample rate and everything derived from it. Must not be called
+ * while the audio callback is running.
+ */
+void _synth_setSampleRate(Synth *synth, Uint32 sampleRate) {
+    synth->sampleFreq = sampleRate;
+    synth->sampleFreqReciprocal = _synth_getReciprocal(sampleRate);
+    synth->adsrTimescaler = ((Uint64)ADSR_TIMESCALER_2 << 8) * REFERENCE_SAMPLE_RATE / sampleRate;
+    synth->swipeOffsetScale = (Uint64)SWIPE_OFFSET_SCALE * sampleRate / REFERENCE_SAMPLE_RATE;
+    synth->swipeOffsetReciprocal = _synth_getReciprocal(synth->swipeOffsetScale);
+    synth->swipeFractionScaler = (1ull << (EXP2_TABLE_BITS + 48)) / synth->swipeOffsetScale;
+    for (int i = 0; i < MAX_INSTRUMENTS; i++) {
+        _synth_compilePatch(synth, i);
+    }
+    for (int i = 0; i < synth->voices; i++) {
+        Modulation *vibrato = &synth->channelData[i].waveData.frequencyModulation;
+        Modulation *tremolo = &synth->channelData[i].ampData.amplitudeModulation;
+        vibrato->lfo.step = lfo_getStep(vibrato->frequency * VIBRATO_RATE, sampleRate);
+        tremolo->lfo.step = lfo_getStep(tremolo->frequency * TREMOLO_RATE, sampleRate);
+    }
 }
 
-Synth *synth_init(Uint8 channels, bool enablePlayback, SoundOutputHook soundOutputHook, void *userData) {
+Synth *synth_init(SynthSettings *settings) {
+    Uint8 channels = settings->channels;
+    Uint32 sampleRate = settings->sampleRate == 0 ? SYNTH_DEFAULT_SAMPLE_RATE : settings->sampleRate;
     if (channels < 1) {
         fprintf(stderr, "Cannot set 0 channels\n");
         return NULL;
     }
+    if (sampleRate < MIN_SAMPLE_RATE || sampleRate > MAX_SAMPLE_RATE) {
+        fprintf(stderr, "Sample rate %d outside supported range %d-%d\n", sampleRate, MIN_SAMPLE_RATE, MAX_SAMPLE_RATE);
+        return NULL;
+    }
     Synth *synth = calloc(1, sizeof(Synth));
-    synth->sampleFreq = SAMPLE_RATE;
-    synth->channels = channels;
-    synth->channelData = calloc(channels, sizeof(Channel));
     synth->instruments = calloc(MAX_INSTRUMENTS, sizeof(Instrument));
+    synth->patches = calloc(MAX_INSTRUMENTS, sizeof(Patch*));
+    // Patches are compiled with the kernels of the selected table variant
+    synth->compactTables = settings->compactTables;
+    _synth_setSampleRate(synth, sampleRate);
+    synth->channels = channels;
+    synth->voices = settings->voices == 0 ? (channels * 2 < 255 ? channels * 2 : 255) : settings->voices;
+    if (synth->voices < channels) {
+        synth->voices = channels;
+    }
+    synth->voiceStealing = settings->voiceStealing;
+    if (channels <= MIX_HEADROOM_CHANNELS) {
+        synth->mixScaler = MIX_FULL_SCALE / channels;
+    } else {
+        synth->mixScaler = MIX_FULL_SCALE / MIX_HEADROOM_CHANNELS * sqrt((double)MIX_HEADROOM_CHANNELS / channels);
+    }
+    synth->floatMixScaler = synth->mixScaler / (32768.0f * 32768.0f);
+    synth->channelData = calloc(synth->voices, sizeof(Channel));
+    synth->channelVoices = calloc(channels, sizeof(Uint8));
+    synth->mutedChannels = calloc(channels, sizeof(bool));
+    synth->requestedMutes = calloc(channels, sizeof(bool));
+    synth->commands = calloc(COMMAND_QUEUE_SIZE, sizeof(Command));
+    synth->channelSums = calloc(channels * SYNTH_BLOCK_SIZE, sizeof(Sint32));
+    synth->channelBuffers = calloc(channels * SYNTH_BLOCK_SIZE, sizeof(Sint16));
+    synth->tapBuffers = calloc(channels, sizeof(Sint16*));
+    synth->voiceBank = voicebank_init(synth->voices, SYNTH_BLOCK_SIZE, ADSR_PWM_PRESCALER);
+    synth->lanes = calloc(synth->voices, sizeof(Uint8));
     synth->frequencyTable = frequencyTable_init(96, 128, -45);
     synth->volume = 255;
-    synth->soundOutputHook = soundOutputHook;
-    synth->userData = userData;
-
-    srand(time(NULL));
+    synth->floatOutput = settings->floatOutput;
+    synth->multiRateThreshold = settings->floatOutput ? 0 : settings->multiRateThreshold;
+    synth->channelTap = settings->channelTap;
+    synth->userData = settings->userData;
 
-    _synth_initAudioTables(synth);
     _synth_initChannels(synth);
+    synth_setNoiseSeed(synth, SYNTH_DEFAULT_NOISE_SEED);
 
-    if (enablePlayback) {
+    if (settings->enablePlayback) {
         SDL_AudioSpec want;
         SDL_AudioSpec have;
 
         SDL_memset(&want, 0, sizeof(want));
         want.freq = synth->sampleFreq; // Playback frequency on Sound card. Each sample takes worth 1/24000 second
-        want.format = AUDIO_S16SYS; // 8-bit unsigned samples
+        want.format = synth->floatOutput ? AUDIO_F32SYS : AUDIO_S16SYS;
         want.channels = 1; // Only play mono for simplicity = 1 byte = 1 sample
-        want.samples = 256; // Buffer size.
-        want.callback = synth_processBuffer; // Called whenever the sound card needs more data
+        want.samples = SYNTH_BLOCK_SIZE; // Buffer size, whole blocks render the same as offline
+        // Called whenever the sound card needs more data
+        want.callback = settings->renderAhead > 0 ? _synth_playRendered : synth_processBuffer;
         want.userdata = synth;
 
         SDL_InitSubSystem(SDL_INIT_AUDIO);
-        synth->audio = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+        synth->audio = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
         if (synth->audio == 0) {
             fprintf(stderr, "Failed to open audio due to %s\n", SDL_GetError());
             synth_close(synth);
             return NULL;
         }
-        if (have.format != want.format) { /* we let this one thing change. */
-            SDL_Log("We didn't get our audio format.");
+        if (have.freq != want.freq) {
+            /* Render at the device rate rather than letting SDL resample */
+            if (have.freq < MIN_SAMPLE_RATE || have.freq > MAX_SAMPLE_RATE) {
+                fprintf(stderr, "Unsupported audio device sample rate %d\n", have.freq);
+                synth_close(synth);
+                return NULL;
+            }
+            SDL_Log("Audio device runs at %d Hz instead of %d Hz", have.freq, want.freq);
+            _synth_setSampleRate(synth, have.freq);
+        }
+        synth->queueCommands = true;
+        if (settings->renderAhead > 0) {
+            synth->renderThread = renderThread_init(synth_processBuffer, synth, SYNTH_BLOCK_SIZE * synth_getSampleSize(synth),
+                    settings->renderAhead, settings->realtimeRenderThread, settings->renderCpus);
+            if (synth->renderThread == NULL) {
+                synth_close(synth);
+                return NULL;
+            }
         }
 
         SDL_PauseAudioDevice(synth->audio, 0); /* start audio playing. */
@@ -583,7 +1437,11 @@ Synth *synth_init(Uint8 channels, bool enablePlayback, SoundOutputHook soundOutp
 }
 
 int synth_getSampleRate(Synth *synth) {
-    return SAMPLE_RATE;
+    return synth->sampleFreq;
+}
+
+int synth_getSampleSize(Synth *synth) {
+    return synth->floatOutput ? sizeof(float) : sizeof(Sint16);
 }
 
 void synth_close(Synth *synth) {
@@ -591,14 +1449,47 @@ void synth_close(Synth *synth) {
         if (synth->audio != 0) {
             SDL_CloseAudioDevice(synth->audio);
         }
+        // After the audio device, whose callback reads from the render thread
+        renderThread_close(synth->renderThread);
+        synth->renderThread = NULL;
         if (NULL != synth->channelData) {
             free(synth->channelData);
             synth->channelData = NULL;
         }
+        free(synth->channelVoices);
+        synth->channelVoices = NULL;
+        free(synth->mutedChannels);
+        synth->mutedChannels = NULL;
+        free(synth->requestedMutes);
+        synth->requestedMutes = NULL;
+        free(synth->commands);
+        synth->commands = NULL;
+        free(synth->channelSums);
+        synth->channelSums = NULL;
+        free(synth->channelBuffers);
+        synth->channelBuffers = NULL;
+        free(synth->tapBuffers);
+        synth->tapBuffers = NULL;
+        if (NULL != synth->voiceBank) {
+            voicebank_close(synth->voiceBank);
+            synth->voiceBank = NULL;
+        }
+        if (NULL != synth->lanes) {
+            free(synth->lanes);
+            synth->lanes = NULL;
+        }
         if (NULL != synth->instruments) {
             free(synth->instruments);
             synth->instruments = NULL;
         }
+        if (NULL != synth->patches) {
+            rcu_close(&synth->patchRcu);
+            for (int i = 0; i < MAX_INSTRUMENTS; i++) {
+                free(synth->patches[i]);
+            }
+            free(synth->patches);
+            synth->patches = NULL;
+        }
         if (NULL != synth->frequencyTable) {
             frequencyTable_close(synth->frequencyTable);
             synth->frequencyTable = NULL;
@@ -613,145 +1504,368 @@ void synth_loadPatch(Synth *synth, Uint8 patch, Instrument *instrument) {
         return;
     }
     memcpy(&synth->instruments[patch], instrument, sizeof(Instrument));
+    _synth_compilePatch(synth, patch);
+}
+
+/**
+ * Voice playing the latest note of a channel
+ */
+Channel *_synth_getVoice(Synth *synth, Uint8 channel) {
+    return &synth->channelData[synth->channelVoices[channel]];
+}
+
+/**
+ * Pick the voice for a new note of a channel. A note that has not been
+ * released is cut as before. A released note keeps ringing on its voice
+ * and the new note gets a free voice, or when none is left the released
+ * voice picked by the stealing policy. This bounds the number of voices
+ * the audio callback renders to the size of the pool.
+ */
+Channel *_synth_allocateVoice(Synth *synth, Uint8 channel) {
+    Uint8 previous = synth->channelVoices[channel];
+    if (synth->channelData[previous].ampData.adsr != RELEASE) {
+        return &synth->channelData[previous];
+    }
+    // Released voices and free ones are the voices no channel plays its latest note on
+    synth->channelVoices[channel] = NO_VOICE;
+    int best = -1;
+    for (int i = 0; i < synth->voices; i++) {
+        Channel *candidate = &synth->channelData[i];
+        bool current = synth->channelVoices[candidate->owner] == i;
+        if (current) {
+            continue;
+        }
+        if (candidate->ampData.adsr == OFF) {
+            best = i;
+            break;
+        }
+        if (best < 0) {
+            best = i;
+        } else if (synth->voiceStealing == STEAL_OLDEST) {
+            if (synth->clock - candidate->releaseTime > synth->clock - synth->channelData[best].releaseTime) {
+                best = i;
+            }
+        } else if (candidate->ampData.level < synth->channelData[best].ampData.level) {
+            best = i;
+        }
+    }
+    Channel *ch = &synth->channelData[best];
+    if (best != previous) {
+        /*
+         * Take over the channel settings, keeping the render state of the
+         * voice itself. The gain ramps down from what the voice last played
+         * while the previous voice keeps ringing with its own gain.
+         */
+        Channel voice = *ch;
+        memcpy(ch, &synth->channelData[previous], sizeof(Channel));
+        ch->lane = voice.lane;
+        ch->noiseState = voice.noiseState;
+        ch->noisePos = voice.noisePos;
+        ch->noiseValue = voice.noiseValue;
+        ch->wavePos = voice.wavePos;
+        ch->carrierPos = voice.carrierPos;
+        ch->mean = voice.mean;
+        ch->floatMean = voice.floatMean;
+        ch->gain = voice.gain;
+        ch->controlCountdown = voice.controlCountdown;
+        ch->rateShift = voice.rateShift;
+        memcpy(ch->outputHistory, voice.outputHistory, sizeof(ch->outputHistory));
+        memcpy(ch->subBlocks, voice.subBlocks, sizeof(ch->subBlocks));
+    }
+    ch->owner = channel;
+    synth->channelVoices[channel] = best;
+    return ch;
 }
 
 void _synth_updateAmpData(AmpData *amp) {
-    amp->adsr = ATTACK;
+    amp->level = 0;
     amp->amplitude = 0;
-    amp->adsrTimer = 0;
+    // Makes the envelope generator set up the attack even if it is already in that stage
+    amp->stage = OFF;
+    amp->adsr = ATTACK;
 }
 
-void synth_pitchModulation(Synth *synth, Uint8 channel, Uint16 speed, Sint8 *relativeNotes, Uint8 notesLength) {
-    if (synth == NULL || channel >= synth->channels) {
+void _synth_notePitch(Synth *synth, Uint8 channel, Sint8 note) {
+    Channel *ch = _synth_getVoice(synth, channel);
+    ch->note = note;
+    ch->waveData.swipe.speed = 0;
+    ch->waveData.swipe.direction = 0;
+    ch->waveData.swipe.offset = 0;
+    ch->pitchDirty = true;
+}
+
+void _synth_noteTrigger(Synth *synth, Uint8 channel, Uint8 patch, Sint8 note) {
+    Channel *ch = _synth_allocateVoice(synth, channel);
+    ch->ampData.adsr = OFF;
+    ch->playtime = 0;
+    ch->patch = patch;
+    ch->wavePos = 0;
+    ch->carrierPos = 0;
+    lfo_reset(&ch->waveData.frequencyModulation.lfo);
+    lfo_reset(&ch->ampData.amplitudeModulation.lfo);
+    ch->waveData.currentSegment = -1;
+    ch->waveData.segmentEnd = 0;
+    _synth_updateWaveform(synth, synth->channelVoices[channel]);
+    _synth_notePitch(synth, channel, note);
+    _synth_updateAmpData(&ch->ampData);
+}
+
+void _synth_noteRelease(Synth *synth, Uint8 channel) {
+    Channel *ch = _synth_getVoice(synth, channel);
+    if (ch->ampData.adsr == OFF) {
         return;
     }
-    synth->channelData[channel].pitchModulation.speed = speed;
-    synth->channelData[channel].pitchModulation.notesLength = notesLength;
-    memcpy(synth->channelData[channel].pitchModulation.notes, relativeNotes, notesLength);
+    ch->ampData.adsr = RELEASE;
+    ch->releaseTime = synth->clock;
+}
+
+void _synth_noteOff(Synth *synth, Uint8 channel) {
+    // Cuts the release tails of earlier notes of the channel as well
+    for (int i = 0; i < synth->voices; i++) {
+        Channel *ch = &synth->channelData[i];
+        if (ch->owner == channel && ch->ampData.adsr != OFF) {
+            ch->ampData.adsr = OFF;
+            ch->ampData.amplitude = 0;
+            ch->ampData.level = 0;
+            ch->gain = 0;
+        }
+    }
+}
 
+void _synth_frequencyModulation(Synth *synth, Uint8 channel, Uint8 frequency, Uint8 amplitude) {
+    Modulation *modulation = &_synth_getVoice(synth, channel)->waveData.frequencyModulation;
+    modulation->frequency = frequency;
+    modulation->amplitude = amplitude;
+    modulation->lfo.step = lfo_getStep(frequency * VIBRATO_RATE, synth->sampleFreq);
+    _synth_getVoice(synth, channel)->pitchDirty = true;
 }
 
+void _synth_amplitudeModulation(Synth *synth, Uint8 channel, Uint8 frequency, Uint8 amplitude) {
+    Modulation *modulation = &_synth_getVoice(synth, channel)->ampData.amplitudeModulation;
+    modulation->frequency = frequency;
+    modulation->amplitude = amplitude;
+    modulation->lfo.step = lfo_getStep(frequency * TREMOLO_RATE, synth->sampleFreq);
+}
 
-void synth_notePitch(Synth *synth, Uint8 channel, Uint8 patch, Sint8 note) {
+void _synth_applyCommand(Synth *synth, Command *command) {
+    Uint8 channel = command->channel;
+    Channel *ch;
+    switch (command->type) {
+    case COMMAND_NOTE_TRIGGER:
+        _synth_noteTrigger(synth, channel, command->patch, command->note);
+        break;
+    case COMMAND_NOTE_PITCH:
+        _synth_notePitch(synth, channel, command->note);
+        break;
+    case COMMAND_NOTE_RELEASE:
+        _synth_noteRelease(synth, channel);
+        break;
+    case COMMAND_NOTE_OFF:
+        _synth_noteOff(synth, channel);
+        break;
+    case COMMAND_PITCH_MODULATION:
+        ch = _synth_getVoice(synth, channel);
+        ch->pitchModulation = command->pitchModulation;
+        ch->pitchDirty = true;
+        break;
+    case COMMAND_FREQUENCY_MODULATION:
+        _synth_frequencyModulation(synth, channel, command->value, command->amplitude);
+        break;
+    case COMMAND_AMPLITUDE_MODULATION:
+        _synth_amplitudeModulation(synth, channel, command->value, command->amplitude);
+        break;
+    case COMMAND_GLIDE:
+        ch = _synth_getVoice(synth, channel);
+        ch->waveData.swipe.speed = command->value;
+        ch->waveData.swipe.direction = command->direction;
+        break;
+    case COMMAND_GLIDE_RESET:
+        ch = _synth_getVoice(synth, channel);
+        ch->waveData.swipe.speed = 0;
+        ch->waveData.swipe.direction = 0;
+        ch->waveData.swipe.offset = 0;
+        ch->pitchDirty = true;
+        break;
+    case COMMAND_CHANNEL_VOLUME:
+        _synth_getVoice(synth, channel)->ampData.volume = command->value;
+        break;
+    case COMMAND_GLOBAL_VOLUME:
+        synth->volume = command->value;
+        break;
+    case COMMAND_MUTE:
+        synth->mutedChannels[channel] = command->mute;
+        break;
+    }
+}
+
+void _synth_applyCommands(Synth *synth) {
+    int read = SDL_AtomicGet(&synth->commandRead);
+    int write = SDL_AtomicGet(&synth->commandWrite);
+    for (; read != write; read = (read + 1) & COMMAND_POSITION_MASK) {
+        _synth_applyCommand(synth, &synth->commands[read & (COMMAND_QUEUE_SIZE - 1)]);
+    }
+    SDL_AtomicSet(&synth->commandRead, read);
+}
+
+/**
+ * Queue a command for the audio callback, or apply it right away on a
+ * synth without playback and when the sequencer sends it from the
+ * callback. Waits for the callback to make room when the queue is full.
+ */
+void _synth_sendCommand(Synth *synth, Command *command) {
+    if (!synth->queueCommands || renderingSynth == synth) {
+        _synth_applyCommand(synth, command);
+        return;
+    }
+    int write = SDL_AtomicGet(&synth->commandWrite);
+    while (((write - SDL_AtomicGet(&synth->commandRead)) & COMMAND_POSITION_MASK) == COMMAND_QUEUE_SIZE) {
+        SDL_Delay(1);
+    }
+    synth->commands[write & (COMMAND_QUEUE_SIZE - 1)] = *command;
+    // Publishes the command, SDL_AtomicSet is a full memory barrier
+    SDL_AtomicSet(&synth->commandWrite, (write + 1) & COMMAND_POSITION_MASK);
+}
+
+void synth_pitchModulation(Synth *synth, Uint8 channel, Uint16 speed, Sint8 *relativeNotes, Uint8 notesLength) {
     if (synth == NULL || channel >= synth->channels) {
         return;
     }
+    Command command = {.type = COMMAND_PITCH_MODULATION, .channel = channel};
+    command.pitchModulation.speed = speed;
+    command.pitchModulation.notesLength = notesLength < SYNTH_MAX_ARPEGGIO_NOTES ? notesLength : SYNTH_MAX_ARPEGGIO_NOTES;
+    if (relativeNotes != NULL) {
+        memcpy(command.pitchModulation.notes, relativeNotes, command.pitchModulation.notesLength);
+    }
+    _synth_sendCommand(synth, &command);
+}
 
-    Channel *ch = &synth->channelData[channel];
-    ch->note = note;
-    ch->waveData.swipe.speed = 0;
-    ch->waveData.swipe.direction = 0;
-    ch->waveData.swipe.offset = 0;
 
+void synth_notePitch(Synth *synth, Uint8 channel, Uint8 patch, Sint8 note) {
+    if (synth == NULL || channel >= synth->channels) {
+        return;
+    }
+    Command command = {.type = COMMAND_NOTE_PITCH, .channel = channel, .patch = patch, .note = note};
+    _synth_sendCommand(synth, &command);
 }
 
 void synth_noteTrigger(Synth *synth, Uint8 channel, Uint8 patch, Sint8 note) {
     if (synth == NULL || channel >= synth->channels) {
         return;
     }
-    Channel *ch = &synth->channelData[channel];
-    ch->ampData.adsr = OFF;
-    ch->playtime = 0;
-    ch->patch = patch;
-    ch->waveData.wavePos = 0;
-    ch->waveData.currentSegment = -1;
-    _synth_updateWaveform(synth, channel);
-    synth_notePitch(synth, channel, patch, note);
-    _synth_updateAmpData(&ch->ampData);
+    Command command = {.type = COMMAND_NOTE_TRIGGER, .channel = channel, .patch = patch, .note = note};
+    _synth_sendCommand(synth, &command);
 }
 
 void synth_noteRelease(Synth *synth, Uint8 channel) {
-    if (synth == NULL || channel >= synth->channels || synth->channelData[channel].ampData.adsr == OFF) {
+    if (synth == NULL || channel >= synth->channels) {
         return;
     }
-    synth->channelData[channel].ampData.adsr = RELEASE;
-    synth->channelData[channel].ampData.adsrTimer = 0;
+    Command command = {.type = COMMAND_NOTE_RELEASE, .channel = channel};
+    _synth_sendCommand(synth, &command);
 }
 
 void synth_noteOff(Synth *synth, Uint8 channel) {
-    if (synth == NULL || channel >= synth->channels || synth->channelData[channel].ampData.adsr == OFF) {
+    if (synth == NULL || channel >= synth->channels) {
         return;
     }
-    synth->channelData[channel].ampData.adsr = OFF;
-    synth->channelData[channel].ampData.amplitude = 0;
-    synth->channelData[channel].ampData.adsrTimer = 0;
+    Command command = {.type = COMMAND_NOTE_OFF, .channel = channel};
+    _synth_sendCommand(synth, &command);
 }
 
 void synth_setGlobalVolume(Synth *synth, Uint8 volume) {
     if (synth == NULL) {
         return;
     }
-    synth->volume = volume;
+    Command command = {.type = COMMAND_GLOBAL_VOLUME, .value = volume};
+    _synth_sendCommand(synth, &command);
 }
 
 void synth_setChannelVolume(Synth *synth, Uint8 channel, Uint8 volume) {
     if (synth == NULL || channel >= synth->channels) {
         return;
     }
-    synth->channelData[channel].ampData.volume = volume;
+    Command command = {.type = COMMAND_CHANNEL_VOLUME, .channel = channel, .value = volume};
+    _synth_sendCommand(synth, &command);
+}
+
+void synth_setNoiseSeed(Synth *synth, Uint32 seed) {
+    if (synth == NULL) {
+        return;
+    }
+    for (int i = 0; i < synth->voices; i++) {
+        Channel *ch = &synth->channelData[i];
+        // Give every voice its own sequence, xorshift gets stuck at 0
+        ch->noiseState = (seed + i) * 2654435761u;
+        if (ch->noiseState == 0) {
+            ch->noiseState = 1;
+        }
+        ch->noisePos = 0;
+        ch->noiseValue = 0;
+    }
 }
 
 void synth_frequencyModulation(Synth *synth, Uint8 channel, Uint8 frequency, Uint8 amplitude) {
     if (synth == NULL || channel >= synth->channels) {
         return;
     }
-    synth->channelData[channel].waveData.frequencyModulation.frequency = frequency;
-    synth->channelData[channel].waveData.frequencyModulation.amplitude = amplitude;
+    Command command = {.type = COMMAND_FREQUENCY_MODULATION, .channel = channel, .value = frequency, .amplitude = amplitude};
+    _synth_sendCommand(synth, &command);
 }
 
 void synth_amplitudeModulation(Synth *synth, Uint8 channel, Uint8 frequency, Uint8 amplitude) {
     if (synth == NULL || channel >= synth->channels) {
         return;
     }
-    synth->channelData[channel].ampData.amplitudeModulation.frequency = frequency;
-    synth->channelData[channel].ampData.amplitudeModulation.amplitude = amplitude;
+    Command command = {.type = COMMAND_AMPLITUDE_MODULATION, .channel = channel, .value = frequency, .amplitude = amplitude};
+    _synth_sendCommand(synth, &command);
 }
 
 void synth_pitchGlideUp(Synth *synth, Uint8 channel, Uint8 speed) {
     if (synth == NULL || channel >= synth->channels) {
         return;
     }
-    synth->channelData[channel].waveData.swipe.speed = speed;
-    synth->channelData[channel].waveData.swipe.direction = 1;
+    Command command = {.type = COMMAND_GLIDE, .channel = channel, .value = speed, .direction = 1};
+    _synth_sendCommand(synth, &command);
 }
 
 void synth_pitchGlideDown(Synth *synth, Uint8 channel, Uint8 speed) {
     if (synth == NULL || channel >= synth->channels) {
         return;
     }
-    synth->channelData[channel].waveData.swipe.speed = speed;
-    synth->channelData[channel].waveData.swipe.direction = -1;
+    Command command = {.type = COMMAND_GLIDE, .channel = channel, .value = speed, .direction = -1};
+    _synth_sendCommand(synth, &command);
 }
 
 void synth_pitchGlideStop(Synth *synth, Uint8 channel) {
     if (synth == NULL || channel >= synth->channels) {
         return;
     }
-    synth->channelData[channel].waveData.swipe.speed = 0;
-    synth->channelData[channel].waveData.swipe.direction = 0;
+    Command command = {.type = COMMAND_GLIDE, .channel = channel, .value = 0, .direction = 0};
+    _synth_sendCommand(synth, &command);
 }
 
 void synth_pitchGlideReset(Synth *synth, Uint8 channel) {
     if (synth == NULL || channel >= synth->channels) {
         return;
     }
-    synth->channelData[channel].waveData.swipe.speed = 0;
-    synth->channelData[channel].waveData.swipe.direction = 0;
-    synth->channelData[channel].waveData.swipe.offset = 0;
+    Command command = {.type = COMMAND_GLIDE_RESET, .channel = channel};
+    _synth_sendCommand(synth, &command);
 }
 
 bool synth_isChannelMuted(Synth *synth, Uint8 channel) {
     if (synth == NULL || channel >= synth->channels) {
         return false;
     }
-    return synth->channelData[channel].mute;
+    return synth->requestedMutes[channel];
 }
 
 void synth_muteChannel(Synth *synth, Uint8 channel, bool mute) {
     if (synth == NULL || channel >= synth->channels) {
         return;
     }
-    synth->channelData[channel].mute = mute;
+    synth->requestedMutes[channel] = mute;
+    Command command = {.type = COMMAND_MUTE, .channel = channel, .mute = mute};
+    _synth_sendCommand(synth, &command);
 }
 
 
@@ -799,7 +1913,7 @@ void _synth_testRunBuffer(Synth *testSynth) {
         }
     }
 
-    double t = testSamples / (double)SAMPLE_RATE;
+    double t = testSamples / (double)testSynth->sampleFreq;
     printf("%.2fs ", t);
     testSamples += bufSize;
 
@@ -849,19 +1963,806 @@ void _synth_runTests(Synth *testSynth) {
         _synth_printChannel(&testSynth->channelData[i].ampData);
     }
     testSamples = 0;
-    while (testSamples < SAMPLE_RATE/2) {
+    while (testSamples < testSynth->sampleFreq/2) {
         _synth_testRunBuffer(testSynth);
     }
     _synth_testNoteOff(testSynth);
     testSamples = 0;
-    while (testSamples < SAMPLE_RATE) {
+    while (testSamples < testSynth->sampleFreq) {
         _synth_testRunBuffer(testSynth);
     }
 
 }
 
+/**
+ * Measure a render of voices using vibrato, tremolo and ring modulation,
+ * which are the users of the sine, exp2 and carrier tables. With evict set,
+ * a buffer larger than the L2 cache is written before each block, like the
+ * rest of the application would do between audio callbacks, and only the
+ * render time is counted.
+ */
+double _synth_testTableRender(bool compactTables, bool evict, Uint32 *checksum) {
+    int voices = 16;
+    int iterations = 200;
+    Sint16 buffer[SYNTH_BLOCK_SIZE];
+    SynthSettings settings = {
+        .channels = voices,
+        .compactTables = compactTables
+    };
+    Synth *synth = synth_init(&settings);
+    Instrument instrument = {0};
+    instrument.sustain = 127;
+    instrument.waves[0].waveform = RING_MOD;
+
+    synth_loadPatch(synth, 1, &instrument);
+    for (int i = 0; i < voices; i++) {
+        synth_noteTrigger(synth, i, 1, 24 + i * 3);
+        synth_frequencyModulation(synth, i, 20 + i, 40);
+        synth_amplitudeModulation(synth, i, 10 + i, 60);
+    }
+    int evictSize = 8 * 1024 * 1024;
+    Uint8 *evictBuffer = evict ? malloc(evictSize) : NULL;
+    *checksum = 0;
+    Uint64 ticks = 0;
+    for (int i = 0; i < iterations; i++) {
+        if (evictBuffer != NULL) {
+            memset(evictBuffer, i, evictSize);
+        }
+        Uint64 start = SDL_GetPerformanceCounter();
+        synth_processBuffer(synth, (Uint8*)buffer, sizeof(buffer));
+        ticks += SDL_GetPerformanceCounter() - start;
+        for (int j = 0; j < SYNTH_BLOCK_SIZE; j++) {
+            *checksum = *checksum * 31 + (Uint16)buffer[j];
+        }
+    }
+    free(evictBuffer);
+    synth_close(synth);
+    return 1e9 * ticks / SDL_GetPerformanceFrequency() / ((double)iterations * SYNTH_BLOCK_SIZE);
+}
+
+/**
+ * Print the largest difference between the compact and the full tables, and
+ * the cost of random lookups and of a modulation heavy render with each
+ */
+void _synth_testCompactTables() {
+    Synth full = {0};
+    Synth compact = {0};
+    compact.compactTables = true;
+    int sineError = 0;
+    int modulationError = 0;
+    int carrierError = 0;
+
+    printf("======================TEST OF COMPACT TABLES========================\n");
+    for (int i = 0; i < 65536; i++) {
+        int sine = abs(_synth_getSine(&full, i) - _synth_getSine(&compact, i));
+        int modulation = abs(_synth_getHalfToDouble(&full, i) - _synth_getHalfToDouble(&compact, i));
+        int carrier = abs(_synth_getCarrier(&full, i) - _synth_getCarrier(&compact, i));
+        sineError = sine > sineError ? sine : sineError;
+        modulationError = modulation > modulationError ? modulation : modulationError;
+        carrierError = carrier > carrierError ? carrier : carrierError;
+    }
+    printf("Max error: sine %d/32767 modulation %d/16384 carrier %d/30400 %s\n",
+            sineError, modulationError, carrierError,
+            sineError <= 3 && modulationError <= 1 && carrierError <= 9 ? "OK" : "FAIL");
+
+    printf("Table size: full %d bytes compact %d bytes\n",
+            (int)(sizeof(synthTables_sine) + sizeof(synthTables_halfToDoubleModulation) + sizeof(synthTables_carrier)),
+            (int)(sizeof(synthTables_quarterSine) + sizeof(synthTables_compactExp2) + sizeof(synthTables_compactCarrier)));
+
+    int lookups = 1 << 22;
+    for (int n = 0; n < 2; n++) {
+        Synth *synth = n == 0 ? &full : &compact;
+        Uint32 pos = 1;
+        Sint32 sum = 0;
+        Uint64 start = SDL_GetPerformanceCounter();
+        for (int i = 0; i < lookups; i++) {
+            pos = pos * 1664525 + 1013904223;
+            sum += _synth_getSine(synth, pos >> 16) + _synth_getHalfToDouble(synth, pos) + _synth_getCarrier(synth, pos >> 8);
+        }
+        Uint64 ticks = SDL_GetPerformanceCounter() - start;
+        printf("Random lookups %-7s: %6.2f ns/lookup (sum %d)\n", n == 0 ? "full" : "compact",
+                1e9 * ticks / SDL_GetPerformanceFrequency() / ((double)lookups * 3), sum);
+    }
+    for (int n = 0; n < 4; n++) {
+        Uint32 checksum;
+        bool compactTables = n & 1;
+        bool evict = n & 2;
+        double nsPerSample = _synth_testTableRender(compactTables, evict, &checksum);
+        printf("16 modulated voices %-7s %-13s: %6.2f ns/sample checksum %08x\n",
+                compactTables ? "compact" : "full", evict ? "cache evicted" : "cache warm", nsPerSample, checksum);
+    }
+}
+
+/**
+ * Render time of one sample in ns
+ */
+double _synth_testRenderTime(Synth *synth, Uint32 *checksum) {
+    int iterations = 200;
+    Sint16 buffer[SYNTH_BLOCK_SIZE];
+    *checksum = 0;
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < iterations; i++) {
+        synth_processBuffer(synth, (Uint8*)buffer, sizeof(buffer));
+        *checksum = *checksum * 31 + (Uint16)buffer[i % SYNTH_BLOCK_SIZE];
+    }
+    Uint64 ticks = SDL_GetPerformanceCounter() - start;
+    return 1e9 * ticks / SDL_GetPerformanceFrequency() / ((double)iterations * SYNTH_BLOCK_SIZE);
+}
+
+/**
+ * Play a note with a different waveform on every channel, every other
+ * channel with vibrato
+ */
+void _synth_testPlayAllWaveforms(Synth *synth, int channels) {
+    Waveform waveforms[] = {LOWPASS_SAW, LOWPASS_PULSE, PWM, TRIANGLE, NOISE, RING_MOD};
+    int numberOfWaveforms = sizeof(waveforms) / sizeof(Waveform);
+
+    for (int i = 0; i < numberOfWaveforms; i++) {
+        Instrument instrument = {0};
+        instrument.sustain = 127;
+        instrument.waves[0].waveform = waveforms[i];
+        instrument.waves[0].filter = 100;
+        instrument.waves[0].volume = 127;
+        instrument.waves[0].dutyCycle = 128;
+        instrument.waves[0].pwm = 4;
+        instrument.waves[0].carrierFrequency = 300;
+        synth_loadPatch(synth, i + 1, &instrument);
+    }
+    for (int i = 0; i < channels; i++) {
+        synth_noteTrigger(synth, i, 1 + i % numberOfWaveforms, 24 + i % 48);
+        if (i % 2) {
+            synth_frequencyModulation(synth, i, 20, 30);
+        }
+    }
+}
+
+/**
+ * Print the render time of one sample and of one voice sample for an
+ * increasing number of playing voices, to show how the engine scales with
+ * the number of channels of a song. A sparse song with only
+ * MIN_TRACKS_PER_PATTERN voices playing and as many muted should cost about
+ * the same at every channel count.
+ */
+void _synth_testChannelScaling() {
+    printf("======================TEST OF CHANNEL SCALING========================\n");
+    for (int channels = MIN_TRACKS_PER_PATTERN; channels <= MAX_TRACKS_PER_PATTERN; channels *= 2) {
+        SynthSettings settings = {
+            .channels = channels
+        };
+        Synth *synth = synth_init(&settings);
+        if (synth == NULL) {
+            fprintf(stderr, "Channel scaling test failed to start\n");
+            return;
+        }
+        _synth_testPlayAllWaveforms(synth, channels);
+        Uint32 checksum;
+        double nsPerSample = _synth_testRenderTime(synth, &checksum);
+        printf("%2d channels: %8.2f ns/sample %6.2f ns/voice sample %5.1f%% of real time (checksum %08x)\n",
+                channels, nsPerSample, nsPerSample / channels,
+                nsPerSample * synth->sampleFreq / 1e7, checksum);
+
+        for (int i = MIN_TRACKS_PER_PATTERN; i < channels; i++) {
+            if (i < 2 * MIN_TRACKS_PER_PATTERN) {
+                synth_muteChannel(synth, i, true);
+            } else {
+                synth_noteOff(synth, i);
+            }
+        }
+        nsPerSample = _synth_testRenderTime(synth, &checksum);
+        printf("%2d channels, %d playing: %8.2f ns/sample (checksum %08x)\n",
+                channels, MIN_TRACKS_PER_PATTERN, nsPerSample, checksum);
+        synth_close(synth);
+    }
+}
+
+#define GOLDEN_SAMPLE_RATE 44100
+#define GOLDEN_LENGTH 22050
+#define GOLDEN_INTERVAL 125
+
+/**
+ * Render half a second of a song using every waveform, arpeggio, vibrato,
+ * tremolo, glides, waveform segments and a release at a sample rate other
+ * than the reference rate, keeping every GOLDEN_INTERVAL:th sample
+ */
+void _synth_testRenderGolden(Sint16 *golden) {
+    SynthSettings settings = {
+        .channels = 8,
+        .sampleRate = GOLDEN_SAMPLE_RATE
+    };
+    Synth *synth = synth_init(&settings);
+    Waveform waveforms[] = {LOWPASS_SAW, LOWPASS_PULSE, PWM, TRIANGLE, NOISE, RING_MOD, RING_MOD, PWM};
+    Sint8 arpeggio[] = {0, 4, 7};
+    Sint16 buffer[441];
+
+    for (int i = 0; i < 8; i++) {
+        Instrument instrument = {0};
+        instrument.attack = 10 * i;
+        instrument.decay = 30;
+        instrument.sustain = 90;
+        instrument.release = 20;
+        instrument.waves[0].waveform = waveforms[i];
+        instrument.waves[0].filter = 16 * i;
+        instrument.waves[0].dutyCycle = 64;
+        instrument.waves[0].pwm = i == 7 ? 3 : 0;
+        instrument.waves[0].carrierFrequency = i == 6 ? 300 : 0;
+        instrument.waves[0].length = 70;
+        instrument.waves[1].waveform = waveforms[(i + 3) % 8];
+        instrument.waves[1].note = i % 2 ? -12 : 0;
+        instrument.waves[1].volume = 100;
+        synth_loadPatch(synth, i + 1, &instrument);
+        synth_noteTrigger(synth, i, i + 1, 20 + i * 5);
+    }
+    synth_pitchModulation(synth, 1, 30, arpeggio, 3);
+    synth_frequencyModulation(synth, 2, 40, 80);
+    synth_amplitudeModulation(synth, 3, 1, 100);
+    synth_pitchGlideUp(synth, 4, 200);
+    synth_pitchGlideDown(synth, 5, 120);
+    synth_setChannelVolume(synth, 6, 180);
+
+    for (int pos = 0; pos < GOLDEN_LENGTH; pos += 441) {
+        if (pos == 8820) {
+            synth_noteRelease(synth, 0);
+            synth_noteRelease(synth, 3);
+            synth_noteTrigger(synth, 7, 3, 40);
+        }
+        synth_processBuffer(synth, (Uint8*)buffer, sizeof(buffer));
+        for (int i = 0; i < 441; i++) {
+            if ((pos + i) % GOLDEN_INTERVAL == 0) {
+                golden[(pos + i) / GOLDEN_INTERVAL] = buffer[i];
+            }
+        }
+    }
+    synth_close(synth);
+}
+
+/** Samples rendered by _synth_testRenderGolden() with exact integer division, the incremental envelope, interpolated LFOs, blocks aligned to the synth clock and envelope ticks every ADSR_PWM_PRESCALER samples */
+static const Sint16 synthGolden[GOLDEN_LENGTH / GOLDEN_INTERVAL + 1] = {
+    0, 2029, -945, -4120, 3499, 801, -3621, 5328, 1251, -777, -3446, 1967,
+    797, -4543, 5525, 485, -1531, -134, 2993, -2183, -1354, 1557, 2729, -3796,
+    4019, -1844, 2499, 960, -2488, 230, 6217, 320, -1586, 1624, 623, -2629,
+    321, 3621, -2833, -1077, 3939, 1377, -1227, 3835, -957, -1418, 911, 4107,
+    -101, -670, 3180, 1999, -4475, -2348, 5, -808, 3476, 5512, 3119, -1281,
+    954, 2099, -2104, -68, -1465, -1864, 2002, 2002, 1675, -3679, 3607, -1028,
+    -4653, -4988, 886, -2262, 173, 1713, 5078, -1213, 1323, 2367, 1825, -498,
+    4802, 597, -3414, -1527, 4641, -685, 1642, -1407, -486, -4437, -2480, -777,
+    933, 1321, 1493, -2375, 2595, -792, -2342, 2516, 6433, 512, -1865, 4356,
+    4839, -4445, -4076, -1074, 1742, -1183, 2209, 3085, -409, 4040, 1133, -498,
+    -67, 1810, 1716, 2465, -3604, 1956, 4192, 2082, 4356, -2179, -4781, -266,
+    -2428, 3976, 8646, 2275, 2816, -2134, 484, 8775, -4203, -1366, 3284, 4940,
+    328, -2466, 5326, 3400, 1272, -938, -3686, -7528, 320, 1548, -1600, 3071,
+    3237, -3769, -2857, 2003, -1873, 2433, 1868, -816, 4773, 3376, 2786, -13,
+    -6240, -4692, 1442, -9233, 1607, 3568, -2657, -2867, 6711,
+};
+
+/**
+ * Compare the song rendered by _synth_testRenderGolden() with the golden
+ * samples, which the fixed point pipeline must reproduce within one LSB
+ */
+void _synth_testGoldenOutput() {
+    Sint16 samples[GOLDEN_LENGTH / GOLDEN_INTERVAL + 1];
+    int maxError = 0;
+
+    printf("======================TEST OF GOLDEN OUTPUT========================\n");
+    _synth_testRenderGolden(samples);
+    for (int i = 0; i < GOLDEN_LENGTH / GOLDEN_INTERVAL + 1; i++) {
+        int error = abs(samples[i] - synthGolden[i]);
+        maxError = error > maxError ? error : maxError;
+    }
+    printf("Max error %d LSB %s\n", maxError, maxError <= 1 ? "OK" : "FAIL");
+}
+
+/**
+ * Render the same song with the fixed point and the float mix side by side,
+ * printing the speed of each, their largest difference and how many samples
+ * the fixed point mix had to clip
+ */
+void _synth_testFloatOutput() {
+    int iterations = 200;
+    Sint16 fixedBuffer[SYNTH_BLOCK_SIZE];
+    float floatBuffer[SYNTH_BLOCK_SIZE];
+
+    printf("======================TEST OF FLOAT OUTPUT========================\n");
+    for (int channels = MIN_TRACKS_PER_PATTERN; channels <= MAX_TRACKS_PER_PATTERN; channels *= 4) {
+        SynthSettings settings = {
+            .channels = channels
+        };
+        Synth *fixedSynth = synth_init(&settings);
+        settings.floatOutput = true;
+        Synth *floatSynth = synth_init(&settings);
+        if (fixedSynth == NULL || floatSynth == NULL) {
+            fprintf(stderr, "Float output test failed to start\n");
+            synth_close(fixedSynth);
+            synth_close(floatSynth);
+            return;
+        }
+        _synth_testPlayAllWaveforms(fixedSynth, channels);
+        _synth_testPlayAllWaveforms(floatSynth, channels);
+
+        Uint64 fixedTicks = 0;
+        Uint64 floatTicks = 0;
+        float maxDifference = 0;
+        int clipped = 0;
+        for (int i = 0; i < iterations; i++) {
+            Uint64 start = SDL_GetPerformanceCounter();
+            synth_processBuffer(fixedSynth, (Uint8*)fixedBuffer, sizeof(fixedBuffer));
+            Uint64 middle = SDL_GetPerformanceCounter();
+            synth_processBuffer(floatSynth, (Uint8*)floatBuffer, sizeof(floatBuffer));
+            floatTicks += SDL_GetPerformanceCounter() - middle;
+            fixedTicks += middle - start;
+            for (int j = 0; j < SYNTH_BLOCK_SIZE; j++) {
+                float value = floatBuffer[j] * 32768;
+                if (value >= 32767 || value < -32768) {
+                    clipped++;
+                } else if (fabsf(value - fixedBuffer[j]) > maxDifference) {
+                    maxDifference = fabsf(value - fixedBuffer[j]);
+                }
+            }
+        }
+        double ticksPerNs = SDL_GetPerformanceFrequency() / 1e9;
+        printf("%2d channels: fixed %8.2f ns/sample float %8.2f ns/sample, max difference %.1f LSB, %d samples clipped\n",
+                channels,
+                fixedTicks / ticksPerNs / ((double)iterations * SYNTH_BLOCK_SIZE),
+                floatTicks / ticksPerNs / ((double)iterations * SYNTH_BLOCK_SIZE),
+                maxDifference, clipped);
+        synth_close(fixedSynth);
+        synth_close(floatSynth);
+    }
+}
+
+/**
+ * Play a dense song of short notes with long releases on a small voice pool
+ * with each stealing policy. Released notes must keep ringing, and no more
+ * voices than the pool holds may ever be rendered.
+ */
+void _synth_testVoicePool() {
+    VoiceStealing policies[] = {STEAL_QUIETEST, STEAL_OLDEST};
+    char *names[] = {"quietest", "oldest"};
+    Sint16 buffer[SYNTH_BLOCK_SIZE];
+
+    printf("======================TEST OF VOICE POOL========================\n");
+    for (int p = 0; p < 2; p++) {
+        SynthSettings settings = {
+            .channels = 4,
+            .voices = 10,
+            .voiceStealing = policies[p]
+        };
+        Synth *synth = synth_init(&settings);
+        if (synth == NULL) {
+            fprintf(stderr, "Voice pool test failed to start\n");
+            return;
+        }
+        // Releases of different levels and lengths, so that the quietest voice is not always the oldest
+        for (int channel = 0; channel < settings.channels; channel++) {
+            Instrument instrument = {0};
+            instrument.sustain = 40 + 25 * channel;
+            instrument.release = 90 - 20 * channel;
+            instrument.waves[0].waveform = TRIANGLE;
+            synth_loadPatch(synth, channel + 1, &instrument);
+        }
+
+        int maxVoices = 0;
+        Uint32 checksum = 0;
+        bool gainKept = true;
+        for (int row = 0; row < 64; row++) {
+            for (int channel = 0; channel < settings.channels; channel++) {
+                if ((row + channel) % 2 == 0) {
+                    // A voice taken over for a new note ramps from its own gain, not from that of the previous voice
+                    Sint16 gains[10];
+                    for (int v = 0; v < settings.voices; v++) {
+                        gains[v] = synth->channelData[v].gain;
+                    }
+                    synth_noteTrigger(synth, channel, channel + 1, 30 + (row * 7 + channel * 5) % 36);
+                    gainKept = gainKept && _synth_getVoice(synth, channel)->gain == gains[synth->channelVoices[channel]];
+                } else {
+                    synth_noteRelease(synth, channel);
+                }
+            }
+            for (int i = 0; i < 8; i++) {
+                synth_processBuffer(synth, (Uint8*)buffer, sizeof(buffer));
+                checksum = checksum * 31 + (Uint16)buffer[row % SYNTH_BLOCK_SIZE];
+                if (synth->activeLanes > maxVoices) {
+                    maxVoices = synth->activeLanes;
+                }
+            }
+        }
+        bool ok = maxVoices > settings.channels && maxVoices <= settings.voices && gainKept;
+        printf("Steal %-8s: at most %d of %d voices for %d channels, voice gain %s (checksum %08x) %s\n",
+                names[p], maxVoices, settings.voices, settings.channels, gainKept ? "kept" : "copied",
+                checksum, ok ? "OK" : "FAIL");
+        synth_close(synth);
+    }
+}
+
+typedef struct {
+    Synth *synth;
+    int row;
+    /** Fraction of a sample carried between rows, which are a seventh of a second long */
+    Uint32 remainder;
+} SequencerTest;
+
+Uint32 _synth_testSequencerRow(void *userData) {
+    SequencerTest *test = (SequencerTest*)userData;
+    Uint32 numerator = SYNTH_DEFAULT_SAMPLE_RATE + test->remainder;
+    if (test->row == 0) {
+        // The first note starts at sample 1000
+        test->row++;
+        return 1000;
+    }
+    for (int channel = 0; channel < 4; channel++) {
+        if ((test->row + channel) % 3 == 0) {
+            synth_noteTrigger(test->synth, channel, channel + 1, 24 + (test->row * 5 + channel * 7) % 48);
+        } else {
+            synth_noteRelease(test->synth, channel);
+        }
+    }
+    test->row++;
+    test->remainder = numerator % 7;
+    return numerator / 7;
+}
+
+/**
+ * Render a song from a sequencer in buffers of several sizes, which must
+ * give identical output, and check that the first note starts at the sample
+ * the sequencer asked for
+ */
+void _synth_testSequencer() {
+    int bufferSizes[] = {SYNTH_BLOCK_SIZE, 16 * SYNTH_BLOCK_SIZE, 3 * SYNTH_BLOCK_SIZE};
+    int length = 2 * SYNTH_DEFAULT_SAMPLE_RATE;
+    Sint16 *buffer = calloc(length, sizeof(Sint16));
+    Uint32 reference = 0;
+
+    printf("======================TEST OF SEQUENCER========================\n");
+    for (int b = 0; b < 3; b++) {
+        SynthSettings settings = {
+            .channels = 4
+        };
+        Synth *synth = synth_init(&settings);
+        if (synth == NULL || buffer == NULL) {
+            fprintf(stderr, "Sequencer test failed to start\n");
+            break;
+        }
+        for (int channel = 0; channel < 4; channel++) {
+            Instrument instrument = {0};
+            instrument.decay = 10;
+            instrument.sustain = 80;
+            instrument.release = 20;
+            instrument.waves[0].waveform = channel % 2 == 0 ? LOWPASS_SAW : TRIANGLE;
+            synth_loadPatch(synth, channel + 1, &instrument);
+        }
+        SequencerTest test = {.synth = synth};
+        synth_setSequencer(synth, _synth_testSequencerRow, &test);
+        for (int pos = 0; pos < length; pos += bufferSizes[b]) {
+            int samples = length - pos < bufferSizes[b] ? length - pos : bufferSizes[b];
+            synth_processBuffer(synth, (Uint8*)&buffer[pos], samples * sizeof(Sint16));
+        }
+        Uint32 checksum = 0;
+        int firstSound = -1;
+        for (int i = 0; i < length; i++) {
+            checksum = checksum * 31 + (Uint16)buffer[i];
+            if (firstSound < 0 && buffer[i] != 0) {
+                firstSound = i;
+            }
+        }
+        if (b == 0) {
+            reference = checksum;
+        }
+        bool ok = checksum == reference && firstSound >= 1000 && firstSound < 1000 + ADSR_PWM_PRESCALER;
+        printf("Buffers of %5d samples: first sound at %d, checksum %08x %s\n",
+                bufferSizes[b], firstSound, checksum, ok ? "OK" : "FAIL");
+        synth_close(synth);
+    }
+    free(buffer);
+}
+
+typedef struct {
+    Synth *synth;
+    /** Sum of the channel buffers at each sample */
+    Sint32 *sums;
+    int calls;
+    bool mutedChannelTapped;
+} ChannelTapTest;
+
+/**
+ * Sequencer that does nothing but end a block every 37 samples
+ */
+Uint32 _synth_testSplitBlocks(void *userData) {
+    return 37;
+}
+
+/**
+ * Render the same notes with and without a sequencer splitting the blocks.
+ * Envelope and PWM ticks fall due on the same samples either way, so their
+ * state must be the same at the end of every buffer.
+ */
+void _synth_testControlRate() {
+    Synth *synths[2];
+    Sint16 buffer[SYNTH_BLOCK_SIZE];
+    int buffers = SYNTH_DEFAULT_SAMPLE_RATE / SYNTH_BLOCK_SIZE;
+    int maxLevelError = 0;
+    int maxDutyError = 0;
+
+    printf("======================TEST OF CONTROL RATE========================\n");
+    for (int s = 0; s < 2; s++) {
+        SynthSettings settings = {
+            .channels = 1
+        };
+        Instrument instrument = {0};
+        instrument.attack = 20;
+        instrument.decay = 30;
+        instrument.sustain = 60;
+        instrument.release = 20;
+        instrument.waves[0].waveform = PWM;
+        instrument.waves[0].pwm = 3;
+        synths[s] = synth_init(&settings);
+        if (synths[s] == NULL) {
+            fprintf(stderr, "Control rate test failed to start\n");
+            synth_close(synths[0]);
+            return;
+        }
+        synth_loadPatch(synths[s], 1, &instrument);
+        synth_noteTrigger(synths[s], 0, 1, 36);
+    }
+    synth_setSequencer(synths[1], _synth_testSplitBlocks, NULL);
+    for (int b = 0; b < buffers; b++) {
+        if (b == buffers / 2) {
+            synth_noteRelease(synths[0], 0);
+            synth_noteRelease(synths[1], 0);
+        }
+        for (int s = 0; s < 2; s++) {
+            synth_processBuffer(synths[s], (Uint8*)buffer, sizeof(buffer));
+        }
+        Channel *whole = &synths[0]->channelData[synths[0]->channelVoices[0]];
+        Channel *split = &synths[1]->channelData[synths[1]->channelVoices[0]];
+        int levelError = abs(whole->ampData.level - split->ampData.level);
+        int dutyError = abs(whole->waveData.dutyCycle - split->waveData.dutyCycle);
+        maxLevelError = levelError > maxLevelError ? levelError : maxLevelError;
+        maxDutyError = dutyError > maxDutyError ? dutyError : maxDutyError;
+    }
+    bool ok = maxLevelError == 0 && maxDutyError == 0;
+    printf("Blocks split every 37 samples: envelope error %d, duty cycle error %d %s\n",
+            maxLevelError, maxDutyError, ok ? "OK" : "FAIL");
+    synth_close(synths[0]);
+    synth_close(synths[1]);
+}
+
+void _synth_testChannelTap(void *userData, const Sint16 *const *channels, int length) {
+    ChannelTapTest *test = (ChannelTapTest*)userData;
+    Uint32 start = test->synth->clock - length;
+    test->calls++;
+    test->mutedChannelTapped = test->mutedChannelTapped || channels[3] != NULL;
+    for (int channel = 0; channel < test->synth->channels; channel++) {
+        for (int i = 0; channels[channel] != NULL && i < length; i++) {
+            test->sums[start + i] += channels[channel][i];
+        }
+    }
+}
+
+/**
+ * Tap the channels of a synth playing chords with one channel muted, and a
+ * released note ringing on with the next one. The tap must be called once
+ * per block, never with the muted channel, and the channel buffers must
+ * add up to the mixed output.
+ */
+void _synth_testChannelTaps() {
+    int bufferSize = 4 * SYNTH_BLOCK_SIZE;
+    int length = 24 * bufferSize;
+    Sint16 *buffer = calloc(length, sizeof(Sint16));
+    ChannelTapTest test = {.sums = calloc(length, sizeof(Sint32))};
+    SynthSettings settings = {
+        .channels = 4,
+        .channelTap = _synth_testChannelTap,
+        .userData = &test
+    };
+    Synth *synth = synth_init(&settings);
+    int maxError = 0;
+
+    printf("======================TEST OF CHANNEL TAP========================\n");
+    if (synth == NULL || buffer == NULL || test.sums == NULL) {
+        fprintf(stderr, "Channel tap test failed to start\n");
+        synth_close(synth);
+        free(buffer);
+        free(test.sums);
+        return;
+    }
+    test.synth = synth;
+    for (int channel = 0; channel < 4; channel++) {
+        Instrument instrument = {0};
+        instrument.sustain = 100;
+        instrument.release = 10;
+        instrument.waves[0].waveform = channel % 2 == 0 ? LOWPASS_SAW : TRIANGLE;
+        synth_loadPatch(synth, channel + 1, &instrument);
+        synth_noteTrigger(synth, channel, channel + 1, 36 + channel * 4);
+        // Keeps the sum of two notes of a channel within 16 bits, the channel buffers are clipped
+        synth_setChannelVolume(synth, channel, 120);
+    }
+    synth_muteChannel(synth, 3, true);
+    for (int pos = 0; pos < length; pos += bufferSize) {
+        if (pos == length / 2) {
+            synth_noteRelease(synth, 0);
+            synth_noteTrigger(synth, 0, 2, 48);
+            synth_setChannelVolume(synth, 0, 120);
+        }
+        synth_processBuffer(synth, (Uint8*)&buffer[pos], bufferSize * sizeof(Sint16));
+    }
+    for (int i = 0; i < length; i++) {
+        Sint32 value = ((Sint64)test.sums[i] * synth->mixScaler) >> 15;
+        value = value > 32767 ? 32767 : (value < -32768 ? -32768 : value);
+        int error = abs(value - buffer[i]);
+        maxError = error > maxError ? error : maxError;
+    }
+    int blocks = length / SYNTH_BLOCK_SIZE;
+    bool ok = maxError == 0 && test.calls == blocks && !test.mutedChannelTapped;
+    printf("%d calls for %d blocks, muted channel %s, max error %d LSB %s\n", test.calls, blocks,
+            test.mutedChannelTapped ? "tapped" : "not tapped", maxError, ok ? "OK" : "FAIL");
+    synth_close(synth);
+    free(buffer);
+    free(test.sums);
+}
+
+/**
+ * Send the same stream of commands to a synth that applies them directly
+ * and to one that queues them, between buffers of whole blocks. The queued
+ * commands are applied at the start of the next block, so both must render
+ * the same samples. Enough commands are sent for the queue to wrap around
+ * several times.
+ */
+void _synth_testCommandQueue() {
+    int rows = 120;
+    int rowLength = 2 * SYNTH_BLOCK_SIZE;
+    Sint16 buffers[2][2 * SYNTH_BLOCK_SIZE];
+    Synth *synths[2];
+    Uint32 checksums[2] = {0, 0};
+    int commands = 0;
+    bool ok = true;
+
+    printf("======================TEST OF COMMAND QUEUE========================\n");
+    for (int s = 0; s < 2; s++) {
+        SynthSettings settings = {
+            .channels = 4
+        };
+        synths[s] = synth_init(&settings);
+        if (synths[s] == NULL) {
+            fprintf(stderr, "Command queue test failed to start\n");
+            return;
+        }
+        synths[s]->queueCommands = s == 1;
+        for (int channel = 0; channel < 4; channel++) {
+            Instrument instrument = {0};
+            instrument.decay = 10;
+            instrument.sustain = 80;
+            instrument.release = 5;
+            instrument.waves[0].waveform = channel % 2 == 0 ? LOWPASS_PULSE : TRIANGLE;
+            synth_loadPatch(synths[s], channel + 1, &instrument);
+        }
+    }
+    for (int row = 0; row < rows; row++) {
+        for (int s = 0; s < 2; s++) {
+            Synth *synth = synths[s];
+            for (int channel = 0; channel < 4; channel++) {
+                Sint8 arpeggio[] = {0, 3, 7, 12};
+                bool mute = (row / 16 + channel) % 5 == 0;
+                synth_noteTrigger(synth, channel, channel + 1, 30 + (row * 7 + channel * 5) % 36);
+                synth_setChannelVolume(synth, channel, 128 + row % 128);
+                synth_frequencyModulation(synth, channel, row % 8 * 4, 30);
+                synth_pitchModulation(synth, channel, row % 3 == 0 ? 30 : 0, arpeggio, 4);
+                synth_pitchGlideUp(synth, channel, row % 4);
+                synth_muteChannel(synth, channel, mute);
+                ok = ok && synth_isChannelMuted(synth, channel) == mute;
+                if (row % 2 == 1) {
+                    synth_noteRelease(synth, channel);
+                }
+                commands += s == 0 ? (row % 2 == 1 ? 7 : 6) : 0;
+            }
+            synth_processBuffer(synth, (Uint8*)buffers[s], rowLength * sizeof(Sint16));
+            for (int i = 0; i < rowLength; i++) {
+                checksums[s] = checksums[s] * 31 + (Uint16)buffers[s][i];
+            }
+        }
+    }
+    ok = ok && checksums[0] == checksums[1] && checksums[0] != 0;
+    printf("%d commands direct %08x queued %08x %s\n", commands, checksums[0], checksums[1], ok ? "OK" : "FAIL");
+    synth_close(synths[0]);
+    synth_close(synths[1]);
+}
+
+/**
+ * Render a short song with bass lines, pads, leads with vibrato and a
+ * noise hihat at a multi-rate threshold and return the render time
+ */
+Uint64 _synth_testRenderMultiRate(Uint8 threshold, Sint16 *buffer, int length) {
+    Waveform waveforms[] = {TRIANGLE, LOWPASS_SAW, LOWPASS_PULSE, LOWPASS_SAW, TRIANGLE, PWM, NOISE, LOWPASS_SAW};
+    Sint8 baseNotes[] = {12, 0, 24, 36, 48, 48, 80, 19};
+    Sint8 chord[] = {0, 3, 7, 10};
+    SynthSettings settings = {
+        .channels = 8,
+        .multiRateThreshold = threshold
+    };
+    Synth *synth = synth_init(&settings);
+    if (synth == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < 8; i++) {
+        Instrument instrument = {0};
+        instrument.attack = i == 6 ? 0 : 2;
+        instrument.decay = 20;
+        instrument.sustain = i == 6 ? 0 : 90;
+        instrument.release = 30;
+        instrument.waves[0].waveform = waveforms[i];
+        instrument.waves[0].filter = i < 2 ? 0 : 40;
+        instrument.waves[0].dutyCycle = 100;
+        instrument.waves[0].pwm = 2;
+        synth_loadPatch(synth, i + 1, &instrument);
+    }
+    Uint64 ticks = 0;
+    int row = 0;
+    for (int pos = 0; pos < length; pos += SYNTH_DEFAULT_SAMPLE_RATE / 8, row++) {
+        for (int i = 0; i < 8; i++) {
+            if (i < 2 || i == 6 || row % 4 == 0) {
+                synth_noteTrigger(synth, i, i + 1, baseNotes[i] + chord[(row + i) % 4]);
+            } else if (row % 4 == 3) {
+                synth_noteRelease(synth, i);
+            }
+        }
+        synth_frequencyModulation(synth, 0, 30, 40);
+        synth_frequencyModulation(synth, 4, 40, 60);
+        synth_frequencyModulation(synth, 5, 40, 60);
+        synth_pitchGlideUp(synth, 7, 2);
+        Uint64 start = SDL_GetPerformanceCounter();
+        synth_processBuffer(synth, (Uint8*)&buffer[pos], SYNTH_DEFAULT_SAMPLE_RATE / 8 * sizeof(Sint16));
+        ticks += SDL_GetPerformanceCounter() - start;
+    }
+    synth_close(synth);
+    return ticks;
+}
+
+/**
+ * Benchmark multi-rate rendering at several thresholds. Print the fastest
+ * of a few render times, the saving over the full rate render and how far
+ * the output is from it.
+ */
+void _synth_testMultiRate() {
+    Uint8 thresholds[] = {0, 25, 50, 75};
+    int length = 2 * SYNTH_DEFAULT_SAMPLE_RATE;
+    Sint16 *reference = calloc(length, sizeof(Sint16));
+    Sint16 *output = calloc(length, sizeof(Sint16));
+    double fullRate = 0;
+
+    printf("======================TEST OF MULTI-RATE RENDERING========================\n");
+    for (int t = 0; t < 4 && reference != NULL && output != NULL; t++) {
+        Sint16 *buffer = t == 0 ? reference : output;
+        Uint64 ticks = 0;
+        for (int i = 0; i < 5; i++) {
+            Uint64 render = _synth_testRenderMultiRate(thresholds[t], buffer, length);
+            ticks = i == 0 || render < ticks ? render : ticks;
+        }
+        double nsPerSample = 1e9 * ticks / SDL_GetPerformanceFrequency() / length;
+        if (t == 0) {
+            fullRate = nsPerSample;
+            printf("Full rate        : %7.2f ns/sample\n", nsPerSample);
+        } else {
+            double signal = 0;
+            double noise = 0;
+            int maxError = 0;
+            for (int i = 0; i < length; i++) {
+                int error = abs(output[i] - reference[i]);
+                signal += (double)reference[i] * reference[i];
+                noise += (double)error * error;
+                maxError = error > maxError ? error : maxError;
+            }
+            printf("Threshold %3d%%   : %7.2f ns/sample, %5.1f%% saved, max error %5d LSB, SNR %5.1f dB\n",
+                    thresholds[t], nsPerSample, 100 * (1 - nsPerSample / fullRate), maxError,
+                    10 * log10(signal / (noise > 0 ? noise : 1)));
+        }
+    }
+    free(reference);
+    free(output);
+}
+
 void synth_test() {
-    Synth *testSynth = synth_init(testNumberOfChannels, false, NULL, NULL);
+    SynthSettings settings = {
+        .channels = testNumberOfChannels
+    };
+    Synth *testSynth = synth_init(&settings);
     if (testSynth == NULL) {
         fprintf(stderr, "Synth test failed to start\n");
         return;
@@ -870,5 +2771,20 @@ void synth_test() {
     _synth_runTests(testSynth);
     printf("\n");
     synth_close(testSynth);
+    voicebank_test();
+    lfo_test();
+    rcu_test();
+    renderThread_test();
+    scope_test();
+    _synth_testGoldenOutput();
+    _synth_testCompactTables();
+    _synth_testChannelScaling();
+    _synth_testFloatOutput();
+    _synth_testVoicePool();
+    _synth_testSequencer();
+    _synth_testControlRate();
+    _synth_testCommandQueue();
+    _synth_testChannelTaps();
+    _synth_testMultiRate();
 }
 
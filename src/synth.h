@@ -9,17 +9,126 @@
 
 typedef struct _Synth Synth;
 
-typedef void (*SoundOutputHook)(void *userData, int channel, Sint16 sample);
 /**
- * Initialize synth device with specified number of channels
- *
- * Set enablePlayback to true for soundcard playback, or false for
- * offline processing such as audio file generation
+ * Receives the output of every channel once per rendered block. channels
+ * holds a buffer of length samples for each channel, NULL for channels that
+ * are silent or muted. Called on the audio thread, the buffers are only
+ * valid during the call.
+ */
+typedef void (*SynthChannelTap)(void *userData, const Sint16 *const *channels, int length);
+
+/**
+ * Sequencer run by the synth while it renders, see synth_setSequencer().
+ * Returns the number of samples until it is due again, 0 to be removed.
+ */
+typedef Uint32 (*SynthSequencer)(void *userData);
+
+#define SYNTH_DEFAULT_SAMPLE_RATE 48000
+
+/** Number of samples each voice renders into its scratch buffer before mixing */
+#define SYNTH_BLOCK_SIZE 256
+
+/** Longest arpeggio synth_pitchModulation() takes, further notes are ignored */
+#define SYNTH_MAX_ARPEGGIO_NOTES 16
+
+/** Which released voice a new note takes over when the voice pool is exhausted */
+typedef enum {
+    /** The released voice with the lowest envelope level */
+    STEAL_QUIETEST=0,
+    /** The voice that was released first */
+    STEAL_OLDEST=1
+} VoiceStealing;
+
+/**
+ * Synth configuration, fields left zero use their defaults
+ */
+typedef struct {
+    /** Number of channels, at least 1 */
+    Uint8 channels;
+    /**
+     * Set to true for soundcard playback, or false for offline processing
+     * such as audio file generation
+     */
+    bool enablePlayback;
+    /**
+     * Sample rate in Hz, 8000 to 192000. Defaults to SYNTH_DEFAULT_SAMPLE_RATE.
+     * With playback enabled the rate the audio device provides is used if it
+     * differs, check it with synth_getSampleRate().
+     */
+    Uint32 sampleRate;
+    /**
+     * Use small linearly interpolated sine, exp2 and ring modulation tables
+     * that stay in the L1 cache instead of the 64k entry tables. Compared
+     * to the full tables sine values differ by at most 3/32767, ring
+     * modulation carrier values by 9/30400 and modulation factors by 1/16384.
+     */
+    bool compactTables;
+    /**
+     * Mix in floating point and output 32 bit float samples between -1 and
+     * 1 instead of 16 bit integers. The float mix has no intermediate
+     * rounding and is not clipped, peaks above full scale are left to the
+     * audio device or the file consumer.
+     */
+    bool floatOutput;
+    /**
+     * Size of the voice pool the channels play their notes on, at least the
+     * number of channels. Defaults to twice the number of channels, at most
+     * 255. A note released on a channel keeps ringing while the next note
+     * plays on another voice. With all voices busy the next note takes over
+     * a released voice picked by voiceStealing, so no more than this many
+     * voices are ever rendered.
+     */
+    Uint8 voices;
+    VoiceStealing voiceStealing;
+    /**
+     * Filter and amplify triangle, lowpass saw and lowpass pulse voices at
+     * 1/2 or 1/4 of the sample rate when their highest harmonic stays below
+     * this percentage of the reduced Nyquist frequency, and upsample them
+     * with a half-band filter before the mix. Vibrato and glides of such
+     * voices are sampled at the reduced rate too. Lower values keep the
+     * upsampling images quieter, 0 renders everything at the full rate.
+     * Ignored with floatOutput.
+     */
+    Uint8 multiRateThreshold;
+    /**
+     * Called with the output of the channels for each block, the sum of
+     * the notes of a channel that are still ringing
+     */
+    SynthChannelTap channelTap;
+    void *userData;
+    /**
+     * With playback enabled, render this many blocks ahead on a thread of
+     * its own and let the audio callback only copy them, so a block that
+     * takes long to render does not cause a dropout. Notes, commands and
+     * the sequencer run this far ahead of what is heard. 0 renders in the
+     * audio callback.
+     */
+    Uint8 renderAhead;
+    /** Ask for SCHED_FIFO scheduling of the render thread, which may need privileges */
+    bool realtimeRenderThread;
+    /** Mask of the CPUs the render thread may run on, 0 for any */
+    Uint32 renderCpus;
+} SynthSettings;
+
+/**
+ * Initialize synth device with the specified settings
  */
-Synth *synth_init(Uint8 channels, bool enablePlayback, SoundOutputHook soundOutputHook, void *userData);
+Synth *synth_init(SynthSettings *settings);
 
 int synth_getSampleRate(Synth *synth);
 
+/** Bytes per sample written by synth_processBuffer(), 4 for float output and 2 otherwise */
+int synth_getSampleSize(Synth *synth);
+
+/*
+ * The note, modulation, glide, volume and mute functions below may be called
+ * from any one thread while the synth plays. With playback enabled they are
+ * queued and the audio callback, or the render thread when rendering
+ * ahead, applies them in order at the start of its next block, so it never
+ * sees a half updated channel. Called from the
+ * sequencer, or on a synth without playback, they take effect immediately.
+ */
+
 /**
  * Load patch data into synth
  */
@@ -62,6 +171,7 @@ void synth_pitchGlideReset(Synth *synth, Uint8 channel);
 
 void synth_muteChannel(Synth *synth, Uint8 channel, bool mute);
 
+/** Mute state as last set by synth_muteChannel(), which may not be audible yet */
 bool synth_isChannelMuted(Synth *synth, Uint8 channel);
 
 void synth_noteRelease(Synth *synth, Uint8 channel);
@@ -72,6 +182,25 @@ void synth_setGlobalVolume(Synth *synth, Uint8 volume);
 
 void synth_setChannelVolume(Synth *synth, Uint8 channel, Uint8 volume);
 
+/**
+ * Run sequencer from synth_processBuffer(), first before the next sample is
+ * rendered and then at the sample positions it returns. Everything it does
+ * takes effect exactly at that sample. Output requested in buffers of whole
+ * SYNTH_BLOCK_SIZE blocks does not depend on the buffer size, so playback
+ * and offline rendering produce the same samples. NULL removes the
+ * sequencer.
+ */
+void synth_setSequencer(Synth *synth, SynthSequencer sequencer, void *userData);
+
+/** Noise seed used by synth_init, renders starting from it are reproducible */
+#define SYNTH_DEFAULT_NOISE_SEED 0x2545F491
+
+/**
+ * Restart the noise generator of every voice from seed. Two renders of the
+ * same song starting from the same seed produce identical output.
+ */
+void synth_setNoiseSeed(Synth *synth, Uint32 seed);
+
 
 /* Sint8* synth_getTable(Synth *synth); */
 
@@ -85,7 +214,8 @@ void synth_play(Synth *synth);
 void synth_test();
 
 /**
- * Generate audio out to the provided stream of len bytes. Should not be called
+ * Generate audio out to the provided stream of len bytes, in float samples
+ * with float output enabled and Sint16 samples otherwise. Should not be called
  * manually when synth is initialized with sound card output as it would
  * interfere with the audio output
  */
@@ -0,0 +1,58 @@
+#ifndef SYNTH_TABLES_H_
+#define SYNTH_TABLES_H_
+
+#include <SDL2/SDL.h>
+
+#include "wavetable.h"
+
+/*
+ * Lookup tables used by the synth. They are generated at build time by
+ * tools/gen_synth_tables.c into read only data shared by all Synth instances.
+ */
+
+/** One octave of 2^x in the glide table, interpolated linearly */
+#define EXP2_TABLE_BITS 10
+#define EXP2_TABLE_SIZE (1 << EXP2_TABLE_BITS)
+#define EXP2_TABLE_SHIFT 16
+
+/*
+ * Sizes of the compact tables, which are interpolated linearly and small
+ * enough to stay in the L1 cache
+ */
+#define QUARTER_SINE_TABLE_BITS 10
+#define QUARTER_SINE_TABLE_SIZE (1 << QUARTER_SINE_TABLE_BITS)
+#define COMPACT_EXP2_TABLE_BITS 9
+#define COMPACT_EXP2_TABLE_SIZE (1 << COMPACT_EXP2_TABLE_BITS)
+#define COMPACT_CARRIER_TABLE_BITS 10
+#define COMPACT_CARRIER_TABLE_SIZE (1 << COMPACT_CARRIER_TABLE_BITS)
+
+/** Sine values between -32768 and 32767 for one cycle */
+extern const Sint16 synthTables_sine[65536];
+
+/** Odd harmonic ring modulation carrier, sum of sine[i * pos] / i for i = 1, 3 .. 11 */
+extern const Sint16 synthTables_carrier[65536];
+
+/** 8192 represents 1/2 and 32768 represents 2. Mid index 32768 means 16384 aka 1 */
+extern const Uint16 synthTables_halfToDoubleModulation[65536];
+
+/** 2^(i/EXP2_TABLE_SIZE) for one octave, 65536 represents 1 */
+extern const Uint32 synthTables_exp2[EXP2_TABLE_SIZE + 1];
+
+/**
+ * First quarter of a sine cycle, 0 to 32767. The entry after the peak
+ * mirrors the one before it so that interpolating at the peak needs no
+ * bounds check.
+ */
+extern const Sint16 synthTables_quarterSine[QUARTER_SINE_TABLE_SIZE + 2];
+
+/** 2^(i/COMPACT_EXP2_TABLE_SIZE) for one octave, 65536 represents 1 */
+extern const Uint32 synthTables_compactExp2[COMPACT_EXP2_TABLE_SIZE + 1];
+
+/** Ring modulation carrier, one cycle plus the first entry repeated */
+extern const Sint16 synthTables_compactCarrier[COMPACT_CARRIER_TABLE_SIZE + 1];
+
+extern const Wavetable synthTables_lowpassSaw;
+
+extern const Wavetable synthTables_lowpassPulse;
+
+#endif /* SYNTH_TABLES_H_ */
@@ -0,0 +1,735 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#include "voicebank.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VOICEBANK_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * All implementations must produce bit identical results. The lowpass filter
+ * divides by 127 with C truncation semantics, which all versions do by
+ * multiplying with 2^21/127 rounded up and correcting negative values by one.
+ * The result is exact for all |x| <= 16644, which covers 127 * -128.
+ *
+ * The [-1, 9, 9, -1] / 16 half-band filter which upsamples reduced rate
+ * voices is computed as near + near / 8 - far / 8, from the averages near of
+ * the two inner and far of the two outer samples rounded up, with saturation.
+ * This stays within 16 bits and is at most 2 off the exact value.
+ */
+#define VOICEBANK_DIV127_MAGIC 16514
+#define VOICEBANK_GAIN_SHIFT 7
+
+/*
+ * Scalar implementation, used when the CPU lacks SSE2 and as reference
+ */
+
+static inline Sint32 _voicebank_div127(Sint32 x) {
+    return ((x * VOICEBANK_DIV127_MAGIC) >> 21) + (x < 0);
+}
+
+void _voicebank_advancePhaseScalar(VoiceBank *bank, int length) {
+    int stride = bank->stride;
+    for (int v = 0; v < stride; v++) {
+        Uint16 wavePos = bank->wavePos[v];
+        for (int i = 0; i < length; i++) {
+            bank->phase[i * stride + v] = wavePos;
+            wavePos += bank->phaseStep[i * stride + v];
+        }
+        bank->wavePos[v] = wavePos;
+    }
+}
+
+static inline Sint16 _voicebank_average(Sint16 a, Sint16 b) {
+    return (a + b + 1) >> 1;
+}
+
+void _voicebank_halfBandScalar(VoiceBank *bank, int first, int end, int distance, const Sint16 *mask) {
+    int stride = bank->stride;
+    for (int i = first; i < end; i += 2 * distance) {
+        Sint16 *before = &bank->output[(i - 3 * distance) * stride];
+        Sint16 *previous = &bank->output[(i - distance) * stride];
+        Sint16 *next = &bank->output[(i + distance) * stride];
+        Sint16 *after = &bank->output[(i + 3 * distance) * stride];
+        Sint16 *output = &bank->output[i * stride];
+        for (int v = 0; v < bank->mixStride; v++) {
+            if (mask[v] != 0) {
+                Sint16 near = _voicebank_average(previous[v], next[v]);
+                Sint16 far = _voicebank_average(before[v], after[v]);
+                Sint32 value = near + ((near >> 3) - (far >> 3));
+                output[v] = value > 32767 ? 32767 : (value < -32768 ? -32768 : value);
+            }
+        }
+    }
+}
+
+/**
+ * Filter and amplify each reduced rate voice on the rows where the clock is a
+ * multiple of its rate divisor, look-ahead rows included. The filter value
+ * is raised to the power of the rate divisor so that the cutoff frequency
+ * stays the same. Look-ahead rows use the filter and the last gain of the
+ * final sub-block and their filter state is not kept, the next block
+ * computes them again from its own control values.
+ */
+void _voicebank_filterReducedScalar(VoiceBank *bank, int length) {
+    int stride = bank->stride;
+    for (int v = 0; v < bank->mixStride; v++) {
+        int shift = bank->rateShift[v];
+        if (shift == 0) {
+            continue;
+        }
+        int step = 1 << shift;
+        int i = (step - bank->clock % step) % step;
+        Sint16 mean = bank->mean[v];
+        for (int pos = 0; pos < length; pos += bank->subBlockSize) {
+            int subBlock = pos / bank->subBlockSize;
+            int end = pos + bank->subBlockSize < length ? pos + bank->subBlockSize : length + VOICEBANK_LOOKAHEAD;
+            Sint16 filter = bank->filter[subBlock * stride + v];
+            Sint16 gain = bank->gain[subBlock * stride + v];
+            Sint16 gainStep = bank->gainStep[subBlock * stride + v];
+            for (int s = 0; s < shift; s++) {
+                filter = _voicebank_div127(filter * filter);
+            }
+            for (; i < end; i += step) {
+                Sint16 ramp = (i < length ? i : length - 1) - pos;
+                mean = _voicebank_div127((127 - filter) * bank->wave[i * stride + v]) + _voicebank_div127(filter * mean);
+                bank->output[i * stride + v] = (mean * (Sint16)(gain + gainStep * ramp)) >> VOICEBANK_GAIN_SHIFT;
+                if (i < length) {
+                    bank->mean[v] = mean;
+                }
+            }
+        }
+    }
+}
+
+void _voicebank_mixScalar(VoiceBank *bank, Sint32 *mixBuffer, int length) {
+    int stride = bank->stride;
+    int subBlock = 0;
+    int subBlockEnd = bank->subBlockSize;
+    for (int i = 0; i < length; i++) {
+        if (i == subBlockEnd) {
+            subBlock++;
+            subBlockEnd += bank->subBlockSize;
+        }
+        Sint16 *filter = &bank->filter[subBlock * stride];
+        Sint16 *gain = &bank->gain[subBlock * stride];
+        Sint16 *gainStep = &bank->gainStep[subBlock * stride];
+        Sint16 ramp = i - subBlockEnd + bank->subBlockSize;
+        Sint16 *wave = &bank->wave[i * stride];
+        Sint16 *output = &bank->output[i * stride];
+        Sint32 sum = 0;
+        for (int v = 0; v < bank->mixStride; v++) {
+            if (bank->reducedRate[v] == 0) {
+                Sint16 mean = _voicebank_div127((127 - filter[v]) * wave[v]) + _voicebank_div127(filter[v] * bank->mean[v]);
+                bank->mean[v] = mean;
+                output[v] = (mean * (Sint16)(gain[v] + gainStep[v] * ramp)) >> VOICEBANK_GAIN_SHIFT;
+            }
+            sum += output[v];
+        }
+        mixBuffer[i] = sum;
+    }
+}
+
+#ifdef VOICEBANK_X86
+
+/*
+ * SSE2 implementation, 8 voices per instruction
+ */
+
+__attribute__((target("sse2")))
+static inline __m128i _voicebank_div127Sse2(__m128i x) {
+    __m128i quotient = _mm_srai_epi16(_mm_mulhi_epi16(x, _mm_set1_epi16(VOICEBANK_DIV127_MAGIC)), 5);
+    return _mm_add_epi16(quotient, _mm_srli_epi16(x, 15));
+}
+
+__attribute__((target("sse2")))
+void _voicebank_advancePhaseSse2(VoiceBank *bank, int length) {
+    int stride = bank->stride;
+    for (int v = 0; v < stride; v += 8) {
+        __m128i wavePos = _mm_loadu_si128((__m128i*)&bank->wavePos[v]);
+        for (int i = 0; i < length; i++) {
+            _mm_storeu_si128((__m128i*)&bank->phase[i * stride + v], wavePos);
+            wavePos = _mm_add_epi16(wavePos, _mm_loadu_si128((__m128i*)&bank->phaseStep[i * stride + v]));
+        }
+        _mm_storeu_si128((__m128i*)&bank->wavePos[v], wavePos);
+    }
+}
+
+__attribute__((target("sse2")))
+static inline __m128i _voicebank_averageSse2(__m128i a, __m128i b) {
+    /* The unsigned average of the values offset by 32768 */
+    __m128i offset = _mm_set1_epi16(-32768);
+    return _mm_xor_si128(_mm_avg_epu16(_mm_xor_si128(a, offset), _mm_xor_si128(b, offset)), offset);
+}
+
+__attribute__((target("sse2")))
+void _voicebank_halfBandSse2(VoiceBank *bank, int first, int end, int distance, const Sint16 *mask) {
+    int stride = bank->stride;
+    for (int i = first; i < end; i += 2 * distance) {
+        Sint16 *before = &bank->output[(i - 3 * distance) * stride];
+        Sint16 *previous = &bank->output[(i - distance) * stride];
+        Sint16 *next = &bank->output[(i + distance) * stride];
+        Sint16 *after = &bank->output[(i + 3 * distance) * stride];
+        Sint16 *output = &bank->output[i * stride];
+        for (int v = 0; v < bank->mixStride; v += 8) {
+            __m128i m = _mm_loadu_si128((__m128i*)&mask[v]);
+            __m128i near = _voicebank_averageSse2(_mm_loadu_si128((__m128i*)&previous[v]), _mm_loadu_si128((__m128i*)&next[v]));
+            __m128i far = _voicebank_averageSse2(_mm_loadu_si128((__m128i*)&before[v]), _mm_loadu_si128((__m128i*)&after[v]));
+            __m128i value = _mm_adds_epi16(near, _mm_sub_epi16(_mm_srai_epi16(near, 3), _mm_srai_epi16(far, 3)));
+            value = _mm_or_si128(_mm_and_si128(m, value), _mm_andnot_si128(m, _mm_loadu_si128((__m128i*)&output[v])));
+            _mm_storeu_si128((__m128i*)&output[v], value);
+        }
+    }
+}
+
+/*
+ * Reduced rate voices are filtered a group of voices at a time along the
+ * rows, so the filter state stays in a register. Rows where the clock is
+ * 2 modulo 4 only belong to the 1/2 rate voices of the group.
+ */
+__attribute__((target("sse2")))
+static inline __m128i _voicebank_filterRowSse2(VoiceBank *bank, int v, int i, int subBlock, Sint16 ramp,
+        __m128i mask, __m128i quarter, __m128i m) {
+    int stride = bank->stride;
+    __m128i f = _mm_loadu_si128((__m128i*)&bank->filter[subBlock * stride + v]);
+    __m128i f2 = _voicebank_div127Sse2(_mm_mullo_epi16(f, f));
+    __m128i f4 = _voicebank_div127Sse2(_mm_mullo_epi16(f2, f2));
+    f = _mm_or_si128(_mm_and_si128(quarter, f4), _mm_andnot_si128(quarter, f2));
+    __m128i w = _mm_loadu_si128((__m128i*)&bank->wave[i * stride + v]);
+    __m128i g = _mm_add_epi16(_mm_loadu_si128((__m128i*)&bank->gain[subBlock * stride + v]),
+            _mm_mullo_epi16(_mm_loadu_si128((__m128i*)&bank->gainStep[subBlock * stride + v]), _mm_set1_epi16(ramp)));
+    __m128i filtered = _mm_add_epi16(
+            _voicebank_div127Sse2(_mm_mullo_epi16(_mm_sub_epi16(_mm_set1_epi16(127), f), w)),
+            _voicebank_div127Sse2(_mm_mullo_epi16(f, m)));
+    m = _mm_or_si128(_mm_and_si128(mask, filtered), _mm_andnot_si128(mask, m));
+    __m128i out = _mm_or_si128(
+            _mm_slli_epi16(_mm_mulhi_epi16(m, g), 16 - VOICEBANK_GAIN_SHIFT),
+            _mm_srli_epi16(_mm_mullo_epi16(m, g), VOICEBANK_GAIN_SHIFT));
+    Sint16 *output = &bank->output[i * stride + v];
+    out = _mm_or_si128(_mm_and_si128(mask, out), _mm_andnot_si128(mask, _mm_loadu_si128((__m128i*)output)));
+    _mm_storeu_si128((__m128i*)output, out);
+    return m;
+}
+
+__attribute__((target("sse2")))
+void _voicebank_filterReducedSse2(VoiceBank *bank, int length) {
+    for (int v = 0; v < bank->mixStride; v += 8) {
+        __m128i half = _mm_loadu_si128((__m128i*)&bank->reducedRate[v]);
+        __m128i quarter = _mm_loadu_si128((__m128i*)&bank->reducedRate[bank->capacity + v]);
+        __m128i halfOnly = _mm_andnot_si128(quarter, half);
+        if (_mm_movemask_epi8(half) == 0) {
+            continue;
+        }
+        int step = _mm_movemask_epi8(halfOnly) == 0 ? 4 : 2;
+        int i = (step - bank->clock % step) % step;
+        int subBlock = 0;
+        int subBlockEnd = bank->subBlockSize;
+        __m128i m = _mm_loadu_si128((__m128i*)&bank->mean[v]);
+        for (; i < length; i += step) {
+            while (i >= subBlockEnd) {
+                subBlock++;
+                subBlockEnd += bank->subBlockSize;
+            }
+            __m128i mask = (bank->clock + i) & 2 ? halfOnly : half;
+            m = _voicebank_filterRowSse2(bank, v, i, subBlock, i - subBlockEnd + bank->subBlockSize, mask, quarter, m);
+        }
+        _mm_storeu_si128((__m128i*)&bank->mean[v], m);
+        subBlock = (length - 1) / bank->subBlockSize;
+        for (; i < length + VOICEBANK_LOOKAHEAD; i += step) {
+            __m128i mask = (bank->clock + i) & 2 ? halfOnly : half;
+            m = _voicebank_filterRowSse2(bank, v, i, subBlock, length - 1 - subBlock * bank->subBlockSize, mask, quarter, m);
+        }
+    }
+}
+
+__attribute__((target("sse2")))
+void _voicebank_mixSse2(VoiceBank *bank, Sint32 *mixBuffer, int length) {
+    int stride = bank->stride;
+    __m128i c127 = _mm_set1_epi16(127);
+    __m128i ones = _mm_set1_epi16(1);
+    int subBlock = 0;
+    int subBlockEnd = bank->subBlockSize;
+    for (int i = 0; i < length; i++) {
+        if (i == subBlockEnd) {
+            subBlock++;
+            subBlockEnd += bank->subBlockSize;
+        }
+        Sint16 *filter = &bank->filter[subBlock * stride];
+        Sint16 *gain = &bank->gain[subBlock * stride];
+        Sint16 *gainStep = &bank->gainStep[subBlock * stride];
+        Sint16 ramp = i - subBlockEnd + bank->subBlockSize;
+        Sint16 *wave = &bank->wave[i * stride];
+        Sint16 *output = &bank->output[i * stride];
+        __m128i sum = _mm_setzero_si128();
+        __m128i r = _mm_set1_epi16(ramp);
+        for (int v = 0; v < bank->mixStride; v += 8) {
+            __m128i f = _mm_loadu_si128((__m128i*)&filter[v]);
+            __m128i w = _mm_loadu_si128((__m128i*)&wave[v]);
+            __m128i m = _mm_loadu_si128((__m128i*)&bank->mean[v]);
+            __m128i g = _mm_add_epi16(_mm_loadu_si128((__m128i*)&gain[v]),
+                    _mm_mullo_epi16(_mm_loadu_si128((__m128i*)&gainStep[v]), r));
+            __m128i reduced = _mm_loadu_si128((__m128i*)&bank->reducedRate[v]);
+            __m128i filtered = _mm_add_epi16(
+                    _voicebank_div127Sse2(_mm_mullo_epi16(_mm_sub_epi16(c127, f), w)),
+                    _voicebank_div127Sse2(_mm_mullo_epi16(f, m)));
+            /* Reduced rate voices keep the state and output they already have */
+            m = _mm_or_si128(_mm_and_si128(reduced, m), _mm_andnot_si128(reduced, filtered));
+            _mm_storeu_si128((__m128i*)&bank->mean[v], m);
+            /* (m * g) >> 7 fits in 16 bits, assemble it from the two product halves */
+            __m128i out = _mm_or_si128(
+                    _mm_slli_epi16(_mm_mulhi_epi16(m, g), 16 - VOICEBANK_GAIN_SHIFT),
+                    _mm_srli_epi16(_mm_mullo_epi16(m, g), VOICEBANK_GAIN_SHIFT));
+            out = _mm_or_si128(_mm_and_si128(reduced, _mm_loadu_si128((__m128i*)&output[v])), _mm_andnot_si128(reduced, out));
+            _mm_storeu_si128((__m128i*)&output[v], out);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(out, ones));
+        }
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+        mixBuffer[i] = _mm_cvtsi128_si32(sum);
+    }
+}
+
+/*
+ * AVX2 implementation, 16 voices per instruction
+ */
+
+__attribute__((target("avx2")))
+static inline __m256i _voicebank_div127Avx2(__m256i x) {
+    __m256i quotient = _mm256_srai_epi16(_mm256_mulhi_epi16(x, _mm256_set1_epi16(VOICEBANK_DIV127_MAGIC)), 5);
+    return _mm256_add_epi16(quotient, _mm256_srli_epi16(x, 15));
+}
+
+__attribute__((target("avx2")))
+void _voicebank_advancePhaseAvx2(VoiceBank *bank, int length) {
+    int stride = bank->stride;
+    for (int v = 0; v < stride; v += 16) {
+        __m256i wavePos = _mm256_loadu_si256((__m256i*)&bank->wavePos[v]);
+        for (int i = 0; i < length; i++) {
+            _mm256_storeu_si256((__m256i*)&bank->phase[i * stride + v], wavePos);
+            wavePos = _mm256_add_epi16(wavePos, _mm256_loadu_si256((__m256i*)&bank->phaseStep[i * stride + v]));
+        }
+        _mm256_storeu_si256((__m256i*)&bank->wavePos[v], wavePos);
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i _voicebank_averageAvx2(__m256i a, __m256i b) {
+    __m256i offset = _mm256_set1_epi16(-32768);
+    return _mm256_xor_si256(_mm256_avg_epu16(_mm256_xor_si256(a, offset), _mm256_xor_si256(b, offset)), offset);
+}
+
+__attribute__((target("avx2")))
+void _voicebank_halfBandAvx2(VoiceBank *bank, int first, int end, int distance, const Sint16 *mask) {
+    int stride = bank->stride;
+    for (int i = first; i < end; i += 2 * distance) {
+        Sint16 *before = &bank->output[(i - 3 * distance) * stride];
+        Sint16 *previous = &bank->output[(i - distance) * stride];
+        Sint16 *next = &bank->output[(i + distance) * stride];
+        Sint16 *after = &bank->output[(i + 3 * distance) * stride];
+        Sint16 *output = &bank->output[i * stride];
+        for (int v = 0; v < bank->mixStride; v += 16) {
+            __m256i near = _voicebank_averageAvx2(_mm256_loadu_si256((__m256i*)&previous[v]), _mm256_loadu_si256((__m256i*)&next[v]));
+            __m256i far = _voicebank_averageAvx2(_mm256_loadu_si256((__m256i*)&before[v]), _mm256_loadu_si256((__m256i*)&after[v]));
+            __m256i value = _mm256_adds_epi16(near, _mm256_sub_epi16(_mm256_srai_epi16(near, 3), _mm256_srai_epi16(far, 3)));
+            value = _mm256_blendv_epi8(_mm256_loadu_si256((__m256i*)&output[v]), value, _mm256_loadu_si256((__m256i*)&mask[v]));
+            _mm256_storeu_si256((__m256i*)&output[v], value);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i _voicebank_filterRowAvx2(VoiceBank *bank, int v, int i, int subBlock, Sint16 ramp,
+        __m256i mask, __m256i quarter, __m256i m) {
+    int stride = bank->stride;
+    __m256i f = _mm256_loadu_si256((__m256i*)&bank->filter[subBlock * stride + v]);
+    __m256i f2 = _voicebank_div127Avx2(_mm256_mullo_epi16(f, f));
+    f = _mm256_blendv_epi8(f2, _voicebank_div127Avx2(_mm256_mullo_epi16(f2, f2)), quarter);
+    __m256i w = _mm256_loadu_si256((__m256i*)&bank->wave[i * stride + v]);
+    __m256i g = _mm256_add_epi16(_mm256_loadu_si256((__m256i*)&bank->gain[subBlock * stride + v]),
+            _mm256_mullo_epi16(_mm256_loadu_si256((__m256i*)&bank->gainStep[subBlock * stride + v]), _mm256_set1_epi16(ramp)));
+    __m256i filtered = _mm256_add_epi16(
+            _voicebank_div127Avx2(_mm256_mullo_epi16(_mm256_sub_epi16(_mm256_set1_epi16(127), f), w)),
+            _voicebank_div127Avx2(_mm256_mullo_epi16(f, m)));
+    m = _mm256_blendv_epi8(m, filtered, mask);
+    __m256i out = _mm256_or_si256(
+            _mm256_slli_epi16(_mm256_mulhi_epi16(m, g), 16 - VOICEBANK_GAIN_SHIFT),
+            _mm256_srli_epi16(_mm256_mullo_epi16(m, g), VOICEBANK_GAIN_SHIFT));
+    Sint16 *output = &bank->output[i * stride + v];
+    _mm256_storeu_si256((__m256i*)output, _mm256_blendv_epi8(_mm256_loadu_si256((__m256i*)output), out, mask));
+    return m;
+}
+
+__attribute__((target("avx2")))
+void _voicebank_filterReducedAvx2(VoiceBank *bank, int length) {
+    for (int v = 0; v < bank->mixStride; v += 16) {
+        __m256i half = _mm256_loadu_si256((__m256i*)&bank->reducedRate[v]);
+        __m256i quarter = _mm256_loadu_si256((__m256i*)&bank->reducedRate[bank->capacity + v]);
+        __m256i halfOnly = _mm256_andnot_si256(quarter, half);
+        if (_mm256_testz_si256(half, half)) {
+            continue;
+        }
+        int step = _mm256_testz_si256(halfOnly, halfOnly) ? 4 : 2;
+        int i = (step - bank->clock % step) % step;
+        int subBlock = 0;
+        int subBlockEnd = bank->subBlockSize;
+        __m256i m = _mm256_loadu_si256((__m256i*)&bank->mean[v]);
+        for (; i < length; i += step) {
+            while (i >= subBlockEnd) {
+                subBlock++;
+                subBlockEnd += bank->subBlockSize;
+            }
+            __m256i mask = (bank->clock + i) & 2 ? halfOnly : half;
+            m = _voicebank_filterRowAvx2(bank, v, i, subBlock, i - subBlockEnd + bank->subBlockSize, mask, quarter, m);
+        }
+        _mm256_storeu_si256((__m256i*)&bank->mean[v], m);
+        subBlock = (length - 1) / bank->subBlockSize;
+        for (; i < length + VOICEBANK_LOOKAHEAD; i += step) {
+            __m256i mask = (bank->clock + i) & 2 ? halfOnly : half;
+            m = _voicebank_filterRowAvx2(bank, v, i, subBlock, length - 1 - subBlock * bank->subBlockSize, mask, quarter, m);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+void _voicebank_mixAvx2(VoiceBank *bank, Sint32 *mixBuffer, int length) {
+    int stride = bank->stride;
+    __m256i c127 = _mm256_set1_epi16(127);
+    __m256i ones = _mm256_set1_epi16(1);
+    int subBlock = 0;
+    int subBlockEnd = bank->subBlockSize;
+    for (int i = 0; i < length; i++) {
+        if (i == subBlockEnd) {
+            subBlock++;
+            subBlockEnd += bank->subBlockSize;
+        }
+        Sint16 *filter = &bank->filter[subBlock * stride];
+        Sint16 *gain = &bank->gain[subBlock * stride];
+        Sint16 *gainStep = &bank->gainStep[subBlock * stride];
+        Sint16 ramp = i - subBlockEnd + bank->subBlockSize;
+        Sint16 *wave = &bank->wave[i * stride];
+        Sint16 *output = &bank->output[i * stride];
+        __m256i sum = _mm256_setzero_si256();
+        __m256i r = _mm256_set1_epi16(ramp);
+        for (int v = 0; v < bank->mixStride; v += 16) {
+            __m256i f = _mm256_loadu_si256((__m256i*)&filter[v]);
+            __m256i w = _mm256_loadu_si256((__m256i*)&wave[v]);
+            __m256i m = _mm256_loadu_si256((__m256i*)&bank->mean[v]);
+            __m256i g = _mm256_add_epi16(_mm256_loadu_si256((__m256i*)&gain[v]),
+                    _mm256_mullo_epi16(_mm256_loadu_si256((__m256i*)&gainStep[v]), r));
+            __m256i reduced = _mm256_loadu_si256((__m256i*)&bank->reducedRate[v]);
+            __m256i filtered = _mm256_add_epi16(
+                    _voicebank_div127Avx2(_mm256_mullo_epi16(_mm256_sub_epi16(c127, f), w)),
+                    _voicebank_div127Avx2(_mm256_mullo_epi16(f, m)));
+            m = _mm256_blendv_epi8(filtered, m, reduced);
+            _mm256_storeu_si256((__m256i*)&bank->mean[v], m);
+            __m256i out = _mm256_or_si256(
+                    _mm256_slli_epi16(_mm256_mulhi_epi16(m, g), 16 - VOICEBANK_GAIN_SHIFT),
+                    _mm256_srli_epi16(_mm256_mullo_epi16(m, g), VOICEBANK_GAIN_SHIFT));
+            out = _mm256_blendv_epi8(out, _mm256_loadu_si256((__m256i*)&output[v]), reduced);
+            _mm256_storeu_si256((__m256i*)&output[v], out);
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(out, ones));
+        }
+        __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+        half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+        half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+        mixBuffer[i] = _mm_cvtsi128_si32(half);
+    }
+}
+
+#endif /* VOICEBANK_X86 */
+
+/*
+ * Reduced rate voices, shared by all implementations
+ */
+
+/**
+ * Filter and amplify the reduced rate voices and upsample them into
+ * output[]. Voices at 1/4 rate are first filled in half way between their
+ * rows, three rows into the look-ahead for the second stage, then all
+ * reduced rate voices on the odd rows.
+ */
+void _voicebank_mixReduced(VoiceBank *bank, int length) {
+    Uint8 maxShift = 0;
+    for (int v = 0; v < bank->mixStride; v++) {
+        maxShift = bank->rateShift[v] > maxShift ? bank->rateShift[v] : maxShift;
+    }
+    if (maxShift > 0) {
+        bank->filterReducedFunc(bank, length);
+    }
+    if (maxShift > 1) {
+        bank->halfBandFunc(bank, (6 - bank->clock % 4) % 4, length + 3, 2, &bank->reducedRate[bank->capacity]);
+    }
+    if (maxShift > 0) {
+        bank->halfBandFunc(bank, (bank->clock + 1) % 2, length, 1, bank->reducedRate);
+    }
+}
+
+bool voicebank_selectImplementation(VoiceBank *bank, const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        bank->advancePhaseFunc = _voicebank_advancePhaseScalar;
+        bank->mixFunc = _voicebank_mixScalar;
+        bank->filterReducedFunc = _voicebank_filterReducedScalar;
+        bank->halfBandFunc = _voicebank_halfBandScalar;
+        bank->implementation = "scalar";
+        return true;
+    }
+#ifdef VOICEBANK_X86
+    if (strcmp(name, "sse2") == 0 && SDL_HasSSE2()) {
+        bank->advancePhaseFunc = _voicebank_advancePhaseSse2;
+        bank->mixFunc = _voicebank_mixSse2;
+        bank->filterReducedFunc = _voicebank_filterReducedSse2;
+        bank->halfBandFunc = _voicebank_halfBandSse2;
+        bank->implementation = "sse2";
+        return true;
+    }
+    if (strcmp(name, "avx2") == 0 && SDL_HasAVX2()) {
+        bank->advancePhaseFunc = _voicebank_advancePhaseAvx2;
+        bank->mixFunc = _voicebank_mixAvx2;
+        bank->filterReducedFunc = _voicebank_filterReducedAvx2;
+        bank->halfBandFunc = _voicebank_halfBandAvx2;
+        bank->implementation = "avx2";
+        return true;
+    }
+#endif
+    return false;
+}
+
+int _voicebank_roundToLanes(int voices) {
+    return (voices + VOICEBANK_LANES - 1) / VOICEBANK_LANES * VOICEBANK_LANES;
+}
+
+VoiceBank *voicebank_init(int voices, int blockSize, int subBlockSize) {
+    VoiceBank *bank = calloc(1, sizeof(VoiceBank));
+    bank->voices = voices;
+    bank->capacity = _voicebank_roundToLanes(voices);
+    bank->stride = bank->capacity;
+    bank->mixStride = bank->capacity;
+    bank->blockSize = blockSize;
+    bank->subBlockSize = subBlockSize;
+
+    int stride = bank->capacity;
+    int subBlocks = (blockSize + subBlockSize - 1) / subBlockSize;
+    bank->wavePos = calloc(stride, sizeof(Uint16));
+    bank->mean = calloc(stride, sizeof(Sint16));
+    bank->phaseStep = calloc(blockSize * stride, sizeof(Uint16));
+    bank->phase = calloc((blockSize + VOICEBANK_LOOKAHEAD) * stride, sizeof(Uint16));
+    bank->wave = calloc((blockSize + VOICEBANK_LOOKAHEAD) * stride, sizeof(Sint16));
+    /* Row 0 of output follows the history rows */
+    bank->output = calloc((VOICEBANK_HISTORY + blockSize + VOICEBANK_LOOKAHEAD) * stride, sizeof(Sint16));
+    bank->output += VOICEBANK_HISTORY * stride;
+    bank->filter = calloc(subBlocks * stride, sizeof(Sint16));
+    bank->gain = calloc(subBlocks * stride, sizeof(Sint16));
+    bank->gainStep = calloc(subBlocks * stride, sizeof(Sint16));
+    bank->rateShift = calloc(stride, sizeof(Uint8));
+    bank->reducedRate = calloc(VOICEBANK_MAX_RATE_SHIFT * stride, sizeof(Sint16));
+    bank->floatMean = calloc(stride, sizeof(float));
+    bank->floatOutput = calloc(blockSize * stride, sizeof(float));
+    bank->floatFilter = calloc(stride, sizeof(float));
+    bank->floatGain = calloc(stride, sizeof(float));
+    bank->floatGainStep = calloc(stride, sizeof(float));
+
+    if (!voicebank_selectImplementation(bank, "avx2") && !voicebank_selectImplementation(bank, "sse2")) {
+        voicebank_selectImplementation(bank, "scalar");
+    }
+    return bank;
+}
+
+void voicebank_close(VoiceBank *bank) {
+    if (bank != NULL) {
+        free(bank->wavePos);
+        free(bank->mean);
+        free(bank->phaseStep);
+        free(bank->phase);
+        free(bank->wave);
+        free(bank->output - VOICEBANK_HISTORY * bank->capacity);
+        free(bank->filter);
+        free(bank->gain);
+        free(bank->gainStep);
+        free(bank->rateShift);
+        free(bank->reducedRate);
+        free(bank->floatMean);
+        free(bank->floatOutput);
+        free(bank->floatFilter);
+        free(bank->floatGain);
+        free(bank->floatGainStep);
+        free(bank);
+        bank = NULL;
+    }
+}
+
+void voicebank_setActiveVoices(VoiceBank *bank, int activeVoices, int audibleVoices) {
+    int subBlocks = (bank->blockSize + bank->subBlockSize - 1) / bank->subBlockSize;
+    bank->stride = _voicebank_roundToLanes(activeVoices);
+    bank->mixStride = _voicebank_roundToLanes(audibleVoices);
+
+    /* A filter of 127 holds the zero mean, so padding lanes output silence */
+    for (int v = activeVoices; v < bank->stride; v++) {
+        bank->wavePos[v] = 0;
+        bank->mean[v] = 0;
+        bank->floatMean[v] = 0;
+        for (int i = 0; i < subBlocks; i++) {
+            bank->filter[i * bank->stride + v] = 127;
+            bank->gain[i * bank->stride + v] = 0;
+            bank->gainStep[i * bank->stride + v] = 0;
+        }
+    }
+    for (int v = 0; v < bank->capacity; v++) {
+        voicebank_setRateShift(bank, v, 0);
+    }
+}
+
+void voicebank_setRateShift(VoiceBank *bank, int voice, Uint8 rateShift) {
+    bank->rateShift[voice] = rateShift;
+    for (int i = 0; i < VOICEBANK_MAX_RATE_SHIFT; i++) {
+        bank->reducedRate[i * bank->capacity + voice] = rateShift > i ? -1 : 0;
+    }
+}
+
+void voicebank_advancePhase(VoiceBank *bank, int length) {
+    int stride = bank->stride;
+    bank->advancePhaseFunc(bank, length);
+    for (int v = 0; v < bank->mixStride; v++) {
+        if (bank->rateShift[v] > 0) {
+            Uint16 wavePos = bank->wavePos[v];
+            Uint16 phaseStep = bank->phaseStep[(length - 1) * stride + v];
+            for (int i = length; i < length + VOICEBANK_LOOKAHEAD; i++) {
+                bank->phase[i * stride + v] = wavePos;
+                wavePos += phaseStep;
+            }
+        }
+    }
+}
+
+void voicebank_mix(VoiceBank *bank, Sint32 *mixBuffer, int length) {
+    _voicebank_mixReduced(bank, length);
+    bank->mixFunc(bank, mixBuffer, length);
+    /* Keep the end of the block for the upsampler, the rows may overlap when the block is short */
+    memmove(&bank->output[-VOICEBANK_HISTORY * bank->stride], &bank->output[(length - VOICEBANK_HISTORY) * bank->stride],
+            VOICEBANK_HISTORY * bank->stride * sizeof(Sint16));
+    bank->clock += length;
+}
+
+void voicebank_mixFloat(VoiceBank *bank, float *mixBuffer, int length) {
+    int stride = bank->stride;
+    int mixStride = bank->mixStride;
+    float *restrict mean = bank->floatMean;
+    float *restrict filter = bank->floatFilter;
+    float *restrict gain = bank->floatGain;
+    float *restrict gainStep = bank->floatGainStep;
+
+    for (int pos = 0; pos < length; pos += bank->subBlockSize) {
+        int end = pos + bank->subBlockSize < length ? pos + bank->subBlockSize : length;
+        const Sint16 *restrict filterRow = &bank->filter[(pos / bank->subBlockSize) * stride];
+        const Sint16 *restrict gainRow = &bank->gain[(pos / bank->subBlockSize) * stride];
+        const Sint16 *restrict gainStepRow = &bank->gainStep[(pos / bank->subBlockSize) * stride];
+        for (int v = 0; v < mixStride; v++) {
+            filter[v] = filterRow[v] * (1.0f / 127);
+            gain[v] = gainRow[v] * (1.0f / VOICEBANK_UNITY_GAIN);
+            gainStep[v] = gainStepRow[v] * (1.0f / VOICEBANK_UNITY_GAIN);
+        }
+        for (int i = pos; i < end; i++) {
+            const Sint16 *restrict wave = &bank->wave[i * stride];
+            float *restrict output = &bank->floatOutput[i * stride];
+            float ramp = i - pos;
+            float sum[VOICEBANK_LANES] = {0};
+            for (int v = 0; v < mixStride; v += VOICEBANK_LANES) {
+                for (int l = 0; l < VOICEBANK_LANES; l++) {
+                    float w = wave[v + l];
+                    float m = w + (mean[v + l] - w) * filter[v + l];
+                    mean[v + l] = m;
+                    output[v + l] = m * (gain[v + l] + gainStep[v + l] * ramp);
+                    sum[l] += output[v + l];
+                }
+            }
+            float total = 0;
+            for (int l = 0; l < VOICEBANK_LANES; l++) {
+                total += sum[l];
+            }
+            mixBuffer[i] = total;
+        }
+    }
+    bank->clock += length;
+}
+
+/*
+ * Tests
+ */
+
+void _voicebank_testFill(VoiceBank *bank, Uint32 seed) {
+    int subBlocks = (bank->blockSize + bank->subBlockSize - 1) / bank->subBlockSize;
+    for (int i = 0; i < bank->blockSize * bank->stride; i++) {
+        seed = seed * 1664525 + 1013904223;
+        bank->phaseStep[i] = seed >> 16;
+        bank->wave[i] = (Sint8)(seed >> 8);
+    }
+    for (int i = 0; i < subBlocks * bank->stride; i++) {
+        seed = seed * 1664525 + 1013904223;
+        bank->filter[i] = (seed >> 8) % 128;
+        bank->gain[i] = (seed >> 12) % 32513;
+        Sint16 end = (seed >> 3) % 32513;
+        bank->gainStep[i] = (end - bank->gain[i]) / bank->subBlockSize;
+    }
+    for (int v = 0; v < bank->stride; v++) {
+        bank->wavePos[v] = v * 4099;
+        bank->mean[v] = (Sint8)(v * 37);
+    }
+}
+
+Uint32 _voicebank_testChecksum(VoiceBank *bank, Sint32 *mixBuffer) {
+    Uint32 checksum = 0;
+    for (int i = 0; i < bank->blockSize * bank->stride; i++) {
+        checksum = checksum * 31 + bank->phase[i] + (Uint16)bank->output[i];
+    }
+    for (int i = 0; i < bank->blockSize; i++) {
+        checksum = checksum * 31 + mixBuffer[i];
+    }
+    return checksum;
+}
+
+void voicebank_test() {
+    const char *implementations[] = {"scalar", "sse2", "avx2"};
+    int voiceCounts[] = {4, 16, 32, 64};
+    int blockSize = 256;
+    int iterations = 2000;
+    Sint32 mixBuffer[256];
+
+    printf("======================TEST OF VOICE BANK========================\n");
+    for (int c = 0; c < 4; c++) {
+        Uint32 reference = 0;
+        for (int n = 0; n < 3; n++) {
+            VoiceBank *bank = voicebank_init(voiceCounts[c], blockSize, 16);
+            if (!voicebank_selectImplementation(bank, implementations[n])) {
+                printf("%2d voices %-6s: not supported\n", voiceCounts[c], implementations[n]);
+                voicebank_close(bank);
+                continue;
+            }
+            _voicebank_testFill(bank, voiceCounts[c]);
+            Uint64 start = SDL_GetPerformanceCounter();
+            for (int i = 0; i < iterations; i++) {
+                voicebank_advancePhase(bank, blockSize);
+                voicebank_mix(bank, mixBuffer, blockSize);
+            }
+            Uint64 ticks = SDL_GetPerformanceCounter() - start;
+            _voicebank_testFill(bank, voiceCounts[c]);
+            /* The full rate pass must leave the output of reduced rate voices alone */
+            for (int v = 0; v < voiceCounts[c]; v++) {
+                voicebank_setRateShift(bank, v, v % (VOICEBANK_MAX_RATE_SHIFT + 1));
+            }
+            voicebank_advancePhase(bank, blockSize);
+            voicebank_mix(bank, mixBuffer, blockSize);
+            Uint32 checksum = _voicebank_testChecksum(bank, mixBuffer);
+            if (n == 0) {
+                reference = checksum;
+            }
+            double nsPerSample = 1e9 * ticks / SDL_GetPerformanceFrequency() / ((double)iterations * blockSize);
+            printf("%2d voices %-6s: %6.2f ns/sample checksum %08x %s\n",
+                    voiceCounts[c], implementations[n], nsPerSample, checksum,
+                    checksum == reference ? "OK" : "MISMATCH");
+            voicebank_close(bank);
+        }
+    }
+}
@@ -0,0 +1,177 @@
+#ifndef VOICEBANK_H_
+#define VOICEBANK_H_
+
+#include <stdbool.h>
+#include <SDL2/SDL.h>
+
+/**
+ * Voices are padded to a multiple of this value so that the widest SIMD
+ * implementation never needs a remainder loop
+ */
+#define VOICEBANK_LANES 16
+
+/** Voices can be filtered and amplified at down to 1/2^VOICEBANK_MAX_RATE_SHIFT of the sample rate */
+#define VOICEBANK_MAX_RATE_SHIFT 2
+
+/**
+ * The upsampler of reduced rate voices reads this many output rows before
+ * the block, which hold the end of the previous block, and this many phase,
+ * wave and output rows past the block end
+ */
+#define VOICEBANK_HISTORY 6
+#define VOICEBANK_LOOKAHEAD 9
+
+typedef struct _VoiceBank VoiceBank;
+
+typedef void (*VoiceBankPhaseFunc)(VoiceBank *bank, int length);
+
+typedef void (*VoiceBankMixFunc)(VoiceBank *bank, Sint32 *mixBuffer, int length);
+
+typedef void (*VoiceBankFilterFunc)(VoiceBank *bank, int length);
+
+typedef void (*VoiceBankHalfBandFunc)(VoiceBank *bank, int first, int end, int distance, const Sint16 *mask);
+
+/**
+ * Structure of arrays holding the per sample state of all voices.
+ *
+ * Per voice arrays hold one entry per voice. Per sample arrays are stored
+ * sample by sample with stride entries each, so the same field of
+ * consecutive voices is adjacent in memory and can be processed by a single
+ * SIMD instruction. Per sub-block arrays hold control rate values in the
+ * same layout, one row for every subBlockSize samples.
+ *
+ * Only the first activeVoices entries, called lanes, are processed. The
+ * caller decides which voice occupies which lane for each block.
+ *
+ * Voices with a rate shift are filtered and amplified only on the rows where
+ * the clock is a multiple of 2^rateShift, so the rows of all voices at the
+ * same rate line up, and the rows between are filled in with the
+ * [-1, 9, 9, -1] / 16 half-band filter.
+ */
+typedef struct _VoiceBank {
+    int voices;
+    /** voices rounded up to VOICEBANK_LANES, the allocated width */
+    int capacity;
+    /** Lanes advanced by voicebank_advancePhase(), rounded up to VOICEBANK_LANES */
+    int stride;
+    /** Lanes mixed by voicebank_mix(), rounded up to VOICEBANK_LANES */
+    int mixStride;
+    int blockSize;
+    int subBlockSize;
+    /** Samples mixed since init */
+    Uint32 clock;
+
+    /** Per voice phase accumulator */
+    Uint16 *wavePos;
+    /** Per voice lowpass filter state, -128..127 */
+    Sint16 *mean;
+
+    /** Per sample phase increment, written by the control pass */
+    Uint16 *phaseStep;
+    /** Per sample phase, written by voicebank_advancePhase(), look-ahead rows included */
+    Uint16 *phase;
+    /** Per sample unfiltered oscillator output, -128..127, look-ahead rows included */
+    Sint16 *wave;
+    /**
+     * Per sample filtered and amplified voice output, written by
+     * voicebank_mix(). Rows -VOICEBANK_HISTORY..-1 hold the last samples of
+     * the previous block.
+     */
+    Sint16 *output;
+
+    /** Per sub-block lowpass filter value, 0 = no filter, 127 = hold current value */
+    Sint16 *filter;
+    /** Per sub-block gain, VOICEBANK_UNITY_GAIN = output equals filtered wave */
+    Sint16 *gain;
+    /**
+     * Per sub-block gain change per sample, the n:th sample of a sub-block
+     * is amplified by gain + n * gainStep which must stay within 0..32767
+     */
+    Sint16 *gainStep;
+
+    /** Per voice rate shift, the voice is filtered and amplified at 1/2^rateShift of the sample rate */
+    Uint8 *rateShift;
+    /**
+     * Per voice masks of the rate shift, VOICEBANK_MAX_RATE_SHIFT rows. Row
+     * n is -1 for the voices whose rate shift is above n and 0 for others.
+     */
+    Sint16 *reducedRate;
+
+    /** Per voice lowpass filter state of voicebank_mixFloat() */
+    float *floatMean;
+    /** Per sample filtered and amplified voice output, written by voicebank_mixFloat() */
+    float *floatOutput;
+    /** Filter and gain of the current sub-block converted to float */
+    float *floatFilter;
+    float *floatGain;
+    float *floatGainStep;
+
+    VoiceBankPhaseFunc advancePhaseFunc;
+    VoiceBankMixFunc mixFunc;
+    VoiceBankFilterFunc filterReducedFunc;
+    VoiceBankHalfBandFunc halfBandFunc;
+    const char *implementation;
+} VoiceBank;
+
+/** Gain value which leaves the filtered wave value unchanged */
+#define VOICEBANK_UNITY_GAIN 128
+
+/**
+ * Allocate a voice bank and select the fastest implementation supported by
+ * the CPU
+ */
+VoiceBank *voicebank_init(int voices, int blockSize, int subBlockSize);
+
+void voicebank_close(VoiceBank *bank);
+
+/**
+ * Set the number of lanes to process from the next block on. The first
+ * audibleVoices lanes are mixed, the phase of all activeVoices lanes is
+ * advanced. Padding lanes are made silent. All voices are active after
+ * voicebank_init().
+ */
+void voicebank_setActiveVoices(VoiceBank *bank, int activeVoices, int audibleVoices);
+
+/**
+ * Filter and amplify a voice at 1/2^rateShift of the sample rate in the
+ * next block. Its wave is then only read on the rows where the clock is a
+ * multiple of 2^rateShift, up to VOICEBANK_LOOKAHEAD rows past the block.
+ * voicebank_setActiveVoices() sets all voices back to the full rate.
+ */
+void voicebank_setRateShift(VoiceBank *bank, int voice, Uint8 rateShift);
+
+/**
+ * Select implementation by name ("scalar", "sse2" or "avx2"). Returns false
+ * and keeps the current implementation if it is not supported.
+ */
+bool voicebank_selectImplementation(VoiceBank *bank, const char *name);
+
+/**
+ * Store the current phase of each voice for length samples into phase[],
+ * advancing the phase accumulators by phaseStep[]. The look-ahead rows of
+ * reduced rate voices continue with the last phase increment.
+ */
+void voicebank_advancePhase(VoiceBank *bank, int length);
+
+/**
+ * Filter and amplify wave[] into output[] and store the sum of all voices
+ * for each sample into mixBuffer. Reduced rate voices are filtered and
+ * amplified on their rows and upsampled first, once per voice.
+ */
+void voicebank_mix(VoiceBank *bank, Sint32 *mixBuffer, int length);
+
+/**
+ * Floating point variant of voicebank_mix() using floatMean and floatOutput
+ * instead of mean and output. Written in plain C for the compiler to
+ * vectorize, the sum is kept per lane so that no reordering of float
+ * additions is needed. All voices are mixed at the full rate.
+ */
+void voicebank_mixFloat(VoiceBank *bank, float *mixBuffer, int length);
+
+/**
+ * Verify that all implementations supported by the CPU produce identical
+ * output and print their relative speed for a number of voice counts
+ */
+void voicebank_test();
+
+#endif /* VOICEBANK_H_ */
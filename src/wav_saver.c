@@ -4,7 +4,8 @@
 #include "wav_saver.h"
 
 #define WAV_NUMBER_OF_CHANNELS 1
-#define WAV_BYTES_PER_SAMPLE 2
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_IEEE_FLOAT 3
 
 typedef struct _WavSaver {
     char *rawName;
@@ -12,6 +13,7 @@ typedef struct _WavSaver {
     FILE *rawFile;
     Uint32 dataLength;
     Uint32 sampleRate;
+    bool floatSamples;
 } WavSaver;
 
 typedef struct {
@@ -32,39 +34,72 @@ typedef struct {
 typedef struct {
     WavChunkHeader header;
     char format[4];
-    FmtChunk fmt;
-    WavChunkHeader data;
-} WavHeader;
+} RiffHeader;
+
+/* Sample frames in the file, required for formats other than PCM */
+typedef struct {
+    WavChunkHeader header;
+    Uint32 sampleLength;
+} FactChunk;
 
 
 void _wavSaver_writeHeader(WavSaver *wavSaver, FILE *file) {
-    WavHeader wavHeader;
+    RiffHeader riffHeader;
+    FmtChunk fmt;
+    /* Size of the fmt extension, non-PCM formats have one even if it is empty */
+    Uint16 extensionSize = 0;
+    FactChunk fact;
+    WavChunkHeader data;
 
-    memset(&wavHeader, 0, sizeof(WavHeader));
+    memset(&riffHeader, 0, sizeof(RiffHeader));
+    memset(&fmt, 0, sizeof(FmtChunk));
+    memset(&fact, 0, sizeof(FactChunk));
+    memset(&data, 0, sizeof(WavChunkHeader));
 
-    memcpy(wavHeader.header.id, "RIFF", 4);
-    wavHeader.header.size = wavSaver->dataLength + sizeof(WavHeader) - 8;
-    memcpy(wavHeader.format, "WAVE", 4);
+    int bytesPerSample = wavSaver->floatSamples ? sizeof(float) : sizeof(Sint16);
+    int headerSize = sizeof(RiffHeader) + sizeof(FmtChunk) + sizeof(WavChunkHeader);
+    if (wavSaver->floatSamples) {
+        headerSize += sizeof(extensionSize) + sizeof(FactChunk);
+    }
+
+    memcpy(riffHeader.header.id, "RIFF", 4);
+    riffHeader.header.size = wavSaver->dataLength + headerSize - 8;
+    memcpy(riffHeader.format, "WAVE", 4);
 
     /* fmt subchunk */
-    memcpy(wavHeader.fmt.header.id, "fmt ", 4);
-    wavHeader.fmt.header.size = 16; /* 16 for PCM */
-    wavHeader.fmt.audioFormat = 1; /* Uncompressed PCM */
-
-    wavHeader.fmt.numChannels = WAV_NUMBER_OF_CHANNELS;
-    wavHeader.fmt.sampleRate = wavSaver->sampleRate;
-    wavHeader.fmt.byteRate = wavSaver->sampleRate * WAV_NUMBER_OF_CHANNELS * WAV_BYTES_PER_SAMPLE;
-    wavHeader.fmt.blockAlign = WAV_NUMBER_OF_CHANNELS * WAV_BYTES_PER_SAMPLE;
-    wavHeader.fmt.bitsPerSample = WAV_BYTES_PER_SAMPLE * 8;
-    memcpy(wavHeader.data.id, "data", 4);
-    wavHeader.data.size = wavSaver->dataLength;
-
-    fwrite(&wavHeader, 1, sizeof(WavHeader), file);
+    memcpy(fmt.header.id, "fmt ", 4);
+    fmt.header.size = sizeof(FmtChunk) - sizeof(WavChunkHeader); /* 16 for PCM */
+    if (wavSaver->floatSamples) {
+        fmt.header.size += sizeof(extensionSize); /* 18 with the empty extension */
+    }
+    fmt.audioFormat = wavSaver->floatSamples ? WAV_FORMAT_IEEE_FLOAT : WAV_FORMAT_PCM;
+    fmt.numChannels = WAV_NUMBER_OF_CHANNELS;
+    fmt.sampleRate = wavSaver->sampleRate;
+    fmt.byteRate = wavSaver->sampleRate * WAV_NUMBER_OF_CHANNELS * bytesPerSample;
+    fmt.blockAlign = WAV_NUMBER_OF_CHANNELS * bytesPerSample;
+    fmt.bitsPerSample = bytesPerSample * 8;
+
+    /* fact subchunk */
+    memcpy(fact.header.id, "fact", 4);
+    fact.header.size = sizeof(FactChunk) - sizeof(WavChunkHeader);
+    fact.sampleLength = wavSaver->dataLength / fmt.blockAlign;
+
+    memcpy(data.id, "data", 4);
+    data.size = wavSaver->dataLength;
+
+    fwrite(&riffHeader, 1, sizeof(RiffHeader), file);
+    fwrite(&fmt, 1, sizeof(FmtChunk), file);
+    if (wavSaver->floatSamples) {
+        fwrite(&extensionSize, 1, sizeof(extensionSize), file);
+        fwrite(&fact, 1, sizeof(FactChunk), file);
+    }
+    fwrite(&data, 1, sizeof(WavChunkHeader), file);
 }
 
-WavSaver *wavSaver_init(char *fileName, Uint32 sampleRate) {
+WavSaver *wavSaver_init(char *fileName, Uint32 sampleRate, bool floatSamples) {
     WavSaver *wavSaver = calloc(1, sizeof(WavSaver));
     wavSaver->sampleRate = sampleRate;
+    wavSaver->floatSamples = floatSamples;
 
     wavSaver->wavName = calloc(strlen(fileName)+1, sizeof(char));
     strcpy(wavSaver->wavName, fileName);
@@ -88,6 +123,11 @@ void wavSaver_consume(WavSaver *wavSaver, Sint16 *samples, int length) {
     fwrite(samples, sizeof(Sint16), length, wavSaver->rawFile);
 }
 
+void wavSaver_consumeFloat(WavSaver *wavSaver, float *samples, int length) {
+    wavSaver->dataLength += length * sizeof(float);
+    fwrite(samples, sizeof(float), length, wavSaver->rawFile);
+}
+
 void _wavSaver_free(void **ptr) {
     if (*ptr != NULL) {
         free(*ptr);
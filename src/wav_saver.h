@@ -1,14 +1,22 @@
 #ifndef WAV_SAVER_H_
 #define WAV_SAVER_H_
 
+#include <stdbool.h>
 #include <SDL2/SDL.h>
 
 typedef struct _WavSaver WavSaver;
 
-WavSaver *wavSaver_init(char *filename, Uint32 sampleRate);
+/**
+ * Create a mono WAV file of 16 bit integer samples, or of 32 bit float
+ * samples when floatSamples is set
+ */
+WavSaver *wavSaver_init(char *filename, Uint32 sampleRate, bool floatSamples);
 
 void wavSaver_consume(WavSaver *wavSaver, Sint16 *samples, int length);
 
+/** Consume samples of a WAV file created with floatSamples set */
+void wavSaver_consumeFloat(WavSaver *wavSaver, float *samples, int length);
+
 void wavSaver_close(WavSaver *wavSaver);
 
 #endif /* WAV_SAVER_H_ */
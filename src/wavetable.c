@@ -0,0 +1,72 @@
+#include <math.h>
+#include <string.h>
+
+#include "wavetable.h"
+
+/*
+ * The highest harmonic a 256 sample table can hold is 128. At a phase step of
+ * 256 per sample the 128th harmonic lands exactly on half the sample rate,
+ * so level n, which keeps 128 >> n harmonics, is alias free up to a phase
+ * step of 256 << n.
+ */
+#define WAVETABLE_HARMONICS (WAVETABLE_SIZE / 2)
+#define WAVETABLE_LEVEL_0_MAX_STEP 256
+/** Harmonics 50 dB below the strongest are not counted, about the level of the 8 bit quantization noise */
+#define WAVETABLE_HARMONIC_FLOOR 0.003
+
+void wavetable_createBandLimited(Wavetable *wavetable, Sint8 *source) {
+    double re[WAVETABLE_HARMONICS + 1];
+    double im[WAVETABLE_HARMONICS + 1];
+    double strongest = 0;
+    int highest = 1;
+
+    for (int k = 0; k <= WAVETABLE_HARMONICS; k++) {
+        re[k] = 0;
+        im[k] = 0;
+        for (int i = 0; i < WAVETABLE_SIZE; i++) {
+            double angle = 2 * M_PI * k * i / WAVETABLE_SIZE;
+            re[k] += source[i] * cos(angle);
+            im[k] -= source[i] * sin(angle);
+        }
+        if (k > 0 && re[k] * re[k] + im[k] * im[k] > strongest) {
+            strongest = re[k] * re[k] + im[k] * im[k];
+        }
+    }
+    for (int k = 1; k <= WAVETABLE_HARMONICS; k++) {
+        if (re[k] * re[k] + im[k] * im[k] >= strongest * WAVETABLE_HARMONIC_FLOOR * WAVETABLE_HARMONIC_FLOOR) {
+            highest = k;
+        }
+    }
+
+    memcpy(wavetable->levels[0], source, WAVETABLE_SIZE);
+    wavetable->harmonics[0] = highest;
+
+    for (int level = 1; level < WAVETABLE_LEVELS; level++) {
+        int harmonics = WAVETABLE_HARMONICS >> level;
+        wavetable->harmonics[level] = harmonics < highest ? harmonics : highest;
+        for (int i = 0; i < WAVETABLE_SIZE; i++) {
+            double value = re[0] / WAVETABLE_SIZE;
+            for (int k = 1; k <= harmonics; k++) {
+                /* Lanczos sigma factor to keep the Gibbs overshoot small */
+                double sigma = k == 1 ? 1 : sin(M_PI * k / (harmonics + 1)) / (M_PI * k / (harmonics + 1));
+                double angle = 2 * M_PI * k * i / WAVETABLE_SIZE;
+                value += 2 * sigma * (re[k] * cos(angle) - im[k] * sin(angle)) / WAVETABLE_SIZE;
+            }
+            value = round(value);
+            if (value > 127) {
+                value = 127;
+            } else if (value < -128) {
+                value = -128;
+            }
+            wavetable->levels[level][i] = value;
+        }
+    }
+}
+
+Uint8 wavetable_getLevel(Uint16 phaseStep) {
+    Uint8 level = 0;
+    while (level < WAVETABLE_LEVELS - 1 && phaseStep > (WAVETABLE_LEVEL_0_MAX_STEP << level)) {
+        level++;
+    }
+    return level;
+}
@@ -0,0 +1,33 @@
+#ifndef WAVETABLE_H_
+#define WAVETABLE_H_
+
+#include <SDL2/SDL.h>
+
+/** Number of samples in one waveform cycle, indexed with the upper 8 bits of the phase */
+#define WAVETABLE_SIZE 256
+
+/**
+ * Number of band limited copies of a waveform. Level 0 holds all harmonics
+ * the table can represent, each following level holds half as many.
+ */
+#define WAVETABLE_LEVELS 8
+
+typedef struct {
+    Sint8 levels[WAVETABLE_LEVELS][WAVETABLE_SIZE];
+    /** Highest harmonic of each level within 50 dB of the strongest one */
+    Uint8 harmonics[WAVETABLE_LEVELS];
+} Wavetable;
+
+/**
+ * Create the band limited levels of a wavetable and their harmonic counts
+ * from a single cycle of a waveform. Level 0 is an exact copy of the source.
+ */
+void wavetable_createBandLimited(Wavetable *wavetable, Sint8 *source);
+
+/**
+ * Return the level to use for a phase increment (1/65536 cycle per sample)
+ * so that no harmonic exceeds half the sample rate
+ */
+Uint8 wavetable_getLevel(Uint16 phaseStep);
+
+#endif /* WAVETABLE_H_ */
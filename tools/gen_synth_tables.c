@@ -0,0 +1,166 @@
+/*
+ * Generate the synth lookup tables declared in src/synth_tables.h as a C
+ * source file. Run by the build, usage: gen_synth_tables <output.c>
+ */
+#include <math.h>
+#include <stdio.h>
+
+#include "synth_tables.h"
+
+/*
+ * Function to create a byte in the waveform
+ */
+typedef Sint8 (*GenerateWaveformFunc)(Uint8 offset);
+
+static Sint16 sine[65536];
+static Sint16 carrier[65536];
+static Uint16 halfToDoubleModulation[65536];
+static Uint32 exp2Table[EXP2_TABLE_SIZE + 1];
+static Sint16 quarterSine[QUARTER_SINE_TABLE_SIZE + 2];
+static Uint32 compactExp2[COMPACT_EXP2_TABLE_SIZE + 1];
+static Sint16 compactCarrier[COMPACT_CARRIER_TABLE_SIZE + 1];
+static Wavetable lowpassSaw;
+static Wavetable lowpassPulse;
+
+Sint8 getSquareAmplitude(Uint8 offset) {
+    return (offset > 128) ? 127 : -128;
+}
+
+Sint8 getSawAmplitude(Uint8 offset) {
+    return 127-offset;
+}
+
+void createFilteredBuffer(GenerateWaveformFunc sampleFunc, Sint8* output, int filter) {
+    for (int i = 0; i < 256; i++) {
+        Sint16 value = 0;
+        if (filter == 0) {
+            value = sampleFunc(i);
+        } else {
+            for (int j = 0; j < filter; j++) {
+                value += sampleFunc((i+j)%256);
+            }
+            value /= filter;
+        }
+        output[i] = value;
+    }
+}
+
+void generateTables() {
+    Sint8 waveform[WAVETABLE_SIZE];
+
+    createFilteredBuffer(getSquareAmplitude, waveform, 8);
+    wavetable_createBandLimited(&lowpassPulse, waveform);
+    createFilteredBuffer(getSawAmplitude, waveform, 4);
+    wavetable_createBandLimited(&lowpassSaw, waveform);
+
+    for (int i = 0; i < 65536; i++) {
+        sine[i] = 32767 * sin((double)i/10430.3);
+    }
+    for (int i = 0; i < 65536; i++) {
+        Sint32 value = 0;
+        for (int j = 1; j < 12; j += 2) {
+            value += sine[(i * j) % 65536] / j;
+        }
+        carrier[i] = value;
+    }
+    for (int i = 0; i < 65536; i++) {
+        halfToDoubleModulation[i] = (double)16384 * pow(2, (double)(i-32768)/(double)32768);
+    }
+    for (int i = 0; i <= EXP2_TABLE_SIZE; i++) {
+        exp2Table[i] = (1 << EXP2_TABLE_SHIFT) * pow(2, (double)i/EXP2_TABLE_SIZE) + 0.5;
+    }
+
+    for (int i = 0; i <= QUARTER_SINE_TABLE_SIZE; i++) {
+        quarterSine[i] = round(32767 * sin(M_PI / 2 * i / QUARTER_SINE_TABLE_SIZE));
+    }
+    quarterSine[QUARTER_SINE_TABLE_SIZE + 1] = quarterSine[QUARTER_SINE_TABLE_SIZE - 1];
+    for (int i = 0; i <= COMPACT_EXP2_TABLE_SIZE; i++) {
+        compactExp2[i] = (1 << EXP2_TABLE_SHIFT) * pow(2, (double)i/COMPACT_EXP2_TABLE_SIZE) + 0.5;
+    }
+    for (int i = 0; i <= COMPACT_CARRIER_TABLE_SIZE; i++) {
+        double value = 0;
+        for (int j = 1; j < 12; j += 2) {
+            value += 32767 * sin(2 * M_PI * j * i / COMPACT_CARRIER_TABLE_SIZE) / j;
+        }
+        compactCarrier[i] = round(value);
+    }
+}
+
+void writeValues(FILE *f, const char *indent, long (*get)(const void*, int), const void *table, int length) {
+    for (int i = 0; i < length; i++) {
+        if (i % 16 == 0) {
+            fprintf(f, "%s", indent);
+        }
+        fprintf(f, "%ld,", get(table, i));
+        fprintf(f, i % 16 == 15 || i == length - 1 ? "\n" : " ");
+    }
+}
+
+long getSint16(const void *table, int i) {
+    return ((const Sint16*)table)[i];
+}
+
+long getUint16(const void *table, int i) {
+    return ((const Uint16*)table)[i];
+}
+
+long getUint32(const void *table, int i) {
+    return ((const Uint32*)table)[i];
+}
+
+long getSint8(const void *table, int i) {
+    return ((const Sint8*)table)[i];
+}
+
+long getUint8(const void *table, int i) {
+    return ((const Uint8*)table)[i];
+}
+
+void writeArray(FILE *f, const char *declaration, long (*get)(const void*, int), const void *table, int length) {
+    fprintf(f, "\n%s = {\n", declaration);
+    writeValues(f, "    ", get, table, length);
+    fprintf(f, "};\n");
+}
+
+void writeWavetable(FILE *f, const char *name, Wavetable *wavetable) {
+    fprintf(f, "\nconst Wavetable %s = {{\n", name);
+    for (int level = 0; level < WAVETABLE_LEVELS; level++) {
+        fprintf(f, "    {\n");
+        writeValues(f, "        ", getSint8, wavetable->levels[level], WAVETABLE_SIZE);
+        fprintf(f, "    },\n");
+    }
+    fprintf(f, "}, {\n");
+    writeValues(f, "    ", getUint8, wavetable->harmonics, WAVETABLE_LEVELS);
+    fprintf(f, "}};\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <output.c>\n", argv[0]);
+        return 1;
+    }
+    FILE *f = fopen(argv[1], "w");
+    if (f == NULL) {
+        fprintf(stderr, "Failed to open %s for writing\n", argv[1]);
+        return 1;
+    }
+    generateTables();
+
+    fprintf(f, "/* Generated by tools/gen_synth_tables.c, do not edit */\n");
+    fprintf(f, "#include \"synth_tables.h\"\n");
+    writeArray(f, "const Sint16 synthTables_sine[65536]", getSint16, sine, 65536);
+    writeArray(f, "const Sint16 synthTables_carrier[65536]", getSint16, carrier, 65536);
+    writeArray(f, "const Uint16 synthTables_halfToDoubleModulation[65536]", getUint16, halfToDoubleModulation, 65536);
+    writeArray(f, "const Uint32 synthTables_exp2[EXP2_TABLE_SIZE + 1]", getUint32, exp2Table, EXP2_TABLE_SIZE + 1);
+    writeArray(f, "const Sint16 synthTables_quarterSine[QUARTER_SINE_TABLE_SIZE + 2]", getSint16, quarterSine, QUARTER_SINE_TABLE_SIZE + 2);
+    writeArray(f, "const Uint32 synthTables_compactExp2[COMPACT_EXP2_TABLE_SIZE + 1]", getUint32, compactExp2, COMPACT_EXP2_TABLE_SIZE + 1);
+    writeArray(f, "const Sint16 synthTables_compactCarrier[COMPACT_CARRIER_TABLE_SIZE + 1]", getSint16, compactCarrier, COMPACT_CARRIER_TABLE_SIZE + 1);
+    writeWavetable(f, "synthTables_lowpassSaw", &lowpassSaw);
+    writeWavetable(f, "synthTables_lowpassPulse", &lowpassPulse);
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Failed to write %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}